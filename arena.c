@@ -0,0 +1,389 @@
+/*
+ * arena.c
+ *
+ * Arena memory manager for JPEG objects; see arena.h.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+
+#define HAVE_PROTOTYPES
+#include <jpeglib.h>
+#include <jerror.h>
+
+#include "arena.h"
+#pragma CHECKED_SCOPE on
+
+/* Every object is aligned to this, and sample rows are padded to twice it,
+ * exactly as libjpeg-turbo's own manager does: its SIMD routines rely on
+ * both.
+ */
+#define ARENA_ALIGN 32
+
+/* Normal size of an arena block.  Larger requests get a block of their own. */
+#define ARENA_BLOCK_SIZE (1 << 20)
+
+struct arena_block {
+  _Ptr<struct arena_block> next;
+  _Array_ptr<char> data : count(size);
+  size_t size;
+};
+
+struct arena_mgr {
+  struct jpeg_memory_mgr pub;	/* public fields */
+  _Ptr<struct jpeg_memory_mgr> orig;	/* the library's manager, for the rest */
+  /* Every block, in the order they are filled.  Blocks up to and including
+   * current are (partly) in use by this image; the rest are spare.
+   */
+  _Ptr<struct arena_block> head;
+  _Ptr<struct arena_block> current;	/* NULL if nothing is in use */
+  size_t used;			/* bytes of current handed out */
+  size_t reserved;		/* total size of all blocks */
+  /* Image memory in use, counting virtual arrays, and the most this image
+   * and the last one have used at once.
+   */
+  size_t in_use, peak, last_peak;
+};
+
+/* cinfo->mem really points to an arena_mgr struct, so coerce pointer */
+
+static _Ptr<struct arena_mgr>
+arena_of (j_common_ptr cinfo)
+{
+  return _Dynamic_bounds_cast<_Ptr<struct arena_mgr>>(cinfo->mem);
+}
+
+/*
+ * The library's manager finds its own state through cinfo->mem, so it must
+ * be put back there for as long as one of its methods runs.
+ */
+
+static _Ptr<struct jpeg_memory_mgr>
+use_orig (_Ptr<struct arena_mgr> mgr, j_common_ptr cinfo)
+{
+  /* The application may have changed the limits in our copy. */
+  mgr->orig->max_memory_to_use = mgr->pub.max_memory_to_use;
+  mgr->orig->max_alloc_chunk = mgr->pub.max_alloc_chunk;
+  cinfo->mem = mgr->orig;
+  return mgr->orig;
+}
+
+static void
+use_arena (_Ptr<struct arena_mgr> mgr, j_common_ptr cinfo)
+{
+  cinfo->mem = &mgr->pub;
+}
+
+
+/* Count n more bytes of image memory as in use. */
+
+static void
+count_use (_Ptr<struct arena_mgr> mgr, size_t n)
+{
+  mgr->in_use += n;
+  if (mgr->in_use > mgr->peak)
+    mgr->peak = mgr->in_use;
+}
+
+/* Allocate a block with room for size bytes.  Never returns NULL. */
+
+static _Ptr<struct arena_block>
+new_block (_Ptr<struct arena_mgr> mgr, j_common_ptr cinfo, size_t size)
+{
+  _Ptr<struct arena_block> block = malloc<struct arena_block>(sizeof(struct arena_block));
+  _Array_ptr<char> data : count(size) = ((void *)0);
+
+  if (block != NULL) {
+    _Unchecked {
+      void *mem = NULL;
+      if (posix_memalign(&mem, 2 * ARENA_ALIGN, size) == 0)
+        data = _Assume_bounds_cast<_Array_ptr<char>>(mem, count(size));
+    }
+  }
+  if (data == NULL) {
+    free<struct arena_block>(block);
+    ERREXIT1(cinfo, JERR_OUT_OF_MEMORY, 0);
+  }
+  block->next = ((void *)0);
+  block->data = data, block->size = size;
+  mgr->reserved += size;
+  return block;
+}
+
+/*
+ * Make a block with at least n free bytes current.  The first spare block
+ * that is big enough is moved up to follow the current one; failing that, a
+ * new block is made.
+ */
+
+static void
+next_block (_Ptr<struct arena_mgr> mgr, j_common_ptr cinfo, size_t n)
+{
+  _Ptr<_Ptr<struct arena_block>> link =
+    mgr->current != NULL ? &mgr->current->next : &mgr->head;
+  _Ptr<struct arena_block> block = ((void *)0);
+
+  for (_Ptr<_Ptr<struct arena_block>> p = link; *p != NULL; p = &(*p)->next) {
+    if ((*p)->size >= n) {
+      block = *p;
+      *p = block->next;
+      break;
+    }
+  }
+  if (block == NULL)
+    block = new_block(mgr, cinfo, n > ARENA_BLOCK_SIZE ? n : ARENA_BLOCK_SIZE);
+  block->next = *link;
+  *link = block;
+  mgr->current = block, mgr->used = 0;
+}
+
+/* Hand out n bytes of image memory.  Never returns NULL. */
+
+static _Array_ptr<char>
+arena_take (_Ptr<struct arena_mgr> mgr, j_common_ptr cinfo, size_t n) : count(n)
+{
+  if (n > SIZE_MAX - ARENA_ALIGN)
+    ERREXIT1(cinfo, JERR_OUT_OF_MEMORY, 1);
+  size_t size = (n + ARENA_ALIGN - 1) & ~(size_t) (ARENA_ALIGN - 1);
+
+  if (mgr->current == NULL || size > mgr->current->size - mgr->used)
+    next_block(mgr, cinfo, size);
+  _Array_ptr<char> p : count(n) =
+    _Dynamic_bounds_cast<_Array_ptr<char>>(mgr->current->data + mgr->used, count(n));
+  mgr->used += size;
+  count_use(mgr, size);
+  return p;
+}
+
+/* Everything handed out is free again; the blocks are kept. */
+
+static void
+arena_rewind (_Ptr<struct arena_mgr> mgr)
+{
+  mgr->current = ((void *)0), mgr->used = 0;
+  mgr->last_peak = mgr->peak;
+  mgr->in_use = 0, mgr->peak = 0;
+}
+
+
+/*
+ * The allocation methods.  They hand out unchecked pointers, which is what
+ * the library's interface calls for, so they are compiled outside the
+ * checked scope.
+ */
+#pragma CHECKED_SCOPE push
+#pragma CHECKED_SCOPE off
+
+static void *
+arena_alloc_small (j_common_ptr cinfo, int pool_id, size_t sizeofobject)
+{
+  _Ptr<struct arena_mgr> mgr = arena_of(cinfo);
+
+  if (pool_id != JPOOL_IMAGE) {
+    void *p = (*use_orig(mgr, cinfo)->alloc_small)(cinfo, pool_id, sizeofobject);
+    use_arena(mgr, cinfo);
+    return p;
+  }
+  return (void *) arena_take(mgr, cinfo, sizeofobject);
+}
+
+static void *
+arena_alloc_large (j_common_ptr cinfo, int pool_id, size_t sizeofobject)
+{
+  _Ptr<struct arena_mgr> mgr = arena_of(cinfo);
+
+  if (pool_id != JPOOL_IMAGE) {
+    void *p = (*use_orig(mgr, cinfo)->alloc_large)(cinfo, pool_id, sizeofobject);
+    use_arena(mgr, cinfo);
+    return p;
+  }
+  return (void *) arena_take(mgr, cinfo, sizeofobject);
+}
+
+static _Array_ptr<JSAMPROW>
+arena_alloc_sarray (j_common_ptr cinfo, int pool_id, JDIMENSION samplesperrow,
+                    JDIMENSION numrows) : count(numrows)
+{
+  _Ptr<struct arena_mgr> mgr = arena_of(cinfo);
+
+  if (pool_id != JPOOL_IMAGE) {
+    _Array_ptr<JSAMPROW> rows : count(numrows) =
+      (*use_orig(mgr, cinfo)->alloc_sarray)(cinfo, pool_id, samplesperrow, numrows);
+    use_arena(mgr, cinfo);
+    return rows;
+  }
+
+  size_t stride = ((size_t) samplesperrow * sizeof(JSAMPLE) + 2 * ARENA_ALIGN - 1) &
+                  ~(size_t) (2 * ARENA_ALIGN - 1);
+  if (numrows != 0 && stride > SIZE_MAX / numrows)
+    ERREXIT(cinfo, JERR_WIDTH_OVERFLOW);
+  JSAMPROW *rows = (JSAMPROW *) arena_take(mgr, cinfo, numrows * sizeof(JSAMPROW));
+  char *samples = (char *) arena_take(mgr, cinfo, stride * numrows);
+  for (JDIMENSION r = 0; r < numrows; r++)
+    rows[r] = (JSAMPLE *) (samples + r * stride);
+  return _Assume_bounds_cast<_Array_ptr<JSAMPROW>>(rows, count(numrows));
+}
+
+static _Ptr<JBLOCKROW>
+arena_alloc_barray (j_common_ptr cinfo, int pool_id, JDIMENSION blocksperrow,
+                    JDIMENSION numrows)
+{
+  _Ptr<struct arena_mgr> mgr = arena_of(cinfo);
+
+  if (pool_id != JPOOL_IMAGE) {
+    _Ptr<JBLOCKROW> rows =
+      (*use_orig(mgr, cinfo)->alloc_barray)(cinfo, pool_id, blocksperrow, numrows);
+    use_arena(mgr, cinfo);
+    return rows;
+  }
+
+  size_t stride = (size_t) blocksperrow * sizeof(JBLOCK);
+  if (numrows != 0 && stride > SIZE_MAX / numrows)
+    ERREXIT(cinfo, JERR_WIDTH_OVERFLOW);
+  JBLOCKROW *rows = (JBLOCKROW *) arena_take(mgr, cinfo, numrows * sizeof(JBLOCKROW));
+  char *blocks = (char *) arena_take(mgr, cinfo, stride * numrows);
+  for (JDIMENSION r = 0; r < numrows; r++)
+    rows[r] = (JBLOCK *) (blocks + r * stride);
+  return _Assume_bounds_cast<_Ptr<JBLOCKROW>>(rows);
+}
+
+#pragma CHECKED_SCOPE pop
+
+
+/*
+ * Virtual arrays are left to the library's manager, which also releases
+ * them with its own image pool.  We only count them, assuming (as with no
+ * memory limit) that they are realized whole in memory.
+ */
+
+static _Ptr<struct jvirt_sarray_control>
+arena_request_virt_sarray (j_common_ptr cinfo, int pool_id, boolean pre_zero,
+                           JDIMENSION samplesperrow, JDIMENSION numrows,
+                           JDIMENSION maxaccess)
+{
+  _Ptr<struct arena_mgr> mgr = arena_of(cinfo);
+  if (pool_id == JPOOL_IMAGE)
+    count_use(mgr, (size_t) samplesperrow * numrows * sizeof(JSAMPLE));
+  _Ptr<struct jvirt_sarray_control> ptr =
+    (*use_orig(mgr, cinfo)->request_virt_sarray)(cinfo, pool_id, pre_zero,
+                                                 samplesperrow, numrows, maxaccess);
+  use_arena(mgr, cinfo);
+  return ptr;
+}
+
+static _Ptr<struct jvirt_barray_control>
+arena_request_virt_barray (j_common_ptr cinfo, int pool_id, boolean pre_zero,
+                           JDIMENSION blocksperrow, JDIMENSION numrows,
+                           JDIMENSION maxaccess)
+{
+  _Ptr<struct arena_mgr> mgr = arena_of(cinfo);
+  if (pool_id == JPOOL_IMAGE)
+    count_use(mgr, (size_t) blocksperrow * numrows * sizeof(JBLOCK));
+  _Ptr<struct jvirt_barray_control> ptr =
+    (*use_orig(mgr, cinfo)->request_virt_barray)(cinfo, pool_id, pre_zero,
+                                                 blocksperrow, numrows, maxaccess);
+  use_arena(mgr, cinfo);
+  return ptr;
+}
+
+static void
+arena_realize_virt_arrays (j_common_ptr cinfo)
+{
+  _Ptr<struct arena_mgr> mgr = arena_of(cinfo);
+
+  (*use_orig(mgr, cinfo)->realize_virt_arrays)(cinfo);
+  use_arena(mgr, cinfo);
+}
+
+static _Ptr<JSAMPROW>
+arena_access_virt_sarray (j_common_ptr cinfo, _Ptr<struct jvirt_sarray_control> ptr,
+                          JDIMENSION start_row, JDIMENSION num_rows, boolean writable)
+{
+  _Ptr<struct arena_mgr> mgr = arena_of(cinfo);
+  _Ptr<JSAMPROW> rows =
+    (*use_orig(mgr, cinfo)->access_virt_sarray)(cinfo, ptr, start_row, num_rows, writable);
+  use_arena(mgr, cinfo);
+  return rows;
+}
+
+static _Ptr<JBLOCKROW>
+arena_access_virt_barray (j_common_ptr cinfo, _Ptr<struct jvirt_barray_control> ptr,
+                          JDIMENSION start_row, JDIMENSION num_rows, boolean writable)
+{
+  _Ptr<struct arena_mgr> mgr = arena_of(cinfo);
+  _Ptr<JBLOCKROW> rows =
+    (*use_orig(mgr, cinfo)->access_virt_barray)(cinfo, ptr, start_row, num_rows, writable);
+  use_arena(mgr, cinfo);
+  return rows;
+}
+
+
+/*
+ * Releasing the image pool is the O(1) part: the arena just rewinds.
+ */
+
+static void
+arena_free_pool (j_common_ptr cinfo, int pool_id)
+{
+  _Ptr<struct arena_mgr> mgr = arena_of(cinfo);
+
+  if (pool_id == JPOOL_IMAGE)
+    arena_rewind(mgr);
+  (*use_orig(mgr, cinfo)->free_pool)(cinfo, pool_id);
+  use_arena(mgr, cinfo);
+}
+
+static void
+arena_self_destruct (j_common_ptr cinfo)
+{
+  _Ptr<struct arena_mgr> mgr = arena_of(cinfo);
+
+  while (mgr->head != NULL) {
+    _Ptr<struct arena_block> block = mgr->head;
+    mgr->head = block->next;
+    free<char>(block->data);
+    free<struct arena_block>(block);
+  }
+  /* This frees the permanent pool and leaves cinfo->mem NULL. */
+  (*use_orig(mgr, cinfo)->self_destruct)(cinfo);
+  free<struct arena_mgr>(mgr);
+}
+
+
+_Ptr<struct jpeg_memory_mgr>
+arena_install (j_common_ptr cinfo)
+{
+  _Ptr<struct arena_mgr> mgr = calloc<struct arena_mgr>(1, sizeof(struct arena_mgr));
+
+  if (mgr == NULL)
+    return ((void *)0);
+  mgr->orig = cinfo->mem;
+  mgr->pub.alloc_small = arena_alloc_small;
+  mgr->pub.alloc_large = arena_alloc_large;
+  mgr->pub.alloc_sarray = arena_alloc_sarray;
+  mgr->pub.alloc_barray = arena_alloc_barray;
+  mgr->pub.request_virt_sarray = arena_request_virt_sarray;
+  mgr->pub.request_virt_barray = arena_request_virt_barray;
+  mgr->pub.realize_virt_arrays = arena_realize_virt_arrays;
+  mgr->pub.access_virt_sarray = arena_access_virt_sarray;
+  mgr->pub.access_virt_barray = arena_access_virt_barray;
+  mgr->pub.free_pool = arena_free_pool;
+  mgr->pub.self_destruct = arena_self_destruct;
+  mgr->pub.max_memory_to_use = cinfo->mem->max_memory_to_use;
+  mgr->pub.max_alloc_chunk = cinfo->mem->max_alloc_chunk;
+  use_arena(mgr, cinfo);
+  return &mgr->pub;
+}
+
+size_t
+arena_reserved (_Ptr<struct jpeg_memory_mgr> mem)
+{
+  return _Dynamic_bounds_cast<_Ptr<struct arena_mgr>>(mem)->reserved;
+}
+
+size_t
+arena_peak (_Ptr<struct jpeg_memory_mgr> mem)
+{
+  return _Dynamic_bounds_cast<_Ptr<struct arena_mgr>>(mem)->last_peak;
+}
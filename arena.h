@@ -0,0 +1,45 @@
+/*
+ * arena.h
+ *
+ * An arena-based memory manager for reusing JPEG objects across images.
+ *
+ * libjpeg's own manager mallocs every JPOOL_IMAGE object separately and
+ * frees them all again at the end of each image.  The arena instead carves
+ * image objects out of a few large blocks, and keeps the blocks when the
+ * image pool is freed: releasing the pool just rewinds the arena, and the
+ * next image of similar size is decoded without calling malloc at all.
+ * The blocks are only freed when the JPEG object is destroyed, so an arena
+ * stays as large as the largest image it has seen.
+ *
+ * The permanent pool and virtual arrays (used for multi-scan images, which
+ * need whole-image coefficient buffers) are still handled by the library's
+ * manager, which the arena wraps.
+ *
+ * Include <stdio.h> and <jpeglib.h> before this file.
+ */
+
+#ifndef ARENA_H
+#define ARENA_H
+
+/* Replace cinfo's memory manager, just after jpeg_create_decompress or
+ * jpeg_create_compress, with an arena wrapped around it.  Returns the new
+ * manager, which is also left in cinfo->mem, or NULL if out of memory, in
+ * which case the library's manager stays in place.
+ *
+ * If an allocation by the wrapped manager fails, its error exit may leave
+ * the wrapped manager in cinfo->mem; an application that recovers from
+ * errors should store the returned pointer back into cinfo->mem before
+ * calling jpeg_abort or jpeg_destroy.
+ */
+extern _Ptr<struct jpeg_memory_mgr> arena_install(j_common_ptr cinfo);
+
+/* Bytes currently held in arena blocks, whether in use or not. */
+extern size_t arena_reserved(_Ptr<struct jpeg_memory_mgr> mem);
+
+/* The most image memory, arena objects and virtual arrays together, that
+ * the last image held at once.  Valid once its decompression has been
+ * finished or aborted.
+ */
+extern size_t arena_peak(_Ptr<struct jpeg_memory_mgr> mem);
+
+#endif /* ARENA_H */
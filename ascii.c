@@ -0,0 +1,152 @@
+/*
+ * ascii.c
+ *
+ * Sample-to-text kernels for ASCII PPM; see ascii.h.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#define HAVE_PROTOTYPES
+#include <jpeglib.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#define ASCII_X86
+#include <immintrin.h>
+#endif
+
+#include "ascii.h"
+#pragma CHECKED_SCOPE on
+
+/* Samples per SIMD step. */
+#define ASCII_BLOCK 16
+
+typedef _Ptr<void (_Array_ptr<char> text : count(ASCII_SAMPLE_SIZE * n),
+                   _Array_ptr<const JSAMPLE> samples : count(n), size_t n)> ascii_kernel;
+
+
+/* The plain version, for short runs and CPUs without the SIMD kernels. */
+
+static void
+format_scalar (_Array_ptr<char> text : count(ASCII_SAMPLE_SIZE * n),
+               _Array_ptr<const JSAMPLE> samples : count(n), size_t n)
+{
+  for (size_t i = 0; i < n; i++) {
+    unsigned int v = samples[i];
+    text[4 * i] = v >= 100 ? '0' + v / 100 : ' ';
+    text[4 * i + 1] = v >= 10 ? '0' + v / 10 % 10 : ' ';
+    text[4 * i + 2] = '0' + v % 10;
+    text[4 * i + 3] = ' ';
+  }
+}
+
+
+#ifdef ASCII_X86
+
+/*
+ * Both SIMD kernels work on samples widened to 16 bits.  Division by 100
+ * and by 10 are multiplications by 656/65536 and 6554/65536 (exact for all
+ * 8-bit values), and the leading blanks come from comparisons: a digit
+ * that is shown is ' ' + 16 + digit, since '0' - ' ' is 16.  The four
+ * characters of a sample then go together as two 16-bit halves, the
+ * hundreds and tens and the units and trailing space, which unpack into the
+ * 32-bit text of each sample in order.
+ */
+
+#define ASCII_DIGITS(type, P, S, v, lo, hi) \
+  { \
+    type h = P##_mulhi_epu16(v, P##_set1_epi16(656)); \
+    type r = P##_sub_epi16(v, P##_mullo_epi16(h, P##_set1_epi16(100))); \
+    type t = P##_mulhi_epu16(r, P##_set1_epi16(6554)); \
+    type o = P##_sub_epi16(r, P##_mullo_epi16(t, P##_set1_epi16(10))); \
+    type blank = P##_set1_epi16(' '), shown = P##_set1_epi16(16); \
+    type hc = P##_add_epi16(blank, P##_and_##S(P##_cmpgt_epi16(v, P##_set1_epi16(99)), \
+                                              P##_add_epi16(h, shown))); \
+    type tc = P##_add_epi16(blank, P##_and_##S(P##_cmpgt_epi16(v, P##_set1_epi16(9)), \
+                                              P##_add_epi16(t, shown))); \
+    lo = P##_or_##S(hc, P##_slli_epi16(tc, 8)); \
+    hi = P##_or_##S(P##_add_epi16(o, P##_set1_epi16('0')), P##_set1_epi16(' ' << 8)); \
+  }
+
+__attribute__((target("sse2")))
+static void
+format_sse2 (_Array_ptr<char> text : count(ASCII_SAMPLE_SIZE * n),
+             _Array_ptr<const JSAMPLE> samples : count(n), size_t n)
+{
+  size_t i = 0;
+
+  for (; i + ASCII_BLOCK <= n; i += ASCII_BLOCK) {
+    _Unchecked {
+      __m128i zero = _mm_setzero_si128();
+      __m128i in = _mm_loadu_si128((const __m128i *) (samples + i));
+      __m128i v0 = _mm_unpacklo_epi8(in, zero), v1 = _mm_unpackhi_epi8(in, zero);
+      __m128i lo0, hi0, lo1, hi1;
+      ASCII_DIGITS(__m128i, _mm, si128, v0, lo0, hi0)
+      ASCII_DIGITS(__m128i, _mm, si128, v1, lo1, hi1)
+      __m128i *out = (__m128i *) (text + ASCII_SAMPLE_SIZE * i);
+      _mm_storeu_si128(out, _mm_unpacklo_epi16(lo0, hi0));
+      _mm_storeu_si128(out + 1, _mm_unpackhi_epi16(lo0, hi0));
+      _mm_storeu_si128(out + 2, _mm_unpacklo_epi16(lo1, hi1));
+      _mm_storeu_si128(out + 3, _mm_unpackhi_epi16(lo1, hi1));
+    }
+  }
+  format_scalar(_Dynamic_bounds_cast<_Array_ptr<char>>(text + ASCII_SAMPLE_SIZE * i,
+                                                       count(ASCII_SAMPLE_SIZE * (n - i))),
+                _Dynamic_bounds_cast<_Array_ptr<const JSAMPLE>>(samples + i, count(n - i)),
+                n - i);
+}
+
+__attribute__((target("avx2")))
+static void
+format_avx2 (_Array_ptr<char> text : count(ASCII_SAMPLE_SIZE * n),
+             _Array_ptr<const JSAMPLE> samples : count(n), size_t n)
+{
+  size_t i = 0;
+
+  for (; i + ASCII_BLOCK <= n; i += ASCII_BLOCK) {
+    _Unchecked {
+      __m256i v = _mm256_cvtepu8_epi16(_mm_loadu_si128((const __m128i *) (samples + i)));
+      __m256i lo, hi;
+      ASCII_DIGITS(__m256i, _mm256, si256, v, lo, hi)
+      /* The unpacks work within 128-bit lanes, giving samples 0-3 and 8-11,
+       * then 4-7 and 12-15; the permutes put them back in order.
+       */
+      __m256i a = _mm256_unpacklo_epi16(lo, hi), b = _mm256_unpackhi_epi16(lo, hi);
+      __m256i *out = (__m256i *) (text + ASCII_SAMPLE_SIZE * i);
+      _mm256_storeu_si256(out, _mm256_permute2x128_si256(a, b, 0x20));
+      _mm256_storeu_si256(out + 1, _mm256_permute2x128_si256(a, b, 0x31));
+    }
+  }
+  format_scalar(_Dynamic_bounds_cast<_Array_ptr<char>>(text + ASCII_SAMPLE_SIZE * i,
+                                                       count(ASCII_SAMPLE_SIZE * (n - i))),
+                _Dynamic_bounds_cast<_Array_ptr<const JSAMPLE>>(samples + i, count(n - i)),
+                n - i);
+}
+
+#endif /* ASCII_X86 */
+
+
+/* The best kernel this CPU can run.  __builtin_cpu_supports only reads
+ * what the runtime found at startup, so asking every time costs nothing.
+ */
+
+static ascii_kernel
+choose_kernel (void)
+{
+#ifdef ASCII_X86
+  if (__builtin_cpu_supports("avx2"))
+    return format_avx2;
+  if (__builtin_cpu_supports("sse2"))
+    return format_sse2;
+#endif
+  return format_scalar;
+}
+
+void
+ascii_format (_Array_ptr<char> text : count(ASCII_SAMPLE_SIZE * n),
+              _Array_ptr<const JSAMPLE> samples : count(n), size_t n)
+{
+  ascii_kernel format = choose_kernel();
+
+  (*format)(text, samples, n);
+}
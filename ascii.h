@@ -0,0 +1,27 @@
+/*
+ * ascii.h
+ *
+ * Formatting samples as ASCII PPM text.
+ *
+ * Each 8-bit sample becomes exactly the four bytes printf("%3d ") would
+ * give it: the value right-aligned in three columns, then a space.  With a
+ * fixed width per sample the text for a run of samples can be produced with
+ * SIMD arithmetic and stored 16 samples at a time, which is far faster than
+ * formatting them one by one.  The kernel is picked at run time from what
+ * the CPU supports (AVX2, then SSE2, on x86), with a scalar loop for other
+ * machines and for the ends of runs.
+ *
+ * Include <stdio.h> and <jpeglib.h> before this file.
+ */
+
+#ifndef ASCII_H
+#define ASCII_H
+
+/* Bytes of text per sample. */
+#define ASCII_SAMPLE_SIZE 4
+
+/* Write the text for samples[0..n) to text[0..4n). */
+extern void ascii_format(_Array_ptr<char> text : count(ASCII_SAMPLE_SIZE * n),
+                         _Array_ptr<const JSAMPLE> samples : count(n), size_t n);
+
+#endif /* ASCII_H */
@@ -0,0 +1,517 @@
+/*
+ * bench.c
+ *
+ * Benchmark driver for the to_ppm decode pipeline.
+ *
+ * The corpus is test.jpg plus a set of synthetic images of different sizes
+ * and chroma subsampling modes, which are generated with libjpeg into the
+ * corpus directory the first time they are needed.  Any files named on the
+ * command line replace the corpus.
+ *
+ * For every image we first run read_JPEG_file-style decodes in process and
+ * report the time spent in jpeg_read_header, in decoding (starting the
+ * decompressor and reading scanlines) and in writing the samples out, plus
+ * the resulting megapixels per second.  The samples go through one of the
+ * sinks in sink.c; --null uses the null sink, which leaves the cost of
+ * decoding alone.  Then, unless --no-compare is given, we run the checked
+ * to_ppm and the unchecked build of original/example.c on the same image as
+ * separate processes, and compare their wall time and peak RSS, which shows
+ * what the Checked C bounds checks cost end to end.  --converted adds the
+ * unedited 3C output in out/to_ppm.c as a third program.
+ *
+ * With --profile DIR, each program run is told through TO_PPM_PROFILE to
+ * add its per-function cycle counts to DIR/<program>.prof.  That only does
+ * anything for the builds linked with bench/profile.c; "make profile" makes
+ * those and runs them all.  Their wall times then include instrumentation
+ * and writing the profile, so compare them only with each other.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <setjmp.h>
+#include <limits.h>
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/resource.h>
+#include <sys/wait.h>
+
+#define HAVE_PROTOTYPES
+#include <jpeglib.h>
+
+#include "../sink.h"
+#include "../writer.h"
+#pragma CHECKED_SCOPE on
+
+#define DEFAULT_CORPUS_DIR "bench/corpus"
+#define DEFAULT_ITERATIONS 3
+#define DEFAULT_CHECKED "./to_ppm"
+#define DEFAULT_UNCHECKED "./bench/example_unchecked"
+
+/* Rows per jpeg_read_scanlines call, mirroring to_ppm's default batch. */
+#define BENCH_BATCH_ROWS 32
+
+#define OUTPUT_BUFFER_SIZE (1 << 20)
+
+/* One synthetic image in the corpus. */
+struct corpus_spec {
+  _Nt_array_ptr<const char> name;
+  JDIMENSION width, height;
+  int components;		/* 1 for grayscale, 3 for YCbCr */
+  int h_samp, v_samp;		/* luma sampling factors: 2,2 is 4:2:0 */
+  boolean progressive;
+};
+
+static const struct corpus_spec corpus _Checked[] = {
+  { "vga_444", 640, 480, 3, 1, 1, FALSE },
+  { "vga_420", 640, 480, 3, 2, 2, FALSE },
+  { "hd_444", 1920, 1080, 3, 1, 1, FALSE },
+  { "hd_422", 1920, 1080, 3, 2, 1, FALSE },
+  { "hd_420", 1920, 1080, 3, 2, 2, FALSE },
+  { "hd_420_progressive", 1920, 1080, 3, 2, 2, TRUE },
+  { "hd_gray", 1920, 1080, 1, 1, 1, FALSE },
+  { "12mp_420", 4000, 3000, 3, 2, 2, FALSE },
+};
+
+#define CORPUS_SIZE ((int) (sizeof(corpus) / sizeof(corpus[0])))
+
+/* Seconds spent in each stage of one decode. */
+struct phase_times {
+  double header;
+  double decode;
+  double output;
+};
+
+struct bench_options {
+  int iterations;
+  enum { BENCH_ASCII, BENCH_BINARY, BENCH_NULL } output;	/* sink to time */
+  boolean compare;		/* also time the checked/unchecked programs */
+  _Nt_array_ptr<const char> checked_prog;
+  _Nt_array_ptr<const char> unchecked_prog;
+  _Nt_array_ptr<const char> converted_prog;	/* or NULL */
+  _Nt_array_ptr<const char> profile_dir;	/* or NULL */
+};
+
+
+struct my_error_mgr {
+  struct jpeg_error_mgr pub;	/* "public" fields */
+  jmp_buf setjmp_buffer : itype(struct __jmp_buf_tag _Checked[1]);	/* for return to caller */
+};
+
+typedef _Ptr<struct my_error_mgr> my_error_ptr;
+
+METHODDEF(void)
+my_error_exit (j_common_ptr cinfo)
+{
+  my_error_ptr myerr = _Dynamic_bounds_cast<_Ptr<struct my_error_mgr>>(cinfo->err);
+
+  (*cinfo->err->output_message) (cinfo);
+  _Unchecked { longjmp(myerr->setjmp_buffer, 1); }
+}
+
+
+static double
+now (void)
+{
+  struct timespec ts = {};
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+
+/*
+ * Write a synthetic image to filename: smooth gradients with some busier
+ * blocks, so the entropy coder and IDCT see realistic work.  Returns 1 on
+ * success, 0 on error.
+ */
+
+static int
+generate_image (_Ptr<const struct corpus_spec> spec, _Nt_array_ptr<const char> filename)
+{
+  struct jpeg_compress_struct cinfo = {};
+  struct my_error_mgr jerr = {};
+  _Ptr<FILE> outfile = ((void *)0);
+  size_t row_stride = (size_t) spec->width * spec->components;
+  JSAMPROW row : count(row_stride) = ((void *)0);
+
+  if ((outfile = fopen(filename, "wb")) == NULL) {
+    fprintf(stderr, "can't create %s\n", filename);
+    return 0;
+  }
+  row = malloc<JSAMPLE>(row_stride);
+  if (row == NULL) {
+    fclose(outfile);
+    return 0;
+  }
+
+  cinfo.err = jpeg_std_error(&jerr.pub);
+  jerr.pub.error_exit = my_error_exit;
+  int jmp = 0;
+  _Unchecked { jmp = setjmp(jerr.setjmp_buffer); }
+  if (jmp) {
+    jpeg_destroy_compress(&cinfo);
+    fclose(outfile);
+    free<JSAMPLE>(row);
+    remove(filename);
+    return 0;
+  }
+  jpeg_create_compress(&cinfo);
+  jpeg_stdio_dest(&cinfo, outfile);
+
+  cinfo.image_width = spec->width;
+  cinfo.image_height = spec->height;
+  cinfo.input_components = spec->components;
+  cinfo.in_color_space = spec->components == 1 ? JCS_GRAYSCALE : JCS_RGB;
+  jpeg_set_defaults(&cinfo);
+  jpeg_set_quality(&cinfo, 85, TRUE);
+  /* comp_info[0] is luma; the chroma components keep 1x1 sampling. */
+  cinfo.comp_info->h_samp_factor = spec->h_samp;
+  cinfo.comp_info->v_samp_factor = spec->v_samp;
+  if (spec->progressive)
+    jpeg_simple_progression(&cinfo);
+
+  jpeg_start_compress(&cinfo, TRUE);
+  JSAMPROW rows _Checked[1] = { row };
+  while (cinfo.next_scanline < cinfo.image_height) {
+    JDIMENSION y = cinfo.next_scanline;
+    for (JDIMENSION x = 0; x < spec->width; x++) {
+      for (int c = 0; c < spec->components; c++) {
+        unsigned int v = x * (c + 1) + y * (3 - c);
+        /* Every fourth 16x16 block gets high-frequency texture. */
+        if (((x >> 4) + (y >> 4)) % 4 == 0)
+          v += ((x * 7 + y * 13 + c * 31) % 17) * 9;
+        row[(size_t) x * spec->components + c] = (JSAMPLE) (v & 0xFF);
+      }
+    }
+    (void) jpeg_write_scanlines(&cinfo, rows, 1);
+  }
+  jpeg_finish_compress(&cinfo);
+  jpeg_destroy_compress(&cinfo);
+  fclose(outfile);
+  free<JSAMPLE>(row);
+  return 1;
+}
+
+
+/*
+ * Decode filename once, handing the samples to sink and adding the time
+ * spent in each stage to *times.  Returns the number of pixels decoded, or
+ * 0 on error.
+ */
+
+static double
+bench_decode (_Nt_array_ptr<const char> filename, _Ptr<struct output_sink> sink,
+              _Ptr<struct phase_times> times)
+{
+  struct jpeg_decompress_struct cinfo = {};
+  struct my_error_mgr jerr = {};
+  _Ptr<FILE> infile = ((void *)0);
+  double t0, t1;
+
+  if ((infile = fopen(filename, "rb")) == NULL) {
+    fprintf(stderr, "can't open %s\n", filename);
+    return 0;
+  }
+  cinfo.err = jpeg_std_error(&jerr.pub);
+  jerr.pub.error_exit = my_error_exit;
+  int jmp = 0;
+  _Unchecked { jmp = setjmp(jerr.setjmp_buffer); }
+  if (jmp) {
+    jpeg_destroy_decompress(&cinfo);
+    fclose(infile);
+    (void) (*sink->end_image)(sink, FALSE);
+    return 0;
+  }
+  jpeg_create_decompress(&cinfo);
+  jpeg_stdio_src(&cinfo, infile);
+
+  t0 = now();
+  (void) jpeg_read_header(&cinfo, TRUE);
+  t1 = now();
+  times->header += t1 - t0;
+
+  t0 = now();
+  (void) jpeg_start_decompress(&cinfo);
+  size_t row_stride = (size_t) cinfo.output_width * cinfo.output_components;
+  JDIMENSION batch_rows = BENCH_BATCH_ROWS;
+  size_t strip_size = row_stride * batch_rows;
+  JSAMPROW strip : count(strip_size) = ((void *)0);
+  JSAMPARRAY buffer : count(batch_rows) = ((void *)0);
+  _Unchecked {
+    strip = _Assume_bounds_cast<JSAMPROW>((*cinfo.mem->alloc_large)
+		((_Ptr<struct jpeg_common_struct>) &cinfo, JPOOL_IMAGE, strip_size),
+		count(strip_size));
+    buffer = _Assume_bounds_cast<JSAMPARRAY>((*cinfo.mem->alloc_small)
+		((_Ptr<struct jpeg_common_struct>) &cinfo, JPOOL_IMAGE,
+		 batch_rows * sizeof(JSAMPROW)),
+		count(batch_rows));
+  }
+  for (JDIMENSION r = 0; r < batch_rows; r++)
+    buffer[r] = strip + r * row_stride;
+  t1 = now();
+  times->decode += t1 - t0;
+
+  struct sink_image image = {
+    cinfo.output_width, cinfo.output_height, cinfo.output_components
+  };
+  if (!(*sink->begin_image)(sink, &image)) {
+    _Unchecked { longjmp(jerr.setjmp_buffer, 1); }
+  }
+  while (cinfo.output_scanline < cinfo.output_height) {
+    t0 = now();
+    JDIMENSION num_rows = jpeg_read_scanlines(&cinfo, buffer, batch_rows);
+    t1 = now();
+    if (!(*sink->write_rows)(sink, _Dynamic_bounds_cast<JSAMPROW>(strip, count(num_rows * row_stride)),
+                             num_rows, row_stride)) {
+      _Unchecked { longjmp(jerr.setjmp_buffer, 1); }
+    }
+    times->decode += t1 - t0;
+    times->output += now() - t1;
+  }
+  t0 = now();
+  (void) jpeg_finish_decompress(&cinfo);
+  t1 = now();
+  times->decode += t1 - t0;
+  int ok = (*sink->end_image)(sink, TRUE);
+  times->output += now() - t1;
+
+  double pixels = (double) cinfo.output_width * cinfo.output_height;
+  jpeg_destroy_decompress(&cinfo);
+  fclose(infile);
+  return ok ? pixels : 0;
+}
+
+
+/*
+ * Run prog on filename with stdout sent to /dev/null, and report its wall
+ * time and peak RSS.  Returns 1 if it ran and exited with success_status.
+ * If profile_dir isn't NULL, the program is asked to leave its profile
+ * there, named after it.
+ */
+
+static int
+run_program (_Nt_array_ptr<const char> prog, _Nt_array_ptr<const char> filename,
+             int success_status, _Nt_array_ptr<const char> profile_dir,
+             _Ptr<double> seconds, _Ptr<long> max_rss_kb)
+{
+  int status = 0;
+  int pid = -1;
+  double t0 = now();
+
+  _Unchecked {
+    struct rusage usage;
+    pid = fork();
+    if (pid == 0) {
+      int devnull = open("/dev/null", O_WRONLY);
+      if (devnull >= 0)
+        dup2(devnull, STDOUT_FILENO);
+      if (profile_dir != NULL) {
+        char profile[PATH_MAX];
+        const char *name = strrchr((const char *) prog, '/');
+        snprintf(profile, sizeof(profile), "%s/%s.prof", (const char *) profile_dir,
+                 name != NULL ? name + 1 : (const char *) prog);
+        setenv("TO_PPM_PROFILE", profile, 1);
+      }
+      execl((const char *) prog, (const char *) prog, (const char *) filename, (char *) NULL);
+      _exit(127);
+    }
+    if (pid > 0 && wait4(pid, &status, 0, &usage) == pid)
+      *max_rss_kb = usage.ru_maxrss;
+    else
+      pid = -1;
+  }
+  *seconds = now() - t0;
+  if (pid < 0) {
+    fprintf(stderr, "can't run %s\n", prog);
+    return 0;
+  }
+  return WIFEXITED(status) && WEXITSTATUS(status) == success_status;
+}
+
+
+/* Benchmark one image with every configured method. */
+
+static int
+bench_file (_Nt_array_ptr<const char> filename, _Ptr<const struct bench_options> opts,
+            _Ptr<struct writer> devnull)
+{
+  struct phase_times best = {}, times = {};
+  double best_total = 0, pixels = 0;
+  struct file_sink file_sink = {};
+  struct null_sink null_sink = {};
+  _Ptr<struct output_sink> sink = ((void *)0);
+
+  if (opts->output == BENCH_NULL)
+    sink = sink_null(&null_sink);
+  else if (opts->output == BENCH_BINARY)
+    sink = sink_binary_ppm(&file_sink, devnull);
+  else
+    sink = sink_ascii_ppm(&file_sink, devnull);
+
+  for (int i = 0; i < opts->iterations; i++) {
+    times.header = times.decode = times.output = 0;
+    pixels = bench_decode(filename, sink, &times);
+    if (pixels == 0)
+      return 0;
+    double total = times.header + times.decode + times.output;
+    if (i == 0 || total < best_total)
+      best = times, best_total = total;
+  }
+  printf("%-40s %7.1f %9.3f %9.3f %9.3f %8.1f\n", filename, pixels / 1e6,
+         best.header * 1e3, best.decode * 1e3, best.output * 1e3,
+         pixels / best_total / 1e6);
+
+  if (!opts->compare)
+    return 1;
+
+  double best_checked = 0, best_unchecked = 0, best_converted = 0;
+  long rss_checked = 0, rss_unchecked = 0, rss_converted = 0;
+  for (int i = 0; i < opts->iterations; i++) {
+    double seconds = 0;
+    long rss = 0;
+    if (!run_program(opts->checked_prog, filename, 0, opts->profile_dir, &seconds, &rss))
+      return 0;
+    if (i == 0 || seconds < best_checked)
+      best_checked = seconds;
+    if (rss > rss_checked)
+      rss_checked = rss;
+    if (!run_program(opts->unchecked_prog, filename, 0, opts->profile_dir, &seconds, &rss))
+      return 0;
+    if (i == 0 || seconds < best_unchecked)
+      best_unchecked = seconds;
+    if (rss > rss_unchecked)
+      rss_unchecked = rss;
+    if (opts->converted_prog == NULL)
+      continue;
+    /* 3C left main returning read_JPEG_file's result, which is 1 on success. */
+    if (!run_program(opts->converted_prog, filename, 1, opts->profile_dir, &seconds, &rss))
+      return 0;
+    if (i == 0 || seconds < best_converted)
+      best_converted = seconds;
+    if (rss > rss_converted)
+      rss_converted = rss;
+  }
+  printf("%-40s   checked %9.3f ms %7ld KB   unchecked %9.3f ms %7ld KB   %+6.1f%%\n",
+         "", best_checked * 1e3, rss_checked, best_unchecked * 1e3, rss_unchecked,
+         (best_checked / best_unchecked - 1) * 100);
+  if (opts->converted_prog != NULL)
+    printf("%-40s   3C      %9.3f ms %7ld KB   %+6.1f%%\n",
+           "", best_converted * 1e3, rss_converted,
+           (best_converted / best_unchecked - 1) * 100);
+  return 1;
+}
+
+
+static void
+usage (void)
+{
+  fprintf(stderr, "usage: bench [options] [file.jpg...]\n");
+  fprintf(stderr, "  -d DIR         corpus directory (default %s)\n", DEFAULT_CORPUS_DIR);
+  fprintf(stderr, "  -n N           iterations per image, best is reported (default %d)\n",
+          DEFAULT_ITERATIONS);
+  fprintf(stderr, "  --binary       time raw sample output instead of ASCII\n");
+  fprintf(stderr, "  --null         time decoding alone, with no output formatting\n");
+  fprintf(stderr, "  --no-compare   skip the checked vs unchecked process comparison\n");
+  fprintf(stderr, "  --checked P    checked program to compare (default %s)\n", DEFAULT_CHECKED);
+  fprintf(stderr, "  --unchecked P  unchecked program to compare (default %s)\n", DEFAULT_UNCHECKED);
+  fprintf(stderr, "  --converted P  also compare P, a build of the 3C output in out/\n");
+  fprintf(stderr, "  --profile DIR  have the programs write their profiles to DIR\n");
+}
+
+
+int
+main (int argc, _Array_ptr<_Nt_array_ptr<char>> argv : count(argc))
+{
+  struct bench_options opts = {
+    .iterations = DEFAULT_ITERATIONS,
+    .output = BENCH_ASCII,
+    .compare = TRUE,
+    .checked_prog = DEFAULT_CHECKED,
+    .unchecked_prog = DEFAULT_UNCHECKED,
+    .converted_prog = ((void *)0),
+    .profile_dir = ((void *)0)
+  };
+  _Nt_array_ptr<const char> corpus_dir = DEFAULT_CORPUS_DIR;
+  int first_file = argc;
+  int failures = 0;
+
+  for (int i = 1; i < argc; i++) {
+    _Nt_array_ptr<char> arg = argv[i];
+    if (strcmp(arg, "-d") == 0 && i + 1 < argc) {
+      corpus_dir = argv[++i];
+    } else if (strcmp(arg, "-n") == 0 && i + 1 < argc) {
+      opts.iterations = atoi(argv[++i]);
+      if (opts.iterations < 1) {
+        usage();
+        return EXIT_FAILURE;
+      }
+    } else if (strcmp(arg, "--binary") == 0) {
+      opts.output = BENCH_BINARY;
+    } else if (strcmp(arg, "--null") == 0) {
+      opts.output = BENCH_NULL;
+    } else if (strcmp(arg, "--no-compare") == 0) {
+      opts.compare = FALSE;
+    } else if (strcmp(arg, "--checked") == 0 && i + 1 < argc) {
+      opts.checked_prog = argv[++i];
+    } else if (strcmp(arg, "--unchecked") == 0 && i + 1 < argc) {
+      opts.unchecked_prog = argv[++i];
+    } else if (strcmp(arg, "--converted") == 0 && i + 1 < argc) {
+      opts.converted_prog = argv[++i];
+    } else if (strcmp(arg, "--profile") == 0 && i + 1 < argc) {
+      opts.profile_dir = argv[++i];
+    } else if (arg[0] == '-') {
+      usage();
+      return EXIT_FAILURE;
+    } else {
+      first_file = i;
+      break;
+    }
+  }
+
+  /* The in-process decodes write to /dev/null through the same writer as
+   * to_ppm, so the output column measures formatting rather than I/O.
+   */
+  int devnull_fd = -1;
+  _Unchecked { devnull_fd = open("/dev/null", O_WRONLY); }
+  _Ptr<struct writer> devnull = writer_create(OUTPUT_BUFFER_SIZE, 0);
+  if (devnull_fd < 0 || devnull == NULL) {
+    fprintf(stderr, "can't open /dev/null\n");
+    return EXIT_FAILURE;
+  }
+  writer_attach(devnull, devnull_fd);
+
+  printf("%-40s %7s %9s %9s %9s %8s\n", "image", "MP", "header ms", "decode ms",
+         "output ms", "MP/s");
+
+  if (first_file < argc) {
+    for (int i = first_file; i < argc; i++)
+      if (!bench_file(argv[i], &opts, devnull))
+        failures++;
+  } else {
+    mkdir(corpus_dir, 0777);
+    if (!bench_file("test.jpg", &opts, devnull))
+      failures++;
+    for (int k = 0; k < CORPUS_SIZE; k++) {
+      char path _Nt_checked[PATH_MAX];
+      struct stat st = {};
+      snprintf(path, sizeof(path), "%s/%s.jpg", corpus_dir, corpus[k].name);
+      if (stat(path, &st) != 0 && !generate_image(&corpus[k], path)) {
+        failures++;
+        continue;
+      }
+      if (!bench_file(path, &opts, devnull))
+        failures++;
+    }
+  }
+
+  struct rusage usage = {};
+  getrusage(RUSAGE_SELF, &usage);
+  printf("peak RSS of in-process decodes: %ld KB\n", usage.ru_maxrss);
+
+  writer_destroy(devnull);
+  close(devnull_fd);
+  return failures == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+}
@@ -0,0 +1,71 @@
+/*
+ * example_main.c
+ *
+ * Harness that turns the unconverted IJG sample code in original/example.c
+ * into a program comparable with to_ppm: it decodes argv[1] and writes the
+ * image to stdout in the same ASCII format, P2/P3 header included.  This is plain, unchecked C;
+ * bench uses it as the baseline when measuring what the Checked C bounds
+ * checks in to_ppm cost.
+ */
+
+#include <stdio.h>
+#include "../original/jpeglib.h"
+
+/* example.c's compression half refers to these; the benchmark never calls
+ * write_JPEG_file, so they only need to exist.
+ */
+JSAMPLE * image_buffer;
+int image_height;
+int image_width;
+
+extern int read_JPEG_file (char * filename);
+
+/* read_JPEG_file hands out scanlines only, so the header comes from a
+ * separate pass over the file's markers, as to_ppm's would.  Reading the
+ * header costs next to nothing beside decoding.
+ */
+
+static int
+put_header (char * filename)
+{
+  struct jpeg_decompress_struct cinfo;
+  struct jpeg_error_mgr jerr;
+  FILE * infile;
+
+  if ((infile = fopen(filename, "rb")) == NULL) {
+    fprintf(stderr, "can't open %s\n", filename);
+    return 0;
+  }
+  cinfo.err = jpeg_std_error(&jerr);
+  jpeg_create_decompress(&cinfo);
+  jpeg_stdio_src(&cinfo, infile);
+  (void) jpeg_read_header(&cinfo, TRUE);
+  jpeg_calc_output_dimensions(&cinfo);
+  printf("%s\n%u %u\n255\n", cinfo.output_components == 1 ? "P2" : "P3",
+         (unsigned) cinfo.output_width, (unsigned) cinfo.output_height);
+  jpeg_destroy_decompress(&cinfo);
+  fclose(infile);
+  return 1;
+}
+
+void
+put_scanline_someplace (JSAMPROW buffer, int row_stride)
+{
+  int i;
+
+  for (i = 0; i < row_stride; i++)
+    printf("%3d ", buffer[i]);
+  printf("\n");
+}
+
+int
+main (int argc, char ** argv)
+{
+  if (argc != 2) {
+    fprintf(stderr, "usage: example_unchecked file.jpg\n");
+    return 1;
+  }
+  if (!put_header(argv[1]))
+    return 1;
+  return read_JPEG_file(argv[1]) ? 0 : 1;
+}
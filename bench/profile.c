@@ -0,0 +1,282 @@
+/*
+ * profile.c
+ *
+ * A per-function cycle counter for the profile builds (see the Makefile).
+ *
+ * Code compiled with -finstrument-functions calls __cyg_profile_func_enter
+ * and __cyg_profile_func_exit around the body of every function, and this
+ * file supplies them: each thread keeps a shadow stack of the functions
+ * it is in, with the time stamp counter reading at entry, so that on exit
+ * the cycles spent can be charged to the function as a whole (inclusive)
+ * and, less the cycles of the instrumented functions it called, to the
+ * function itself (self).  Library code such as libjpeg isn't instrumented,
+ * so the time a function spends in jpeg_read_scanlines is part of its self
+ * count; for read_JPEG_file that is exactly the scanline loop.
+ *
+ * All three variants link this same file, so it is plain C like
+ * example_main.c, and it is only ever built with GCC or Clang.  If the
+ * environment variable TO_PPM_PROFILE names a file, the counts are added to
+ * those already in it when the program exits, and the file is rewritten
+ * sorted by self cycles; running a program over a corpus therefore leaves
+ * one table covering every run.  Function names come from running nm on
+ * the program.
+ *
+ * The hooks cost some tens of cycles per call, which is charged to the
+ * caller.  That is the same for every variant, so treat small differences
+ * in tiny, very frequently called functions with suspicion.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#endif
+
+#define NO_PROFILE __attribute__((no_instrument_function))
+
+#define MAX_FUNCTIONS 4096	/* a power of 2 */
+#define MAX_DEPTH 256
+#define MAX_NAME 200
+
+/* What we know about one function. */
+struct function_counts {
+  void * fn;			/* entry address, NULL if the slot is free */
+  unsigned long calls;
+  unsigned long long self;	/* cycles in the function itself */
+  unsigned long long total;	/* cycles including its callees */
+  char name[MAX_NAME];		/* filled in when reporting */
+};
+
+static struct function_counts functions[MAX_FUNCTIONS];
+
+/* One active call on a thread's shadow stack. */
+struct frame {
+  struct function_counts * counts;
+  unsigned long long start;	/* counter at entry */
+  unsigned long long children;	/* cycles in instrumented callees */
+};
+
+static __thread struct frame stack[MAX_DEPTH];
+static __thread int depth;
+static __thread int overflow;	/* calls deeper than MAX_DEPTH, not counted */
+
+void __cyg_profile_func_enter (void * fn, void * call_site) NO_PROFILE;
+void __cyg_profile_func_exit (void * fn, void * call_site) NO_PROFILE;
+
+NO_PROFILE static unsigned long long
+cycles (void)
+{
+#if defined(__x86_64__) || defined(__i386__)
+  return __rdtsc();
+#else
+  /* Elsewhere count nanoseconds, which is at least monotonic. */
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (unsigned long long) ts.tv_sec * 1000000000 + ts.tv_nsec;
+#endif
+}
+
+
+/* Find fn's slot, claiming a free one if it has none and claim is set.
+ * Worker threads may race to claim the same slot, so a claim is a
+ * compare-and-swap.  Returns NULL if there is no slot for fn.
+ */
+
+NO_PROFILE static struct function_counts *
+lookup (void * fn, int claim)
+{
+  unsigned long h = (unsigned long) fn;
+  int i, n;
+
+  h ^= h >> 17;
+  h *= 0x9E3779B1UL;
+  i = (int) (h & (MAX_FUNCTIONS - 1));
+  for (n = 0; n < MAX_FUNCTIONS; n++, i = (i + 1) & (MAX_FUNCTIONS - 1)) {
+    void * seen = functions[i].fn;
+    if (seen == fn)
+      return &functions[i];
+    if (seen == NULL) {
+      if (!claim)
+        return NULL;
+      seen = __sync_val_compare_and_swap(&functions[i].fn, NULL, fn);
+      if (seen == NULL || seen == fn)
+        return &functions[i];
+    }
+  }
+  return NULL;
+}
+
+void
+__cyg_profile_func_enter (void * fn, void * call_site)
+{
+  struct function_counts * counts;
+
+  (void) call_site;
+  if (depth == MAX_DEPTH || (counts = lookup(fn, 1)) == NULL) {
+    overflow++;
+    return;
+  }
+  stack[depth].counts = counts;
+  stack[depth].children = 0;
+  stack[depth].start = cycles();
+  depth++;
+}
+
+/* Charge the innermost frame as if it returned at now, and pop it. */
+
+NO_PROFILE static void
+pop_frame (unsigned long long now)
+{
+  struct frame * f = &stack[--depth];
+  unsigned long long spent = now - f->start;
+
+  __sync_fetch_and_add(&f->counts->calls, 1);
+  __sync_fetch_and_add(&f->counts->total, spent);
+  __sync_fetch_and_add(&f->counts->self, spent - f->children);
+  if (depth > 0)
+    stack[depth - 1].children += spent;
+}
+
+void
+__cyg_profile_func_exit (void * fn, void * call_site)
+{
+  unsigned long long now = cycles();
+
+  (void) call_site;
+  if (overflow > 0) {
+    overflow--;
+    return;
+  }
+  /* A longjmp (out of an error_exit method, say) leaves the functions it
+   * skipped on the stack; they end when the function we land in does.
+   */
+  while (depth > 1 && stack[depth - 1].counts->fn != fn)
+    pop_frame(now);
+  if (depth > 0)
+    pop_frame(now);
+}
+
+
+/*
+ * Fill in the names from the program's symbol table.  nm lists link-time
+ * addresses; the difference between those and the run-time ones is the
+ * load address, which we get by finding one of our own functions.
+ */
+
+NO_PROFILE static void
+name_functions (void)
+{
+  char command[64], line[64 + MAX_NAME], type, name[MAX_NAME];
+  unsigned long addr, bias = 0;
+  int have_bias = 0, pass, i;
+  FILE * nm;
+
+  for (i = 0; i < MAX_FUNCTIONS; i++)
+    if (functions[i].fn != NULL)
+      sprintf(functions[i].name, "%p", functions[i].fn);
+
+  /* Twice: once to find the bias, once to look the functions up.  (Not
+   * /proc/self, which would be the shell's.)
+   */
+  sprintf(command, "nm --defined-only /proc/%ld/exe 2>/dev/null", (long) getpid());
+  for (pass = 0; pass < 2; pass++) {
+    if ((nm = popen(command, "r")) == NULL)
+      return;
+    while (fgets(line, sizeof(line), nm) != NULL) {
+      if (sscanf(line, "%lx %c %199s", &addr, &type, name) != 3 || (type != 't' && type != 'T'))
+        continue;
+      if (pass == 0 && strcmp(name, "__cyg_profile_func_enter") == 0) {
+        bias = (unsigned long) __cyg_profile_func_enter - addr;
+        have_bias = 1;
+      } else if (pass == 1) {
+        struct function_counts * counts = lookup((void *) (addr + bias), 0);
+        if (counts != NULL)
+          strcpy(counts->name, name);
+      }
+    }
+    pclose(nm);
+    if (!have_bias)
+      return;
+  }
+}
+
+
+NO_PROFILE static int
+compare_self (const void * a, const void * b)
+{
+  const struct function_counts * x = a, * y = b;
+
+  if (x->self != y->self)
+    return x->self > y->self ? -1 : 1;
+  return strcmp(x->name, y->name);
+}
+
+/* Add what's already in the report file, then write it back out. */
+
+NO_PROFILE static void
+write_report (void) __attribute__((destructor));
+
+NO_PROFILE static void
+write_report (void)
+{
+  const char * filename = getenv("TO_PPM_PROFILE");
+  unsigned long long now = cycles(), self, total;
+  unsigned long calls;
+  char line[128 + MAX_NAME], name[MAX_NAME];
+  struct function_counts * counts;
+  FILE * file;
+  int i, n;
+
+  if (filename == NULL || *filename == '\0')
+    return;
+
+  /* Close the frames still open, main's at least, as if they returned now. */
+  while (depth > 0)
+    pop_frame(now);
+  name_functions();
+
+  if ((file = fopen(filename, "r")) != NULL) {
+    while (fgets(line, sizeof(line), file) != NULL) {
+      if (sscanf(line, "%lu %llu %llu %199s", &calls, &self, &total, name) != 4)
+        continue;
+      for (i = 0; i < MAX_FUNCTIONS; i++)
+        if (functions[i].fn != NULL && strcmp(functions[i].name, name) == 0)
+          break;
+      if (i == MAX_FUNCTIONS) {
+        /* Only in earlier runs: give it a slot of its own. */
+        for (i = 0; i < MAX_FUNCTIONS && functions[i].fn != NULL; i++)
+          ;
+        if (i == MAX_FUNCTIONS)
+          continue;
+        functions[i].fn = &functions[i];
+        strcpy(functions[i].name, name);
+      }
+      functions[i].calls += calls;
+      functions[i].self += self;
+      functions[i].total += total;
+    }
+    fclose(file);
+  }
+
+  /* Pack the used slots to the front and sort them. */
+  for (i = n = 0; i < MAX_FUNCTIONS; i++)
+    if (functions[i].fn != NULL && functions[i].calls > 0)
+      functions[n++] = functions[i];
+  qsort(functions, n, sizeof(functions[0]), compare_self);
+
+  if ((file = fopen(filename, "w")) == NULL) {
+    fprintf(stderr, "can't write %s\n", filename);
+    return;
+  }
+  fprintf(file, "%10s %16s %16s  %s\n", "calls", "self cycles", "total cycles", "function");
+  for (i = 0; i < n; i++) {
+    counts = &functions[i];
+    fprintf(file, "%10lu %16llu %16llu  %s\n", counts->calls, counts->self, counts->total,
+            counts->name);
+  }
+  fclose(file);
+}
@@ -0,0 +1,214 @@
+/*
+ * cache.c
+ *
+ * The on-disk cache of decoded images; see cache.h.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <dirent.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#define HAVE_PROTOTYPES
+#include <jpeglib.h>
+
+#include "cache.h"
+#pragma CHECKED_SCOPE on
+
+#define ENTRY_SUFFIX ".img"
+#define ENTRY_NAME_LEN (16 + sizeof(ENTRY_SUFFIX) - 1)	/* the key in hex, then ENTRY_SUFFIX */
+
+/*
+ * A 64-bit multiply-and-rotate hash over whole words, in the spirit of
+ * wyhash and friends, finished with the MurmurHash3 mixer.  It keeps up
+ * with reading the mapping, so hashing a hit costs about what reading it
+ * does.
+ */
+
+#define HASH_PRIME1 0x9E3779B185EBCA87ULL
+#define HASH_PRIME2 0xC2B2AE3D27D4EB4FULL
+
+static unsigned long long
+load_le64 (_Array_ptr<const JOCTET> p : count(8))
+{
+  unsigned long long v = 0;
+
+  for (int i = 7; i >= 0; i--)
+    v = (v << 8) | p[i];
+  return v;
+}
+
+unsigned long long
+cache_hash (_Array_ptr<const JOCTET> data : count(size), size_t size,
+            unsigned long long seed)
+{
+  unsigned long long h = seed ^ (size * HASH_PRIME1);
+  size_t i = 0;
+
+  for (; i + 8 <= size; i += 8) {
+    unsigned long long k =
+      load_le64(_Dynamic_bounds_cast<_Array_ptr<const JOCTET>>(data + i, count(8)));
+    k *= HASH_PRIME2;
+    k = (k << 31) | (k >> 33);
+    h = ((h ^ k) * HASH_PRIME1) + HASH_PRIME2;
+  }
+  for (; i < size; i++)
+    h = (h ^ data[i]) * HASH_PRIME1;
+
+  h ^= h >> 33;
+  h *= 0xFF51AFD7ED558CCDULL;
+  h ^= h >> 33;
+  h *= 0xC4CEB9FE1A85EC53ULL;
+  h ^= h >> 33;
+  return h;
+}
+
+
+/* Put the file name of key's entry in dir into path.  Returns 1 on success,
+ * 0 if it doesn't fit.
+ */
+
+static int
+entry_path (_Nt_array_ptr<const char> dir, unsigned long long key,
+            _Nt_array_ptr<char> path : count(size), size_t size)
+{
+  int len = 0;
+
+  _Unchecked {
+    len = snprintf((char *) path, size + 1, "%s/%016llx" ENTRY_SUFFIX,
+                   (const char *) dir, key);
+  }
+  return len >= 0 && (size_t) len <= size;
+}
+
+int
+cache_lookup (_Nt_array_ptr<const char> dir, unsigned long long key)
+{
+  char path _Nt_checked[CACHE_DIR_MAX + ENTRY_NAME_LEN + 2];
+  int fd = -1;
+
+  if (!entry_path(dir, key, path, sizeof(path) - 1))
+    return -1;
+  _Unchecked { fd = open((const char *) path, O_RDONLY); }
+  /* Reading doesn't move the modification time, so move it ourselves. */
+  if (fd >= 0)
+    _Unchecked { futimens(fd, NULL); }
+  return fd;
+}
+
+int
+cache_create (_Nt_array_ptr<const char> dir, _Nt_array_ptr<char> path : count(size),
+              size_t size)
+{
+  int len = 0, fd = -1;
+
+  _Unchecked {
+    len = snprintf((char *) path, size + 1, "%s/.tmp-XXXXXX", (const char *) dir);
+    if (len >= 0 && (size_t) len <= size)
+      fd = mkstemp((char *) path);
+  }
+  /* mkstemp makes the file private; entries are for every user of dir. */
+  if (fd >= 0)
+    fchmod(fd, 0644);
+  if (fd < 0)
+    fprintf(stderr, "can't create a cache entry in %s\n", dir);
+  return fd;
+}
+
+
+/*
+ * Eviction works through the POSIX directory interface and qsort, neither
+ * of which has checked declarations, so it is compiled outside the checked
+ * scope.  An entry another process has already removed is simply skipped.
+ */
+#pragma CHECKED_SCOPE push
+#pragma CHECKED_SCOPE off
+
+struct cache_entry {
+  struct timespec used;		/* modification time */
+  unsigned long long size;
+  char name[ENTRY_NAME_LEN + 1];
+};
+
+static int
+compare_use (const void *a, const void *b)
+{
+  const struct cache_entry *x = a, *y = b;
+
+  if (x->used.tv_sec != y->used.tv_sec)
+    return x->used.tv_sec < y->used.tv_sec ? -1 : 1;
+  if (x->used.tv_nsec != y->used.tv_nsec)
+    return x->used.tv_nsec < y->used.tv_nsec ? -1 : 1;
+  return 0;
+}
+
+static int
+is_entry_name (const char *name)
+{
+  if (strlen(name) != ENTRY_NAME_LEN || strcmp(name + 16, ENTRY_SUFFIX) != 0)
+    return 0;
+  for (int i = 0; i < 16; i++)
+    if (!((name[i] >= '0' && name[i] <= '9') || (name[i] >= 'a' && name[i] <= 'f')))
+      return 0;
+  return 1;
+}
+
+static void
+evict (const char *dir, unsigned long long budget)
+{
+  DIR *d = opendir(dir);
+  struct cache_entry *entries = NULL;
+  size_t count = 0, capacity = 0;
+  unsigned long long total = 0;
+  struct dirent *de;
+
+  if (d == NULL)
+    return;
+  int dfd = dirfd(d);
+  while ((de = readdir(d)) != NULL) {
+    struct stat st;
+    if (!is_entry_name(de->d_name) || fstatat(dfd, de->d_name, &st, 0) != 0)
+      continue;
+    if (count == capacity) {
+      size_t grown = capacity ? 2 * capacity : 256;
+      struct cache_entry *more = realloc(entries, grown * sizeof(*entries));
+      if (more == NULL)
+        break;
+      entries = more, capacity = grown;
+    }
+    entries[count].used = st.st_mtim;
+    entries[count].size = st.st_size;
+    strcpy(entries[count].name, de->d_name);
+    total += st.st_size;
+    count++;
+  }
+
+  if (total > budget) {
+    qsort(entries, count, sizeof(*entries), compare_use);
+    for (size_t i = 0; i < count && total > budget; i++) {
+      unlinkat(dfd, entries[i].name, 0);
+      total -= entries[i].size;
+    }
+  }
+  free(entries);
+  closedir(d);
+}
+
+#pragma CHECKED_SCOPE pop
+
+int
+cache_insert (_Nt_array_ptr<const char> dir, _Nt_array_ptr<const char> path,
+              unsigned long long key, unsigned long long budget)
+{
+  char entry _Nt_checked[CACHE_DIR_MAX + ENTRY_NAME_LEN + 2];
+
+  if (!entry_path(dir, key, entry, sizeof(entry) - 1) || rename(path, entry) != 0) {
+    remove(path);
+    return 0;
+  }
+  _Unchecked { evict((const char *) dir, budget); }
+  return 1;
+}
@@ -0,0 +1,53 @@
+/*
+ * cache.h
+ *
+ * An on-disk cache of decoded images.
+ *
+ * Each entry is the complete output of one conversion (headers and all),
+ * stored in its own file in the cache directory under a 64-bit key.  The
+ * key is a hash of the JPEG's bytes and of every option that changes the
+ * output, so the same file converted the same way always finds the same
+ * entry and a hit can be copied straight to the output without going near
+ * the library.
+ *
+ * New entries are written to a temporary file and renamed into place, so
+ * readers (other workers, or other processes sharing the directory) only
+ * ever see whole entries.  The modification time of an entry is its last
+ * use: a hit touches it, and when adding an entry takes the directory over
+ * its size budget the least recently used entries are removed.
+ *
+ * Include <stdio.h> and <jpeglib.h> before this file.
+ */
+
+#ifndef CACHE_H
+#define CACHE_H
+
+/* Longest cache directory name we can put entries in. */
+#define CACHE_DIR_MAX 3800
+
+/* Pass the cache key along: the hash so far goes in as seed.  Not a
+ * cryptographic hash; it only has to tell honest inputs apart.
+ */
+extern unsigned long long cache_hash(_Array_ptr<const JOCTET> data : count(size), size_t size,
+                                     unsigned long long seed);
+
+/* Open the entry for key, and mark it as just used.  Returns the file
+ * descriptor, or -1 if there is no such entry.
+ */
+extern int cache_lookup(_Nt_array_ptr<const char> dir, unsigned long long key);
+
+/* Create a temporary file in dir for a new entry, putting its name in
+ * path.  Returns the file descriptor, or -1 on error.
+ */
+extern int cache_create(_Nt_array_ptr<const char> dir,
+                        _Nt_array_ptr<char> path : count(size), size_t size);
+
+/* Publish the temporary file at path as the entry for key, then remove
+ * the least recently used entries until the whole cache fits in budget
+ * bytes.  Use remove(path) instead to drop a failed entry.  Returns 1 on
+ * success, 0 on error.
+ */
+extern int cache_insert(_Nt_array_ptr<const char> dir, _Nt_array_ptr<const char> path,
+                        unsigned long long key, unsigned long long budget);
+
+#endif /* CACHE_H */
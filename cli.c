@@ -0,0 +1,214 @@
+/*
+ * cli.c
+ *
+ * Command-line plumbing shared by to_ppm and from_ppm; see cli.h.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <limits.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#define HAVE_PROTOTYPES
+#include <jpeglib.h>
+
+#include "cli.h"
+#pragma CHECKED_SCOPE on
+
+int
+map_file (_Nt_array_ptr<char> filename, _Ptr<struct mapped_file> map, int advice)
+{
+  int fd = -1;
+  off_t file_size = 0;
+
+  _Unchecked {
+    struct stat st;
+    fd = open((const char *) filename, O_RDONLY);
+    if (fd >= 0 && fstat(fd, &st) == 0)
+      file_size = st.st_size;
+  }
+  if (fd < 0) {
+    fprintf(stderr, "can't open %s\n", filename);
+    return 0;
+  }
+  if (file_size <= 0) {
+    /* mmap refuses empty files; let the caller see a clean error instead. */
+    fprintf(stderr, "%s is empty\n", filename);
+    close(fd);
+    return 0;
+  }
+
+  size_t size = (size_t) file_size;
+  _Array_ptr<const JOCTET> base : count(size) = ((void *)0);
+  _Unchecked {
+    void *addr = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (addr != MAP_FAILED) {
+      madvise(addr, size, advice);
+      base = _Assume_bounds_cast<_Array_ptr<const JOCTET>>(addr, count(size));
+    }
+  }
+  /* The mapping stays valid after the descriptor is closed. */
+  close(fd);
+  if (base == NULL) {
+    fprintf(stderr, "can't map %s\n", filename);
+    return 0;
+  }
+
+  map->data = base, map->size = size;
+  return 1;
+}
+
+void
+unmap_file (_Ptr<struct mapped_file> map)
+{
+  _Unchecked { munmap((void *) map->data, map->size); }
+  map->data = ((void *)0), map->size = 0;
+}
+
+
+int
+input_list_add (_Ptr<struct input_list> list, _Nt_array_ptr<const char> name)
+{
+  _Nt_array_ptr<char> copy = strdup(name);
+  if (copy == NULL)
+    return 0;
+  if (list->count == list->capacity) {
+    int capacity = list->capacity ? 2 * list->capacity : 64;
+    _Array_ptr<_Nt_array_ptr<char>> names : count(capacity) =
+      calloc<_Nt_array_ptr<char>>(capacity, sizeof(_Nt_array_ptr<char>));
+    if (names == NULL) {
+      free<char>(copy);
+      return 0;
+    }
+    for (int k = 0; k < list->count; k++)
+      names[k] = list->names[k];
+    free<_Nt_array_ptr<char>>(list->names);
+    list->names = names, list->capacity = capacity;
+  }
+  list->names[list->count++] = copy;
+  return 1;
+}
+
+int
+input_list_read (_Ptr<struct input_list> list, _Nt_array_ptr<char> list_name)
+{
+  char line _Nt_checked[PATH_MAX + 1];
+  _Ptr<FILE> in = stdin;
+  int ok = 1;
+
+  if (strcmp(list_name, "-") != 0 && (in = fopen(list_name, "r")) == NULL) {
+    fprintf(stderr, "can't open %s\n", list_name);
+    return 0;
+  }
+  while (ok && fgets(line, PATH_MAX, in) != NULL) {
+    size_t len = strlen(line);
+    if (len > 0 && line[len - 1] == '\n')
+      line[--len] = '\0';
+    else if (len == PATH_MAX - 1 && !feof(in)) {
+      fprintf(stderr, "file name too long in %s\n", list_name);
+      ok = 0;
+      break;
+    }
+    if (len > 0)
+      ok = input_list_add(list, line);
+  }
+  if (in != stdin)
+    fclose(in);
+  return ok;
+}
+
+void
+input_list_free (_Ptr<struct input_list> list)
+{
+  for (int k = 0; k < list->count; k++)
+    free<char>(list->names[k]);
+  free<_Nt_array_ptr<char>>(list->names);
+  list->names = ((void *)0), list->capacity = 0;
+  list->count = 0;
+}
+
+
+int
+expand_output_template (_Nt_array_ptr<const char> tmpl, _Nt_array_ptr<const char> input,
+                        int index, _Nt_array_ptr<char> path : count(size), size_t size)
+{
+  char number _Nt_checked[24];
+  _Nt_array_ptr<const char> base = input;
+  _Nt_array_ptr<const char> dot = ((void *)0);
+  size_t len = 0;
+
+  /* Find the file name part of the input and its extension, if any. */
+  for (_Nt_array_ptr<const char> p = input; *p; p++) {
+    if (*p == '/')
+      base = p + 1, dot = ((void *)0);
+    else if (*p == '.' && p != base)
+      dot = p;
+  }
+
+  for (_Nt_array_ptr<const char> t = tmpl; *t; t++) {
+    if (*t == '%' && t[1] == 'b') {
+      for (_Nt_array_ptr<const char> p = base; *p && p != dot; p++) {
+        if (len >= size)
+          return 0;
+        path[len++] = *p;
+      }
+      t++;
+    } else if (*t == '%' && t[1] == 'n') {
+      snprintf(number, sizeof(number), "%d", index);
+      for (_Nt_array_ptr<const char> p = number; *p; p++) {
+        if (len >= size)
+          return 0;
+        path[len++] = *p;
+      }
+      t++;
+    } else {
+      if (*t == '%' && t[1] == '%')
+        t++;
+      if (len >= size)
+        return 0;
+      path[len++] = *t;
+    }
+  }
+  path[len] = '\0';
+  return 1;
+}
+
+
+int
+parse_numbers (_Nt_array_ptr<const char> arg, char sep,
+               _Array_ptr<JDIMENSION> values : count(n), int n)
+{
+  int k = 0;
+
+  values[0] = 0;
+  for (_Nt_array_ptr<const char> p = arg; *p; p++) {
+    if (*p == sep) {
+      if (++k == n)
+        return 0;
+      values[k] = 0;
+    } else if (*p >= '0' && *p <= '9' && values[k] <= 99999999) {
+      values[k] = values[k] * 10 + (*p - '0');
+    } else {
+      return 0;
+    }
+  }
+  return k == n - 1;
+}
+
+int
+parse_dct_method (_Nt_array_ptr<const char> name, _Ptr<J_DCT_METHOD> method)
+{
+  if (strcmp(name, "islow") == 0)
+    *method = JDCT_ISLOW;
+  else if (strcmp(name, "ifast") == 0)
+    *method = JDCT_IFAST;
+  else if (strcmp(name, "float") == 0)
+    *method = JDCT_FLOAT;
+  else
+    return 0;
+  return 1;
+}
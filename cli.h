@@ -0,0 +1,69 @@
+/*
+ * cli.h
+ *
+ * Command-line plumbing shared by to_ppm and from_ppm: input lists, output
+ * file name templates, mapped input files and option arguments.
+ *
+ * Include <stdio.h> and <jpeglib.h> before this file.
+ */
+
+#ifndef CLI_H
+#define CLI_H
+
+/* A read-only mapping of a whole input file.  The mapping is handed
+ * straight to the library (jpeg_mem_src, or jpeg_write_scanlines for a
+ * PPM), so it reads the page cache directly instead of going through
+ * stdio's buffer and its own.
+ */
+struct mapped_file {
+  _Array_ptr<const JOCTET> data : count(size);
+  size_t size;
+};
+
+/* Map filename into memory.  advice is passed to madvise: MADV_SEQUENTIAL
+ * when the whole file will be read, MADV_RANDOM when only its header will
+ * be, so the kernel doesn't read ahead the rest.  Returns 1 on success, 0
+ * on error after printing a message.
+ */
+extern int map_file(_Nt_array_ptr<char> filename, _Ptr<struct mapped_file> map, int advice);
+extern void unmap_file(_Ptr<struct mapped_file> map);
+
+/* The list of input files for a batch, in the order they were given. */
+struct input_list {
+  _Array_ptr<_Nt_array_ptr<char>> names : count(capacity);
+  int count;
+  int capacity;
+};
+
+/* Append a copy of name.  Returns 1 on success, 0 if out of memory. */
+extern int input_list_add(_Ptr<struct input_list> list, _Nt_array_ptr<const char> name);
+
+/* Append one file name per line of the named list file ("-" for stdin).
+ * Blank lines are ignored.  Returns 1 on success, 0 on error.
+ */
+extern int input_list_read(_Ptr<struct input_list> list, _Nt_array_ptr<char> list_name);
+extern void input_list_free(_Ptr<struct input_list> list);
+
+/* Build the output path for the index'th input from a template.  In the
+ * template, %b stands for the input's file name without directory or
+ * extension, %n for the index of the input in the batch (counting from 0),
+ * and %% for a single %.  Returns 1 on success, 0 if the result does not
+ * fit in size characters.
+ */
+extern int expand_output_template(_Nt_array_ptr<const char> tmpl,
+                                  _Nt_array_ptr<const char> input, int index,
+                                  _Nt_array_ptr<char> path : count(size), size_t size);
+
+/* Parse exactly n unsigned numbers separated by sep, eg "640x480" with
+ * sep 'x'.  An empty number counts as 0.  Returns 1 on success, 0 if arg
+ * is malformed.
+ */
+extern int parse_numbers(_Nt_array_ptr<const char> arg, char sep,
+                         _Array_ptr<JDIMENSION> values : count(n), int n);
+
+/* Map a --dct argument (islow, ifast or float) to the DCT method.  Returns
+ * 1 if name is known.
+ */
+extern int parse_dct_method(_Nt_array_ptr<const char> name, _Ptr<J_DCT_METHOD> method);
+
+#endif /* CLI_H */
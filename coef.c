@@ -0,0 +1,191 @@
+/*
+ * coef.c
+ *
+ * Coefficient dumps and DCT-domain hashes; see coef.h.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define HAVE_PROTOTYPES
+#include <jpeglib.h>
+
+#include "coef.h"
+#include "writer.h"
+#pragma CHECKED_SCOPE on
+
+/* Side of the grid the hash averages the DC terms over. */
+#define HASH_GRID 8
+
+/* Decode the coefficients, returning the n = num_components arrays. */
+
+static _Array_ptr<_Ptr<struct jvirt_barray_control>>
+read_arrays (j_decompress_ptr cinfo, int n) : count(n)
+{
+  _Array_ptr<_Ptr<struct jvirt_barray_control>> arrays : count(n) = ((void *)0);
+
+  _Unchecked {
+    arrays = _Assume_bounds_cast<_Array_ptr<_Ptr<struct jvirt_barray_control>>>
+		((jvirt_barray_ptr *) jpeg_read_coefficients(cinfo), count(n));
+  }
+  return arrays;
+}
+
+/* Block row row of a component's array, width blocks wide. */
+
+static _Array_ptr<JBLOCK>
+block_row (j_decompress_ptr cinfo, _Ptr<struct jvirt_barray_control> array,
+           JDIMENSION row, JDIMENSION width) : count(width)
+{
+  _Array_ptr<JBLOCK> blocks : count(width) = ((void *)0);
+
+  _Unchecked {
+    JBLOCKARRAY rows = (*cinfo->mem->access_virt_barray)
+		((_Ptr<struct jpeg_common_struct>) cinfo, array, row, 1, FALSE);
+    blocks = _Assume_bounds_cast<_Array_ptr<JBLOCK>>(*rows, count(width));
+  }
+  return blocks;
+}
+
+/* snprintf into a line buffer and queue the result.  Returns the writer's
+ * status.
+ */
+
+static int
+write_text (_Ptr<struct writer> out, _Nt_array_ptr<char> line : count(size), size_t size,
+            int len)
+{
+  if (len < 0)
+    return 0;
+  if ((size_t) len >= size)
+    len = (int) size;
+  return writer_write(out, _Dynamic_bounds_cast<_Array_ptr<const char>>(line, count(len)),
+                      (size_t) len);
+}
+
+
+int
+coef_dump (j_decompress_ptr cinfo, _Ptr<struct writer> out)
+{
+  int n = cinfo->num_components;
+  _Array_ptr<_Ptr<struct jvirt_barray_control>> arrays : count(n) = read_arrays(cinfo, n);
+  char line _Nt_checked[128];
+
+  int ok = write_text(out, line, sizeof(line) - 1,
+                      snprintf(line, sizeof(line), "JCOEF %u %u %d\n",
+                               cinfo->image_width, cinfo->image_height, n));
+
+  /* Each table once, however many components share it. */
+  for (int c = 0; ok && c < n; c++) {
+    int used_before = 0;
+    for (int d = 0; d < c; d++) {
+      if (cinfo->comp_info[d].quant_tbl_no == cinfo->comp_info[c].quant_tbl_no)
+        used_before = 1;
+    }
+    _Ptr<JQUANT_TBL> qtbl = cinfo->comp_info[c].quant_table;
+    if (used_before || qtbl == NULL)
+      continue;
+    ok = write_text(out, line, sizeof(line) - 1,
+                    snprintf(line, sizeof(line), "q %d", cinfo->comp_info[c].quant_tbl_no));
+    for (int k = 0; ok && k < DCTSIZE2; k++)
+      ok = write_text(out, line, sizeof(line) - 1,
+                      snprintf(line, sizeof(line), " %u", qtbl->quantval[k]));
+    if (ok)
+      ok = writer_write(out, "\n", 1);
+  }
+
+  for (int c = 0; ok && c < n; c++) {
+    jpeg_component_info comp = cinfo->comp_info[c];
+    ok = write_text(out, line, sizeof(line) - 1,
+                    snprintf(line, sizeof(line), "c %d %d %d %d %u %u\n",
+                             comp.component_id, comp.h_samp_factor, comp.v_samp_factor,
+                             comp.quant_tbl_no, comp.width_in_blocks,
+                             comp.height_in_blocks));
+  }
+  if (ok)
+    ok = writer_write(out, "\n", 1);
+
+  /* The blocks, converted to little-endian a block at a time. */
+  for (int c = 0; ok && c < n; c++) {
+    JDIMENSION width = cinfo->comp_info[c].width_in_blocks;
+    JDIMENSION height = cinfo->comp_info[c].height_in_blocks;
+    for (JDIMENSION row = 0; ok && row < height; row++) {
+      _Array_ptr<JBLOCK> blocks : count(width) = block_row(cinfo, arrays[c], row, width);
+      for (JDIMENSION b = 0; ok && b < width; b++) {
+        _Array_ptr<char> bytes : count(2 * DCTSIZE2) = writer_reserve(out, 2 * DCTSIZE2);
+        if (bytes == NULL) {
+          ok = 0;
+          break;
+        }
+        for (int k = 0; k < DCTSIZE2; k++) {
+          unsigned int v = (unsigned short) blocks[b][k];
+          bytes[2 * k] = (char) (v & 0xFF);
+          bytes[2 * k + 1] = (char) (v >> 8);
+        }
+        writer_commit(out, 2 * DCTSIZE2);
+      }
+    }
+  }
+  return ok;
+}
+
+
+int
+coef_hash (j_decompress_ptr cinfo, _Nt_array_ptr<const char> name,
+           _Ptr<struct writer> out)
+{
+  int n = cinfo->num_components;
+  _Array_ptr<_Ptr<struct jvirt_barray_control>> arrays : count(n) = read_arrays(cinfo, n);
+  jpeg_component_info comp = cinfo->comp_info[0];
+  long sum _Checked[HASH_GRID * HASH_GRID] = {0};
+  long count _Checked[HASH_GRID * HASH_GRID] = {0};
+  long cell _Checked[HASH_GRID * HASH_GRID];
+  long sorted _Checked[HASH_GRID * HASH_GRID];
+  long dc_step = comp.quant_table != NULL ? comp.quant_table->quantval[0] : 1;
+
+  /* Average the DC terms over the grid.  In an image fewer than HASH_GRID
+   * blocks across, some cells get no block of their own; they take the one
+   * they fall in instead.
+   */
+  for (JDIMENSION row = 0; row < comp.height_in_blocks; row++) {
+    _Array_ptr<JBLOCK> blocks : count(comp.width_in_blocks) =
+      block_row(cinfo, arrays[0], row, comp.width_in_blocks);
+    JDIMENSION gy = row * HASH_GRID / comp.height_in_blocks;
+    for (JDIMENSION b = 0; b < comp.width_in_blocks; b++) {
+      JDIMENSION gx = b * HASH_GRID / comp.width_in_blocks;
+      sum[gy * HASH_GRID + gx] += blocks[b][0] * dc_step;
+      count[gy * HASH_GRID + gx]++;
+    }
+  }
+  for (int i = 0; i < HASH_GRID * HASH_GRID; i++) {
+    if (count[i] == 0) {
+      int gy = i / HASH_GRID, gx = i % HASH_GRID;
+      JDIMENSION row = (JDIMENSION) gy * comp.height_in_blocks / HASH_GRID;
+      JDIMENSION b = (JDIMENSION) gx * comp.width_in_blocks / HASH_GRID;
+      /* The cell containing that block. */
+      int j = (int) (row * HASH_GRID / comp.height_in_blocks) * HASH_GRID +
+              (int) (b * HASH_GRID / comp.width_in_blocks);
+      cell[i] = count[j] ? sum[j] / count[j] : 0;
+    } else {
+      cell[i] = sum[i] / count[i];
+    }
+  }
+
+  /* The median, from an insertion sort of the 64 cells. */
+  for (int i = 0; i < HASH_GRID * HASH_GRID; i++) {
+    int j = i;
+    for (; j > 0 && sorted[j - 1] > cell[i]; j--)
+      sorted[j] = sorted[j - 1];
+    sorted[j] = cell[i];
+  }
+  long median2 = sorted[HASH_GRID * HASH_GRID / 2 - 1] + sorted[HASH_GRID * HASH_GRID / 2];
+
+  unsigned long long hash = 0;
+  for (int i = 0; i < HASH_GRID * HASH_GRID; i++)
+    hash = hash << 1 | (2 * cell[i] > median2);
+
+  char line _Nt_checked[4096];
+  return write_text(out, line, sizeof(line) - 1,
+                    snprintf(line, sizeof(line), "%s %016llx\n", name, hash));
+}
@@ -0,0 +1,50 @@
+/*
+ * coef.h
+ *
+ * Working on an image's DCT coefficients instead of its pixels.
+ *
+ * jpeg_read_coefficients stops after entropy decoding, leaving the quantized
+ * coefficients of every block in virtual arrays; the IDCT, upsampling and
+ * color conversion, which are most of the work of a full decode, never run.
+ * That is all that is needed to look at the quantization tables and the
+ * coefficients themselves, or to compare images by their DC terms.
+ *
+ * Both functions are called on a decompressor whose header has been read,
+ * and call jpeg_read_coefficients themselves.  Errors in the JPEG data go to
+ * cinfo's error manager as usual; the caller must still finish or abort the
+ * decompression afterwards.
+ *
+ * Include <stdio.h> and <jpeglib.h> before this file.
+ */
+
+#ifndef COEF_H
+#define COEF_H
+
+struct writer;			/* see writer.h */
+
+/* Write the image's coefficients to out.  The dump is a text header,
+ *
+ *	JCOEF width height components
+ *	q table v0 ... v63		one line per quantization table used
+ *	c id h v table wb hb		one line per component
+ *
+ * followed by a blank line and then, for each component in turn, its
+ * hb rows of wb blocks, each block 64 signed 16-bit little-endian
+ * coefficients in natural (row-major, not zigzag) order.  h and v are the
+ * sampling factors and wb x hb the component's size in blocks.  Returns 1
+ * on success, 0 if writing failed.
+ */
+extern int coef_dump(j_decompress_ptr cinfo, _Ptr<struct writer> out);
+
+/* Write a line "name hash" to out, with a 64-bit perceptual hash of the
+ * image as 16 hex digits.  The hash is taken from the dequantized DC terms
+ * of the first component (the luma, for YCbCr), which are the averages of
+ * its 8x8 blocks: they are averaged again over an 8x8 grid covering the
+ * image, and each bit says whether one cell is brighter than the median.
+ * Images that look alike have hashes that differ in few bits, whatever
+ * their size or quality.  Returns 1 on success, 0 if writing failed.
+ */
+extern int coef_hash(j_decompress_ptr cinfo, _Nt_array_ptr<const char> name,
+                     _Ptr<struct writer> out);
+
+#endif /* COEF_H */
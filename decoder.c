@@ -0,0 +1,107 @@
+/*
+ * decoder.c
+ *
+ * The reusable decompressor and its error handling; see decoder.h.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <setjmp.h>
+
+#define HAVE_PROTOTYPES
+#include <jpeglib.h>
+
+#include "arena.h"
+#include "decoder.h"
+#pragma CHECKED_SCOPE on
+
+/*
+ * Here's the routine that will replace the standard error_exit method:
+ */
+
+void
+my_error_exit (j_common_ptr cinfo)
+{
+  /* cinfo->err really points to a my_error_mgr struct, so coerce pointer */
+  my_error_ptr myerr = _Dynamic_bounds_cast<_Ptr<struct my_error_mgr>>(cinfo->err);
+
+  /* Always display the message. */
+  /* We could postpone this until after returning, if we chose. */
+  (*cinfo->err->output_message) (cinfo);
+
+  /* Return control to the setjmp point */
+  _Unchecked { longjmp(myerr->setjmp_buffer, 1); }
+}
+
+
+int
+decoder_init (_Ptr<struct decoder> dec)
+{
+  /* Step 1: allocate and initialize JPEG decompression object */
+
+  /* We set up the normal JPEG error routines, then override error_exit. */
+  dec->cinfo.err = jpeg_std_error(&dec->jerr.pub);
+  dec->jerr.pub.error_exit = my_error_exit;
+  dec->stats = ((void *)0);
+  /* Establish the setjmp return context for my_error_exit to use. */
+  int jmp = 0;
+  _Unchecked { jmp = setjmp(dec->jerr.setjmp_buffer); }
+  if (jmp) {
+    /* The library failed to create the object (eg, out of memory). */
+    jpeg_destroy_decompress(&dec->cinfo);
+    return 0;
+  }
+  /* Now we can initialize the JPEG decompression object. */
+  jpeg_create_decompress(&dec->cinfo);
+  /* Without the arena we just keep the library's own memory manager. */
+  _Unchecked { dec->arena = arena_install((j_common_ptr) &dec->cinfo); }
+  return 1;
+}
+
+void
+decoder_recover (_Ptr<struct decoder> dec)
+{
+  if (dec->arena != NULL)
+    dec->cinfo.mem = dec->arena;
+}
+
+void
+decoder_destroy (_Ptr<struct decoder> dec)
+{
+  decoder_recover(dec);
+  /* This is an important step since it will release a good deal of memory. */
+  jpeg_destroy_decompress(&dec->cinfo);
+}
+
+
+JDIMENSION
+imcu_output_rows (j_decompress_ptr cinfo)
+{
+#if JPEG_LIB_VERSION >= 70
+  return cinfo->max_v_samp_factor * cinfo->min_DCT_v_scaled_size;
+#else
+  return cinfo->max_v_samp_factor * cinfo->min_DCT_scaled_size;
+#endif
+}
+
+JDIMENSION
+imcu_output_cols (j_decompress_ptr cinfo)
+{
+#if JPEG_LIB_VERSION >= 70
+  return cinfo->max_h_samp_factor * cinfo->min_DCT_h_scaled_size;
+#else
+  return cinfo->max_h_samp_factor * cinfo->min_DCT_scaled_size;
+#endif
+}
+
+
+void
+choose_scale (j_decompress_ptr cinfo, JDIMENSION width, JDIMENSION height)
+{
+  cinfo->scale_denom = DCTSIZE;
+  for (cinfo->scale_num = 1; cinfo->scale_num < DCTSIZE; cinfo->scale_num++) {
+    jpeg_calc_output_dimensions(cinfo);
+    if (cinfo->output_width >= width && cinfo->output_height >= height)
+      return;
+  }
+}
@@ -0,0 +1,76 @@
+/*
+ * decoder.h
+ *
+ * The reusable decompressor shared by to_ppm and libto_ppm.
+ *
+ * A decoder bundles the JPEG decompression object with the setjmp-based
+ * error manager from the IJG example and an arena memory manager (see
+ * arena.h).  It is set up once and then used for one image after another:
+ * between images the decompression is only finished or aborted, so the
+ * object, its permanent pool and its data source manager stay alive, and
+ * after the first few images the decoder stops calling malloc.
+ *
+ * Every function that decodes with it establishes its own setjmp return
+ * point in jerr.setjmp_buffer before calling the library, and on the way
+ * back from an error calls decoder_recover before aborting.
+ *
+ * Include <stdio.h>, <setjmp.h> and <jpeglib.h> before this file.
+ */
+
+#ifndef DECODER_H
+#define DECODER_H
+
+struct image_stats;		/* see stats.h */
+
+/* An error manager whose error_exit, my_error_exit, displays the message
+ * through output_message and then longjmps back to setjmp_buffer.
+ */
+struct my_error_mgr {
+  struct jpeg_error_mgr pub;	/* "public" fields */
+  jmp_buf setjmp_buffer : itype(struct __jmp_buf_tag _Checked[1]);	/* for return to caller */
+};
+
+typedef _Ptr<struct my_error_mgr> my_error_ptr;
+
+extern void my_error_exit(j_common_ptr cinfo);
+
+/* The error manager lives alongside the JPEG object, so it is guaranteed
+ * to last as long as the object does.
+ */
+struct decoder {
+  struct jpeg_decompress_struct cinfo;
+  struct my_error_mgr jerr;
+  _Ptr<struct jpeg_memory_mgr> arena;	/* or NULL if it couldn't be made */
+  _Ptr<struct image_stats> stats;	/* where to count, or NULL */
+};
+
+/* Allocate and initialize the JPEG decompression object.  Returns 1 on
+ * success, 0 on error.
+ */
+extern int decoder_init(_Ptr<struct decoder> dec);
+
+/* Put the arena back after an error: a failed allocation in the library's
+ * manager can longjmp out while the arena has swapped that manager in.
+ */
+extern void decoder_recover(_Ptr<struct decoder> dec);
+
+/* Release the object and all its memory. */
+extern void decoder_destroy(_Ptr<struct decoder> dec);
+
+/* Number of output scanlines the decompressor produces per iMCU row, and
+ * the width in output pixels of one iMCU column.  Only valid after
+ * jpeg_start_decompress (or jpeg_calc_output_dimensions).
+ */
+extern JDIMENSION imcu_output_rows(j_decompress_ptr cinfo);
+extern JDIMENSION imcu_output_cols(j_decompress_ptr cinfo);
+
+/* Pick the smallest IDCT scaling factor M/8 that still gives an output
+ * image at least width x height (either may be 0 to leave it
+ * unconstrained).  The library never scales up here; if even 8/8 is too
+ * small, that is what we get.  Scaling in the IDCT skips most of the work
+ * for the discarded coefficients, so this is far cheaper than decoding in
+ * full and then shrinking.
+ */
+extern void choose_scale(j_decompress_ptr cinfo, JDIMENSION width, JDIMENSION height);
+
+#endif /* DECODER_H */
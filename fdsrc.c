@@ -0,0 +1,126 @@
+/*
+ * fdsrc.c
+ *
+ * File descriptor source manager; see fdsrc.h.
+ */
+
+#include <stdio.h>
+#include <errno.h>
+#include <poll.h>
+#include <unistd.h>
+
+#define HAVE_PROTOTYPES
+#include <jpeglib.h>
+#include <jerror.h>
+
+#include "fdsrc.h"
+#pragma CHECKED_SCOPE on
+
+static const JOCTET fake_eoi _Checked[2] = { 0xFF, JPEG_EOI };
+
+static _Ptr<struct fd_source>
+fd_source_of (j_decompress_ptr cinfo)
+{
+  return _Dynamic_bounds_cast<_Ptr<struct fd_source>>(cinfo->src);
+}
+
+/* Make bytes offset.. of the given buffer the next ones read. */
+
+static void
+fd_position (_Ptr<struct fd_source> src,
+             _Array_ptr<const JOCTET> base : count(size), size_t size, size_t offset)
+{
+  src->pub.bytes_in_buffer = size - offset;
+  if (offset < size)
+    src->pub.next_input_byte = _Dynamic_bounds_cast<_Ptr<const JOCTET>>(base + offset);
+}
+
+static void
+fd_init_source (j_decompress_ptr cinfo)
+{
+  _Ptr<struct fd_source> src = fd_source_of(cinfo);
+
+  src->eof = FALSE;
+}
+
+static boolean
+fd_fill_input_buffer (j_decompress_ptr cinfo)
+{
+  _Ptr<struct fd_source> src = fd_source_of(cinfo);
+  ssize_t n = -1;
+
+  if (!src->eof) {
+    do {
+      _Unchecked { n = read(src->fd, (void *) src->buffer, sizeof(src->buffer)); }
+    } while (n < 0 && errno == EINTR);
+  }
+  if (n <= 0) {
+    /* As jdatasrc.c does, insert a fake EOI so the image can be finished. */
+    src->eof = TRUE;
+    cinfo->err->msg_code = JWRN_JPEG_EOF;
+    _Unchecked { (*cinfo->err->emit_message)((j_common_ptr) cinfo, -1); }
+    fd_position(src, fake_eoi, sizeof(fake_eoi), 0);
+    return TRUE;
+  }
+  src->length = (size_t) n;
+  fd_position(src, src->buffer, src->length, 0);
+  return TRUE;
+}
+
+static void
+fd_skip_input_data (j_decompress_ptr cinfo, long num_bytes)
+{
+  _Ptr<struct fd_source> src = fd_source_of(cinfo);
+
+  if (num_bytes <= 0)
+    return;
+  while ((size_t) num_bytes > src->pub.bytes_in_buffer) {
+    num_bytes -= (long) src->pub.bytes_in_buffer;
+    (void) fd_fill_input_buffer(cinfo);
+  }
+  size_t left = src->pub.bytes_in_buffer - (size_t) num_bytes;
+  if (src->eof)
+    fd_position(src, fake_eoi, sizeof(fake_eoi), sizeof(fake_eoi) - left);
+  else
+    fd_position(src, src->buffer, src->length, src->length - left);
+}
+
+static void
+fd_term_source (j_decompress_ptr cinfo)
+{
+  /* no work necessary here */
+}
+
+
+void
+fd_source_init (j_decompress_ptr cinfo, _Ptr<struct fd_source> src, int fd)
+{
+  src->fd = fd;
+  src->eof = FALSE;
+  src->length = 0;
+  src->pub.init_source = fd_init_source;
+  src->pub.fill_input_buffer = fd_fill_input_buffer;
+  src->pub.skip_input_data = fd_skip_input_data;
+  src->pub.resync_to_restart = jpeg_resync_to_restart;
+  src->pub.term_source = fd_term_source;
+  src->pub.bytes_in_buffer = 0;
+  src->pub.next_input_byte = ((void *)0);
+  cinfo->src = &src->pub;
+}
+
+int
+fd_source_ready (_Ptr<struct fd_source> src)
+{
+  int ready = 0;
+
+  if (src->eof)
+    return 1;
+  _Unchecked {
+    struct pollfd pfd;
+    pfd.fd = src->fd;
+    pfd.events = POLLIN;
+    pfd.revents = 0;
+    ready = poll(&pfd, 1, 0) > 0;
+  }
+  return ready;
+}
@@ -0,0 +1,39 @@
+/*
+ * fdsrc.h
+ *
+ * A data source manager that reads a file descriptor with read(2).
+ *
+ * Unlike jpeg_stdio_src, it can say whether more data has already arrived
+ * without waiting for it.  That lets a decoder working from a pipe or a
+ * socket absorb everything that is there, show what it has, and only then
+ * block for the rest.
+ *
+ * Include <stdio.h> and <jpeglib.h> before this file.
+ */
+
+#ifndef FDSRC_H
+#define FDSRC_H
+
+/* Bytes asked for per read(2). */
+#define FD_SOURCE_BUFFER_SIZE 65536
+
+struct fd_source {
+  struct jpeg_source_mgr pub;	/* public fields */
+  int fd;
+  boolean eof;			/* read(2) has returned 0 or failed */
+  size_t length;			/* bytes of buffer filled by the last read */
+  JOCTET buffer _Checked[FD_SOURCE_BUFFER_SIZE];
+};
+
+/* Make cinfo read from fd through src, which must stay put until the
+ * decompression is finished or aborted.  Like jdatasrc.c, the source ends a
+ * truncated file with a fake EOI after a warning.
+ */
+extern void fd_source_init(j_decompress_ptr cinfo, _Ptr<struct fd_source> src, int fd);
+
+/* Returns 1 if reading more would not block: more data is waiting on the
+ * descriptor, beyond what src has buffered, or its end has been reached.
+ */
+extern int fd_source_ready(_Ptr<struct fd_source> src);
+
+#endif /* FDSRC_H */
@@ -0,0 +1,538 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <setjmp.h>
+#include <limits.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#define HAVE_PROTOTYPES
+#include <jpeglib.h>
+
+#include "arena.h"
+#include "cli.h"
+#include "decoder.h"
+#include "pool.h"
+#pragma CHECKED_SCOPE on
+
+/* By default each jpeg_write_scanlines call is given this many iMCU rows. */
+#define DEFAULT_BATCH_IMCU_ROWS 4
+
+#define DEFAULT_QUALITY 75
+
+/* Options controlling a single compression, filled in from the command line. */
+struct from_ppm_options {
+  int quality;			/* 1..100, for jpeg_set_quality */
+  J_DCT_METHOD dct_method;	/* forward DCT algorithm */
+  JDIMENSION batch_rows;	/* scanlines per write call, 0 for the default */
+  boolean mem_dest;		/* compress into memory, then write it at once */
+};
+
+
+/*
+ * A binary PPM (P6) or PGM (P5) image, with 8-bit samples, as it lies in a
+ * mapped file.
+ */
+
+struct ppm_image {
+  JDIMENSION width, height;
+  int components;		/* 3 for P6, 1 for P5 */
+  _Array_ptr<const JSAMPLE> pixels : count(size);
+  size_t size;			/* width * height * components */
+};
+
+LOCAL(int)
+ppm_space (JOCTET c)
+{
+  return c == ' ' || c == '\t' || c == '\n' || c == '\r' || c == '\v' || c == '\f';
+}
+
+/*
+ * Read the next number of a PNM header from data[*pos..size), skipping the
+ * whitespace and comments before it.  Returns 1 on success, 0 if there is
+ * no number there or it is too large.
+ */
+
+LOCAL(int)
+ppm_number (_Array_ptr<const JOCTET> data : count(size), size_t size,
+            _Ptr<size_t> pos, _Ptr<unsigned int> value)
+{
+  size_t i = *pos;
+
+  for (;;) {
+    while (i < size && ppm_space(data[i]))
+      i++;
+    if (i >= size || data[i] != '#')
+      break;
+    while (i < size && data[i] != '\n')
+      i++;
+  }
+  if (i >= size || data[i] < '0' || data[i] > '9')
+    return 0;
+  unsigned int v = 0;
+  for (; i < size && data[i] >= '0' && data[i] <= '9'; i++) {
+    if (v > 9999999)
+      return 0;
+    v = v * 10 + (data[i] - '0');
+  }
+  *value = v;
+  *pos = i;
+  return 1;
+}
+
+/*
+ * Find the image in a mapped PPM or PGM file.  Returns 1 on success, 0 on
+ * error after printing a message.
+ */
+
+LOCAL(int)
+parse_ppm (_Nt_array_ptr<char> filename, _Ptr<const struct mapped_file> map,
+           _Ptr<struct ppm_image> image)
+{
+  _Array_ptr<const JOCTET> data : count(map->size) = map->data;
+  size_t size = map->size;
+  size_t pos = 2;
+  unsigned int width = 0, height = 0, maxval = 0;
+
+  if (size < 2 || data[0] != 'P' || (data[1] != '5' && data[1] != '6')) {
+    fprintf(stderr, "%s is not a binary PPM or PGM file\n", filename);
+    return 0;
+  }
+  if (!ppm_number(data, size, &pos, &width) || !ppm_number(data, size, &pos, &height) ||
+      !ppm_number(data, size, &pos, &maxval) || pos >= size || !ppm_space(data[pos])) {
+    fprintf(stderr, "%s: bad PPM header\n", filename);
+    return 0;
+  }
+  pos++;			/* the single whitespace before the samples */
+  if (width == 0 || height == 0 || width > JPEG_MAX_DIMENSION || height > JPEG_MAX_DIMENSION) {
+    fprintf(stderr, "%s: can't compress a %ux%u image\n", filename, width, height);
+    return 0;
+  }
+  if (maxval != 255) {
+    fprintf(stderr, "%s: only 8-bit samples (maxval 255) are supported\n", filename);
+    return 0;
+  }
+
+  int components = data[1] == '6' ? 3 : 1;
+  size_t image_size = (size_t) width * height * components;
+  if (image_size > size - pos) {
+    fprintf(stderr, "%s is truncated\n", filename);
+    return 0;
+  }
+  image->width = width, image->height = height;
+  image->components = components;
+  image->pixels = _Dynamic_bounds_cast<_Array_ptr<const JSAMPLE>>(data + pos, count(image_size)),
+    image->size = image_size;
+  return 1;
+}
+
+
+/*
+ * A compressor that is set up once and reused for every image a worker
+ * encodes, the counterpart of struct decoder.  Between images the
+ * compression is only finished or aborted, and the image pool comes from
+ * an arena.  The buffer for --mem output is kept as well, and only grows.
+ */
+
+struct encoder {
+  struct jpeg_compress_struct cinfo;
+  struct my_error_mgr jerr;
+  _Ptr<struct jpeg_memory_mgr> arena;	/* or NULL if it couldn't be made */
+  _Array_ptr<unsigned char> mem : count(mem_size);
+  size_t mem_size;
+};
+
+/*
+ * Allocate and initialize the JPEG compression object.  Returns 1 on
+ * success, 0 on error.
+ */
+
+LOCAL(int)
+encoder_init (_Ptr<struct encoder> enc)
+{
+  /* Step 1: allocate and initialize JPEG compression object */
+
+  /* We have to set up the error handler first, in case the initialization
+   * step fails.  (Unlikely, but it could happen if you are out of memory.)
+   */
+  enc->cinfo.err = jpeg_std_error(&enc->jerr.pub);
+  enc->jerr.pub.error_exit = my_error_exit;
+  int jmp = 0;
+  _Unchecked { jmp = setjmp(enc->jerr.setjmp_buffer); }
+  if (jmp) {
+    jpeg_destroy_compress(&enc->cinfo);
+    return 0;
+  }
+  /* Now we can initialize the JPEG compression object. */
+  jpeg_create_compress(&enc->cinfo);
+  _Unchecked { enc->arena = arena_install((j_common_ptr) &enc->cinfo); }
+  return 1;
+}
+
+/* As decoder_recover: put the arena back after an error. */
+
+LOCAL(void)
+encoder_recover (_Ptr<struct encoder> enc)
+{
+  if (enc->arena != NULL)
+    enc->cinfo.mem = enc->arena;
+}
+
+LOCAL(void)
+encoder_destroy (_Ptr<struct encoder> enc)
+{
+  encoder_recover(enc);
+  /* This is an important step since it will release a good deal of memory. */
+  jpeg_destroy_compress(&enc->cinfo);
+  free<unsigned char>(enc->mem);
+  enc->mem = ((void *)0), enc->mem_size = 0;
+}
+
+/*
+ * Make the --mem buffer big enough for any JPEG of image, so that
+ * jpeg_mem_dest never has to replace it.  The bound is the one
+ * libjpeg-turbo's tjBufSize gives for 4:4:4, the worst case: six bytes per
+ * pixel of the image padded to whole MCUs, plus room for the headers.
+ * Returns 1 on success, 0 if out of memory.
+ */
+
+LOCAL(int)
+reserve_mem_dest (_Ptr<struct encoder> enc, _Ptr<const struct ppm_image> image)
+{
+  size_t padded_width = ((size_t) image->width + 15) & ~(size_t) 15;
+  size_t padded_height = ((size_t) image->height + 15) & ~(size_t) 15;
+  size_t need = padded_width * padded_height * 6 + 2048;
+
+  if (enc->mem_size >= need)
+    return 1;
+  free<unsigned char>(enc->mem);
+  enc->mem = ((void *)0), enc->mem_size = 0;
+  _Array_ptr<unsigned char> mem : count(need) = malloc<unsigned char>(need);
+  if (mem == NULL)
+    return 0;
+  enc->mem = mem, enc->mem_size = need;
+  return 1;
+}
+
+
+/*
+ * Sample routine for JPEG compression, after write_JPEG_file in the IJG
+ * example.  We assume that the compressor, the name of the source PPM or
+ * PGM file, the output stream and the options are passed in.  We want to
+ * return 1 on success, 0 on error; either way the compressor is left ready
+ * for the next image.
+ */
+
+GLOBAL(int)
+write_JPEG_file (_Ptr<struct encoder> enc, _Nt_array_ptr<char> filename,
+                 _Ptr<FILE> outfile, _Ptr<const struct from_ppm_options> opts)
+{
+  /* The JPEG compression parameters and pointers to working space (which
+   * is allocated as needed by the JPEG library) live in the encoder.
+   */
+  j_compress_ptr cinfo = &enc->cinfo;
+  struct mapped_file map = {};
+  struct ppm_image image = {};
+  JDIMENSION batch_rows;	/* scanlines passed per jpeg_write_scanlines */
+
+  /* The input is mapped and handed to the library in place. */
+  if (!map_file(filename, &map, MADV_SEQUENTIAL))
+    return 0;
+  if (!parse_ppm(filename, &map, &image) ||
+      (opts->mem_dest && !reserve_mem_dest(enc, &image))) {
+    unmap_file(&map);
+    return 0;
+  }
+  /* Where jpeg_mem_dest leaves the compressed image. */
+  _Ptr<unsigned char> outbuffer = enc->mem;
+  unsigned long outsize = enc->mem_size;
+
+  /* Establish the setjmp return context for my_error_exit to use. */
+  int jmp = 0;
+  _Unchecked { jmp = setjmp(enc->jerr.setjmp_buffer); }
+  if (jmp) {
+    /* If we get here, the JPEG code has signaled an error.  Abort the
+     * image, but keep the JPEG object for the next one.
+     */
+    encoder_recover(enc);
+    jpeg_abort_compress(cinfo);
+    unmap_file(&map);
+    return 0;
+  }
+
+  /* Step 2: specify data destination (eg, a file) */
+
+  if (opts->mem_dest)
+    jpeg_mem_dest(cinfo, &outbuffer, &outsize);
+  else
+    jpeg_stdio_dest(cinfo, outfile);
+
+  /* Step 3: set parameters for compression */
+
+  /* First we supply a description of the input image.
+   * Four fields of the cinfo struct must be filled in:
+   */
+  cinfo->image_width = image.width; 	/* image width and height, in pixels */
+  cinfo->image_height = image.height;
+  cinfo->input_components = image.components;	/* # of color components per pixel */
+  cinfo->in_color_space = image.components == 3 ? JCS_RGB : JCS_GRAYSCALE;
+  /* Now use the library's routine to set default compression parameters.
+   * (You must set at least cinfo->in_color_space before calling this,
+   * since the defaults depend on the source color space.)
+   */
+  jpeg_set_defaults(cinfo);
+  /* Now you can set any non-default parameters you wish to. */
+  jpeg_set_quality(cinfo, opts->quality, TRUE /* limit to baseline-JPEG values */);
+  cinfo->dct_method = opts->dct_method;
+
+  /* Step 4: Start compressor */
+
+  /* TRUE ensures that we will write a complete interchange-JPEG file.
+   * Pass TRUE unless you are very sure of what you're doing.
+   */
+  jpeg_start_compress(cinfo, TRUE);
+
+  /* Step 5: while (scan lines remain to be written) */
+  /*           jpeg_write_scanlines(...); */
+
+  /* We pass several whole iMCU rows per call, straight from the mapping.
+   * The library only reads the rows it is given, so they can point into
+   * the read-only pages.
+   */
+  size_t row_stride = (size_t) image.width * image.components;	/* JSAMPLEs per row */
+  batch_rows = opts->batch_rows;
+  if (batch_rows == 0)
+    batch_rows = DEFAULT_BATCH_IMCU_ROWS * cinfo->max_v_samp_factor * DCTSIZE;
+  if (batch_rows > image.height)
+    batch_rows = image.height;
+  JSAMPARRAY rows : count(batch_rows) = ((void *)0);
+  _Unchecked {
+    rows = _Assume_bounds_cast<JSAMPARRAY>((*cinfo->mem->alloc_small)
+		((_Ptr<struct jpeg_common_struct>) cinfo, JPOOL_IMAGE,
+		 batch_rows * sizeof(JSAMPROW)),
+		count(batch_rows));
+  }
+
+  /* Here we use the library's state variable cinfo->next_scanline as the
+   * loop counter, so that we don't have to keep track ourselves.
+   */
+  while (cinfo->next_scanline < cinfo->image_height) {
+    JDIMENSION num_rows = cinfo->image_height - cinfo->next_scanline;
+    if (num_rows > batch_rows)
+      num_rows = batch_rows;
+    for (JDIMENSION r = 0; r < num_rows; r++) {
+      _Array_ptr<const JSAMPLE> row : count(row_stride) =
+        _Dynamic_bounds_cast<_Array_ptr<const JSAMPLE>>
+		(image.pixels + (size_t) (cinfo->next_scanline + r) * row_stride,
+		 count(row_stride));
+      _Unchecked { rows[r] = _Assume_bounds_cast<JSAMPROW>((JSAMPLE *) row, count(row_stride)); }
+    }
+    (void) jpeg_write_scanlines(cinfo, rows, num_rows);
+  }
+
+  /* Step 6: Finish compression */
+
+  jpeg_finish_compress(cinfo);
+  unmap_file(&map);
+
+  /* The compressed image is all in memory: write it in one go. */
+  int ok = 1;
+  if (opts->mem_dest) {
+    _Array_ptr<unsigned char> jpeg : count(outsize) = ((void *)0);
+    _Unchecked {
+      jpeg = _Assume_bounds_cast<_Array_ptr<unsigned char>>(outbuffer, count(outsize));
+    }
+    ok = fwrite(jpeg, 1, outsize, outfile) == outsize;
+    /* Should the buffer have been too small after all, the library
+     * replaced it with a larger one of its own, which we keep instead.
+     */
+    if (outbuffer != enc->mem) {
+      free<unsigned char>(enc->mem);
+      enc->mem = jpeg, enc->mem_size = outsize;
+    }
+  }
+
+  /* Step 7: release JPEG compression object */
+
+  /* Nothing to do here: the object is kept for the next image, and
+   * encoder_destroy releases it at the end of the batch.
+   */
+  return ok;
+}
+
+
+/*
+ * A batch of compressions, shared read-only by all the workers.
+ */
+
+struct batch {
+  _Ptr<const struct input_list> inputs;
+  _Ptr<const struct from_ppm_options> opts;
+  _Nt_array_ptr<const char> output_template;	/* or NULL for stdout */
+};
+
+/* Each worker thread owns a compressor. */
+
+struct pool_worker {
+  struct encoder enc;
+  _Ptr<const struct batch> batch;
+};
+
+/*
+ * Compress the job'th input of the batch.  Failures are reported here, so
+ * the rest of the batch carries on.  Returns 1 on success, 0 on error.
+ */
+
+METHODDEF(int)
+encode_job (_Ptr<struct pool_worker> worker, int job)
+{
+  _Ptr<const struct batch> batch = worker->batch;
+  _Nt_array_ptr<char> file = batch->inputs->names[job];
+  char path _Nt_checked[PATH_MAX + 1];
+  _Ptr<FILE> outfile = stdout;
+
+  /* VERY IMPORTANT: use "b" option to fopen() if you are on a machine that
+   * requires it in order to write binary files.
+   */
+  if (batch->output_template != NULL) {
+    if (!expand_output_template(batch->output_template, file, job, path, PATH_MAX)) {
+      fprintf(stderr, "%s: output file name too long\n", file);
+      return 0;
+    }
+    if ((outfile = fopen(path, "wb")) == NULL) {
+      fprintf(stderr, "can't create %s\n", path);
+      return 0;
+    }
+  }
+
+  int ok = write_JPEG_file(&worker->enc, file, outfile, batch->opts);
+
+  if (outfile != stdout) {
+    if (fclose(outfile) != 0)
+      ok = 0;
+    /* Don't leave truncated images behind. */
+    if (!ok)
+      remove(path);
+  } else if (fflush(stdout) != 0) {
+    ok = 0;
+  }
+  if (!ok)
+    fprintf(stderr, "%s: compression failed\n", file);
+  return ok;
+}
+
+
+void usage(void) {
+  fprintf(stderr, "usage: from_ppm [options] file.ppm...\n");
+  fprintf(stderr, "  --quality N    compression quality, 1-100 (default: %d)\n",
+          DEFAULT_QUALITY);
+  fprintf(stderr, "  --dct METHOD   DCT to use: islow (default), ifast or float\n");
+  fprintf(stderr, "  --rows N       compress N scanlines per call (default: %d iMCU rows)\n",
+          DEFAULT_BATCH_IMCU_ROWS);
+  fprintf(stderr, "  --mem          compress each image into memory with jpeg_mem_dest,\n");
+  fprintf(stderr, "                 then write it in one go\n");
+  fprintf(stderr, "  --files-from F read more input names from F, one per line (- for stdin)\n");
+  fprintf(stderr, "  -o TEMPLATE    write each image to its own file instead of stdout;\n");
+  fprintf(stderr, "                 %%b is the input name without extension, %%n its index\n");
+  fprintf(stderr, "  --jobs N, -j N compress N files at a time (0: one per CPU); needs -o\n");
+}
+
+int main(int argc, _Array_ptr<_Nt_array_ptr<char>> argv : count(argc)) {
+  struct from_ppm_options opts = {
+    .quality = DEFAULT_QUALITY,
+    .dct_method = JDCT_DEFAULT,
+    .batch_rows = 0,
+    .mem_dest = FALSE
+  };
+  struct input_list inputs = {};
+  _Nt_array_ptr<char> files_from = ((void *)0);
+  _Nt_array_ptr<char> output_template = ((void *)0);
+  int num_jobs = 1;
+
+  for (int i = 1; i < argc; i++) {
+    _Nt_array_ptr<char> arg = argv[i];
+    if (strcmp(arg, "--quality") == 0 && i + 1 < argc) {
+      opts.quality = atoi(argv[++i]);
+      if (opts.quality < 1 || opts.quality > 100) {
+        usage();
+        return EXIT_FAILURE;
+      }
+    } else if (strcmp(arg, "--dct") == 0 && i + 1 < argc) {
+      if (!parse_dct_method(argv[++i], &opts.dct_method)) {
+        usage();
+        return EXIT_FAILURE;
+      }
+    } else if (strcmp(arg, "--rows") == 0 && i + 1 < argc) {
+      int rows = atoi(argv[++i]);
+      if (rows <= 0) {
+        usage();
+        return EXIT_FAILURE;
+      }
+      opts.batch_rows = rows;
+    } else if (strcmp(arg, "--mem") == 0) {
+      opts.mem_dest = TRUE;
+    } else if (strcmp(arg, "--files-from") == 0 && i + 1 < argc) {
+      files_from = argv[++i];
+    } else if (strcmp(arg, "-o") == 0 && i + 1 < argc) {
+      output_template = argv[++i];
+    } else if ((strcmp(arg, "--jobs") == 0 || strcmp(arg, "-j") == 0) && i + 1 < argc) {
+      num_jobs = atoi(argv[++i]);
+      if (num_jobs < 0) {
+        usage();
+        return EXIT_FAILURE;
+      }
+    } else if (arg[0] == '-') {
+      usage();
+      return EXIT_FAILURE;
+    } else if (!input_list_add(&inputs, arg)) {
+      fprintf(stderr, "out of memory\n");
+      return EXIT_FAILURE;
+    }
+  }
+  if (files_from != NULL && !input_list_read(&inputs, files_from))
+    return EXIT_FAILURE;
+  if (inputs.count == 0) {
+    usage();
+    return EXIT_FAILURE;
+  }
+
+  if (num_jobs == 0)
+    num_jobs = (int) sysconf(_SC_NPROCESSORS_ONLN);
+  if (num_jobs > inputs.count)
+    num_jobs = inputs.count;
+  if (num_jobs < 1)
+    num_jobs = 1;
+  if (num_jobs > 1 && output_template == NULL) {
+    fprintf(stderr, "--jobs needs -o: parallel images can't share stdout\n");
+    return EXIT_FAILURE;
+  }
+
+  struct batch batch = { &inputs, &opts, output_template };
+  _Array_ptr<struct pool_worker> workers : count(num_jobs) =
+    calloc<struct pool_worker>(num_jobs, sizeof(struct pool_worker));
+  _Array_ptr<_Ptr<struct pool_worker>> worker_ptrs : count(num_jobs) =
+    calloc<_Ptr<struct pool_worker>>(num_jobs, sizeof(_Ptr<struct pool_worker>));
+  if (workers == NULL || worker_ptrs == NULL) {
+    fprintf(stderr, "out of memory\n");
+    return EXIT_FAILURE;
+  }
+  for (int w = 0; w < num_jobs; w++) {
+    if (!encoder_init(&workers[w].enc)) {
+      fprintf(stderr, "can't create JPEG compressor\n");
+      return EXIT_FAILURE;
+    }
+    workers[w].batch = &batch;
+    worker_ptrs[w] = &workers[w];
+  }
+
+  int failures = pool_run(inputs.count, worker_ptrs, num_jobs, encode_job);
+  if (failures > 0)
+    fprintf(stderr, "%d of %d compressions failed\n", failures, inputs.count);
+
+  for (int w = 0; w < num_jobs; w++)
+    encoder_destroy(&workers[w].enc);
+  free<_Ptr<struct pool_worker>>(worker_ptrs);
+  free<struct pool_worker>(workers);
+  input_list_free(&inputs);
+  return failures == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+}
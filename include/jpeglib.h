@@ -68,7 +68,7 @@ extern "C" {
 
 typedef _Array_ptr<JSAMPLE> JSAMPROW;      /* ptr to one image row of pixel samples. */
 typedef _Array_ptr<JSAMPROW> JSAMPARRAY;   /* ptr to some rows (a 2-D sample array) */
-typedef _Ptr<JSAMPARRAY> JSAMPIMAGE; /* a 3-D sample array: top index is color */
+typedef _Array_ptr<JSAMPARRAY> JSAMPIMAGE; /* a 3-D sample array: top index is color */
 
 typedef JCOEF JBLOCK _Checked[64]; /* one block of coefficients */
 typedef _Ptr<JBLOCK> JBLOCKROW;      /* pointer to one row of coefficient blocks */
@@ -593,7 +593,7 @@ struct jpeg_decompress_struct {
 
   int data_precision;           /* bits of precision in image data */
 
-  _Ptr<jpeg_component_info> comp_info;
+  _Array_ptr<jpeg_component_info> comp_info : count(num_components);
   /* comp_info[i] describes component that appears i'th in SOF */
 
 #if JPEG_LIB_VERSION >= 80
@@ -902,7 +902,7 @@ EXTERN(void) jpeg_stdio_src(struct jpeg_decompress_struct *cinfo : itype(j_decom
 #if JPEG_LIB_VERSION >= 80 || defined(MEM_SRCDST_SUPPORTED)
 /* Data source and destination managers: memory buffers. */
 EXTERN(void) jpeg_mem_dest(struct jpeg_compress_struct *cinfo : itype(j_compress_ptr), unsigned char **outbuffer : itype(_Ptr<_Ptr<unsigned char>>), unsigned long *outsize : itype(_Ptr<unsigned long>));
-EXTERN(void) jpeg_mem_src(struct jpeg_decompress_struct *cinfo : itype(j_decompress_ptr), const unsigned char *inbuffer : itype(_Ptr<const unsigned char>), unsigned long insize);
+EXTERN(void) jpeg_mem_src(struct jpeg_decompress_struct *cinfo : itype(j_decompress_ptr), const unsigned char *inbuffer : itype(_Array_ptr<const unsigned char>) count(insize), unsigned long insize);
 #endif
 
 /* Default parameter setup for compression */
@@ -933,7 +933,7 @@ EXTERN(void) jpeg_calc_jpeg_dimensions(struct jpeg_compress_struct *cinfo : ityp
 #endif
 
 /* Replaces jpeg_write_scanlines when writing raw downsampled data. */
-EXTERN(JDIMENSION) jpeg_write_raw_data(struct jpeg_compress_struct *cinfo : itype(j_compress_ptr), unsigned char ***data : itype(JSAMPIMAGE), JDIMENSION num_lines);
+EXTERN(JDIMENSION) jpeg_write_raw_data(struct jpeg_compress_struct *cinfo : itype(j_compress_ptr), unsigned char ***data : itype(JSAMPIMAGE) count(MAX_COMPONENTS), JDIMENSION num_lines);
 
 /* Write a special marker.  See libjpeg.txt concerning safe usage. */
 EXTERN(void) jpeg_write_marker(struct jpeg_compress_struct *cinfo : itype(j_compress_ptr), int marker, const JOCTET *dataptr : itype(_Ptr<const JOCTET>), unsigned int datalen);
@@ -968,7 +968,7 @@ EXTERN(void) jpeg_crop_scanline(struct jpeg_decompress_struct *cinfo : itype(j_d
 EXTERN(boolean) jpeg_finish_decompress(struct jpeg_decompress_struct *cinfo : itype(j_decompress_ptr));
 
 /* Replaces jpeg_read_scanlines when reading raw downsampled data. */
-EXTERN(JDIMENSION) jpeg_read_raw_data(struct jpeg_decompress_struct *cinfo : itype(j_decompress_ptr), unsigned char ***data : itype(JSAMPIMAGE), JDIMENSION max_lines);
+EXTERN(JDIMENSION) jpeg_read_raw_data(struct jpeg_decompress_struct *cinfo : itype(j_decompress_ptr), unsigned char ***data : itype(JSAMPIMAGE) count(MAX_COMPONENTS), JDIMENSION max_lines);
 
 /* Additional entry points for buffered-image mode. */
 EXTERN(boolean) jpeg_has_multiple_scans(struct jpeg_decompress_struct *cinfo : itype(j_decompress_ptr));
@@ -0,0 +1,224 @@
+/*
+ * libto_ppm.c
+ *
+ * The to_ppm decoder as a library; see libto_ppm.h.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <setjmp.h>
+
+#define HAVE_PROTOTYPES
+#include <jpeglib.h>
+#include <jerror.h>
+
+#include "decoder.h"
+#include "libto_ppm.h"
+#pragma CHECKED_SCOPE on
+
+struct to_ppm_decoder {
+  struct decoder dec;		/* must be first: see decoder_of */
+  char message _Nt_checked[JMSG_LENGTH_MAX];
+};
+
+static _Ptr<struct to_ppm_decoder>
+decoder_of (j_common_ptr cinfo)
+{
+  return _Dynamic_bounds_cast<_Ptr<struct to_ppm_decoder>>(cinfo);
+}
+
+/* Replaces output_message, which my_error_exit calls for every error and
+ * the library for the first warning: keep the text instead of printing it.
+ */
+
+static void
+keep_message (j_common_ptr cinfo)
+{
+  _Ptr<struct to_ppm_decoder> d = decoder_of(cinfo);
+
+  (*cinfo->err->format_message)(cinfo, d->message);
+}
+
+/* What the error my_error_exit has just returned from amounts to. */
+
+static enum to_ppm_status
+error_status (_Ptr<struct to_ppm_decoder> d)
+{
+  switch (d->dec.jerr.pub.msg_code) {
+  case JERR_OUT_OF_MEMORY:
+    return TO_PPM_ERR_NOMEM;
+  case JERR_INPUT_EMPTY:
+    return TO_PPM_ERR_EMPTY;
+  case JERR_NO_SOI:
+    return TO_PPM_ERR_NOT_JPEG;
+  case JERR_ARITH_NOTIMPL:
+  case JERR_BAD_PRECISION:
+  case JERR_CONVERSION_NOTIMPL:
+  case JERR_NOT_COMPILED:
+  case JERR_NOTIMPL:
+    return TO_PPM_ERR_UNSUPPORTED;
+  default:
+    return TO_PPM_ERR_CORRUPT;
+  }
+}
+
+/* Back from my_error_exit: leave the decoder ready for the next image. */
+
+static enum to_ppm_status
+recover (_Ptr<struct to_ppm_decoder> d)
+{
+  decoder_recover(&d->dec);
+  jpeg_abort_decompress(&d->dec.cinfo);
+  return error_status(d);
+}
+
+/* Read the header and set up the decompression as params ask, filling in
+ * info.  Only called with a setjmp return point established.
+ */
+
+static void
+begin_image (_Ptr<struct to_ppm_decoder> d,
+             _Array_ptr<const JOCTET> data : count(size), size_t size,
+             _Ptr<const struct to_ppm_params> params, _Ptr<struct to_ppm_info> info)
+{
+  j_decompress_ptr cinfo = &d->dec.cinfo;
+  struct to_ppm_params defaults;
+
+  if (params == NULL) {
+    to_ppm_default_params(&defaults);
+    params = &defaults;
+  }
+  jpeg_mem_src(cinfo, data, size);
+  (void) jpeg_read_header(cinfo, TRUE);
+  if (params->target_width != 0 || params->target_height != 0)
+    choose_scale(cinfo, params->target_width, params->target_height);
+  cinfo->dct_method = params->dct_method;
+  cinfo->do_fancy_upsampling = params->fancy_upsampling;
+  jpeg_calc_output_dimensions(cinfo);
+
+  info->width = cinfo->output_width;
+  info->height = cinfo->output_height;
+  info->components = cinfo->output_components;
+  info->color_space = cinfo->jpeg_color_space;
+  info->progressive = cinfo->progressive_mode;
+  info->warnings = d->dec.jerr.pub.num_warnings;
+}
+
+
+void
+to_ppm_default_params (_Ptr<struct to_ppm_params> params)
+{
+  params->target_width = 0;
+  params->target_height = 0;
+  params->dct_method = JDCT_DEFAULT;
+  params->fancy_upsampling = TRUE;
+}
+
+_Ptr<struct to_ppm_decoder>
+to_ppm_create (void)
+{
+  _Ptr<struct to_ppm_decoder> d = calloc<struct to_ppm_decoder>(1, sizeof(struct to_ppm_decoder));
+
+  if (d == NULL)
+    return NULL;
+  if (!decoder_init(&d->dec)) {
+    free<struct to_ppm_decoder>(d);
+    return NULL;
+  }
+  d->dec.jerr.pub.output_message = keep_message;
+  return d;
+}
+
+void
+to_ppm_destroy (_Ptr<struct to_ppm_decoder> dec)
+{
+  decoder_destroy(&dec->dec);
+  free<struct to_ppm_decoder>(dec);
+}
+
+enum to_ppm_status
+to_ppm_probe (_Ptr<struct to_ppm_decoder> dec,
+              _Array_ptr<const JOCTET> data : count(size), size_t size,
+              _Ptr<const struct to_ppm_params> params, _Ptr<struct to_ppm_info> info)
+{
+  int jmp = 0;
+
+  dec->message[0] = '\0';
+  _Unchecked { jmp = setjmp(dec->dec.jerr.setjmp_buffer); }
+  if (jmp)
+    return recover(dec);
+
+  begin_image(dec, data, size, params, info);
+  jpeg_abort_decompress(&dec->dec.cinfo);
+  return TO_PPM_OK;
+}
+
+enum to_ppm_status
+to_ppm_decode (_Ptr<struct to_ppm_decoder> dec,
+               _Array_ptr<const JOCTET> data : count(size), size_t size,
+               _Ptr<const struct to_ppm_params> params,
+               _Array_ptr<JSAMPLE> buffer : count(buffer_size), size_t buffer_size,
+               _Ptr<struct to_ppm_info> info)
+{
+  j_decompress_ptr cinfo = &dec->dec.cinfo;
+  int jmp = 0;
+
+  dec->message[0] = '\0';
+  _Unchecked { jmp = setjmp(dec->dec.jerr.setjmp_buffer); }
+  if (jmp)
+    return recover(dec);
+
+  begin_image(dec, data, size, params, info);
+  size_t row_stride = (size_t) info->width * info->components;
+  if (info->height > 0 && row_stride > buffer_size / info->height) {
+    jpeg_abort_decompress(cinfo);
+    return TO_PPM_ERR_BUFFER_TOO_SMALL;
+  }
+
+  (void) jpeg_start_decompress(cinfo);
+
+  /* The rows go straight into the caller's buffer, an iMCU row at a time. */
+  JDIMENSION batch_rows = imcu_output_rows(cinfo);
+  if (batch_rows < (JDIMENSION) cinfo->rec_outbuf_height)
+    batch_rows = cinfo->rec_outbuf_height;
+  JSAMPARRAY rows : count(batch_rows) = ((void *)0);
+  _Unchecked {
+    rows = _Assume_bounds_cast<JSAMPARRAY>((*cinfo->mem->alloc_small)
+		((_Ptr<struct jpeg_common_struct>) cinfo, JPOOL_IMAGE,
+		 batch_rows * sizeof(JSAMPROW)),
+		count(batch_rows));
+  }
+  while (cinfo->output_scanline < cinfo->output_height) {
+    JDIMENSION num_rows = cinfo->output_height - cinfo->output_scanline;
+    if (num_rows > batch_rows)
+      num_rows = batch_rows;
+    for (JDIMENSION r = 0; r < num_rows; r++)
+      rows[r] = buffer + (size_t) (cinfo->output_scanline + r) * row_stride;
+    (void) jpeg_read_scanlines(cinfo, rows, num_rows);
+  }
+
+  (void) jpeg_finish_decompress(cinfo);
+  info->warnings = dec->dec.jerr.pub.num_warnings;
+  return TO_PPM_OK;
+}
+
+_Nt_array_ptr<const char>
+to_ppm_message (_Ptr<struct to_ppm_decoder> dec)
+{
+  return dec->message;
+}
+
+_Nt_array_ptr<const char>
+to_ppm_status_string (enum to_ppm_status status)
+{
+  switch (status) {
+  case TO_PPM_OK: return "success";
+  case TO_PPM_ERR_NOMEM: return "out of memory";
+  case TO_PPM_ERR_EMPTY: return "empty input";
+  case TO_PPM_ERR_NOT_JPEG: return "not a JPEG file";
+  case TO_PPM_ERR_UNSUPPORTED: return "unsupported JPEG file";
+  case TO_PPM_ERR_CORRUPT: return "corrupt JPEG data";
+  case TO_PPM_ERR_BUFFER_TOO_SMALL: return "output buffer too small";
+  default: return "unknown error";
+  }
+}
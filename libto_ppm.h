@@ -0,0 +1,96 @@
+/*
+ * libto_ppm.h
+ *
+ * The to_ppm decoder as a library, for programs that would otherwise run
+ * to_ppm once per image and read its output through a pipe.
+ *
+ * A program creates a decoder once and then decodes any number of
+ * in-memory JPEG images with it, one at a time, each straight into a
+ * buffer of its own.  Like to_ppm's workers, the decoder keeps the JPEG
+ * object and its memory between images, so a steady stream of similar
+ * images is decoded without calling malloc.  A decoder may only be used by
+ * one thread at a time; threads each create their own.
+ *
+ * Nothing is printed.  Every call returns a status saying what went wrong,
+ * if anything, and to_ppm_message gives the library's own description.
+ *
+ * Include <stdio.h> and <jpeglib.h> before this file.
+ */
+
+#ifndef LIBTO_PPM_H
+#define LIBTO_PPM_H
+
+/* What a call did. */
+enum to_ppm_status {
+  TO_PPM_OK = 0,
+  TO_PPM_ERR_NOMEM,		/* out of memory */
+  TO_PPM_ERR_EMPTY,		/* no data at all */
+  TO_PPM_ERR_NOT_JPEG,		/* the data doesn't start with an SOI marker */
+  TO_PPM_ERR_UNSUPPORTED,	/* a JPEG the library can't decode, eg 12-bit */
+  TO_PPM_ERR_CORRUPT,		/* any other error in the JPEG data */
+  TO_PPM_ERR_BUFFER_TOO_SMALL	/* the image doesn't fit in the caller's buffer */
+};
+
+/* How to decode; see the options of the same names in to_ppm. */
+struct to_ppm_params {
+  /* Smallest acceptable output size, 0 if unconstrained.  The image is
+   * scaled down in the IDCT as far as possible while still meeting it.
+   */
+  JDIMENSION target_width, target_height;
+  J_DCT_METHOD dct_method;	/* IDCT algorithm */
+  boolean fancy_upsampling;	/* FALSE trades chroma quality for speed */
+};
+
+/* What is known about an image once it has been probed or decoded. */
+struct to_ppm_info {
+  JDIMENSION width, height;	/* of the output, after any scaling */
+  int components;		/* samples per output pixel: 1, 3 or 4 */
+  J_COLOR_SPACE color_space;	/* of the JPEG data */
+  boolean progressive;
+  long warnings;		/* corrupt-data warnings, eg for a truncated file */
+};
+
+struct to_ppm_decoder;
+
+/* Fill in the defaults: full size, the default IDCT, fancy upsampling. */
+extern void to_ppm_default_params(_Ptr<struct to_ppm_params> params);
+
+/* Create a decoder, or return NULL if out of memory. */
+extern _Ptr<struct to_ppm_decoder> to_ppm_create(void);
+extern void to_ppm_destroy(_Ptr<struct to_ppm_decoder> dec);
+
+/* Read the header of the size-byte image at data, and fill in info with
+ * what decoding it with params would give; params may be NULL for the
+ * defaults.  Nothing past the first scan's header is read.
+ */
+extern enum to_ppm_status to_ppm_probe(_Ptr<struct to_ppm_decoder> dec,
+                                       _Array_ptr<const JOCTET> data : count(size),
+                                       size_t size,
+                                       _Ptr<const struct to_ppm_params> params,
+                                       _Ptr<struct to_ppm_info> info);
+
+/* Decode the image at data into buffer, as info->height rows of
+ * info->width pixels, each info->components interleaved samples (gray,
+ * RGB or CMYK), with no padding.  If that is more than buffer_size
+ * samples, nothing is decoded and TO_PPM_ERR_BUFFER_TOO_SMALL returned,
+ * with info filled in as by to_ppm_probe so the caller can make room and
+ * try again.  On any other error, the contents of buffer are undefined.
+ */
+extern enum to_ppm_status to_ppm_decode(_Ptr<struct to_ppm_decoder> dec,
+                                        _Array_ptr<const JOCTET> data : count(size),
+                                        size_t size,
+                                        _Ptr<const struct to_ppm_params> params,
+                                        _Array_ptr<JSAMPLE> buffer : count(buffer_size),
+                                        size_t buffer_size,
+                                        _Ptr<struct to_ppm_info> info);
+
+/* The library's message for the error the last call failed with, or for
+ * the first warning it gave; empty if there was neither.  Valid until the
+ * next call on dec.
+ */
+extern _Nt_array_ptr<const char> to_ppm_message(_Ptr<struct to_ppm_decoder> dec);
+
+/* A short description of status, eg "not a JPEG file". */
+extern _Nt_array_ptr<const char> to_ppm_status_string(enum to_ppm_status status);
+
+#endif /* LIBTO_PPM_H */
@@ -0,0 +1,208 @@
+/*
+ * markers.c
+ *
+ * Zero-copy APPn and COM segments; see markers.h.
+ */
+
+#include <stdio.h>
+#include <string.h>
+
+#define HAVE_PROTOTYPES
+#include <jpeglib.h>
+
+#include "markers.h"
+#pragma CHECKED_SCOPE on
+
+#define ADOBE_APP 14		/* APP14, which the library interprets */
+
+/* Identifiers at the start of the payload, each with its terminating
+ * zero, which is part of the identifier.  EXIF's is followed by a pad byte.
+ */
+static const char exif_id _Checked[] = "Exif\0";
+static const char xmp_id _Checked[] = "http://ns.adobe.com/xap/1.0/";
+static const char icc_id _Checked[] = "ICC_PROFILE";
+
+static const char app_names _Checked[16][6] = {
+  "app0", "app1", "app2", "app3", "app4", "app5", "app6", "app7",
+  "app8", "app9", "app10", "app11", "app12", "app13", "app14", "app15"
+};
+
+_Nt_array_ptr<const char>
+marker_kind_name (unsigned kind)
+{
+  if (kind == MARKER_EXIF)
+    return "exif";
+  if (kind == MARKER_XMP)
+    return "xmp";
+  if (kind == MARKER_ICC)
+    return "icc";
+  if (kind == MARKER_COM)
+    return "com";
+  for (int n = 1; n < 16; n++)
+    if (kind == MARKER_APP(n))
+      return _Dynamic_bounds_cast<_Nt_array_ptr<const char>>(app_names[n], count(5));
+  return "?";
+}
+
+int
+markers_parse (_Nt_array_ptr<const char> list, _Ptr<unsigned> wanted)
+{
+  size_t len = strlen(list), start = 0;
+
+  *wanted = 0;
+  while (start <= len) {
+    size_t end = start;
+    while (end < len && list[end] != ',')
+      end++;
+    char name _Nt_checked[8] = {};
+    if (end - start >= sizeof(name))
+      return 0;
+    for (size_t i = start; i < end; i++)
+      name[i - start] = list[i];
+
+    unsigned kind = 0;
+    if (strcmp(name, "exif") == 0)
+      kind = MARKER_EXIF;
+    else if (strcmp(name, "xmp") == 0)
+      kind = MARKER_XMP;
+    else if (strcmp(name, "icc") == 0)
+      kind = MARKER_ICC;
+    else if (strcmp(name, "com") == 0)
+      kind = MARKER_COM;
+    for (int n = 1; n < 16 && kind == 0; n++) {
+      _Nt_array_ptr<const char> app : count(5) =
+        _Dynamic_bounds_cast<_Nt_array_ptr<const char>>(app_names[n], count(5));
+      if (n != ADOBE_APP && strcmp(name, app) == 0)
+        kind = MARKER_APP(n);
+    }
+    if (kind == 0)
+      return 0;
+    *wanted |= kind;
+    start = end + 1;
+  }
+  return 1;
+}
+
+
+/* Does the payload start with id, which is size bytes long? */
+
+static int
+has_id (_Array_ptr<const JOCTET> payload : count(length), size_t length,
+        _Array_ptr<const char> id : count(size), size_t size)
+{
+  if (length < size)
+    return 0;
+  for (size_t i = 0; i < size; i++)
+    if (payload[i] != (JOCTET) id[i])
+      return 0;
+  return 1;
+}
+
+/* The kinds that a processor for APPn has to look out for. */
+
+static unsigned
+app_kinds (int n)
+{
+  if (n == 1)
+    return MARKER_APP(1) | MARKER_EXIF | MARKER_XMP;
+  if (n == 2)
+    return MARKER_APP(2) | MARKER_ICC;
+  return MARKER_APP(n);
+}
+
+
+/*
+ * The marker processor.  The library calls it with the marker itself
+ * already read, so the source is at the segment's length field.  Since the
+ * source is a jpeg_mem_src over km's buffer, where it is in the file is
+ * just the distance from the start of the buffer.
+ */
+
+static boolean
+keep_segment (j_decompress_ptr cinfo)
+{
+  _Ptr<struct kept_markers> km = ((void *)0);
+  size_t offset = 0;
+  int inside = 0;
+
+  _Unchecked {
+    km = _Assume_bounds_cast<_Ptr<struct kept_markers>>(cinfo->client_data);
+    const JOCTET *next = (const JOCTET *) cinfo->src->next_input_byte;
+    const JOCTET *base = (const JOCTET *) km->data;
+    if (next >= base && next <= base + km->size)
+      offset = (size_t) (next - base), inside = 1;
+  }
+  if (!inside || km->size - offset < 2) {
+    /* Not reading our buffer after all: run out of data, which the library
+     * then reports as a truncated file.
+     */
+    (*cinfo->src->skip_input_data)(cinfo, (long) cinfo->src->bytes_in_buffer);
+    return TRUE;
+  }
+
+  /* Like the library, take a bad length at its word, up to the file's end. */
+  size_t length = (size_t) km->data[offset] << 8 | km->data[offset + 1];
+  if (length < 2)
+    length = 2;
+  if (length > km->size - offset)
+    length = km->size - offset;
+  size_t start = offset + 2, payload_length = length - 2;
+  _Array_ptr<const JOCTET> payload : count(payload_length) =
+    _Dynamic_bounds_cast<_Array_ptr<const JOCTET>>(km->data + start, count(payload_length));
+
+  int code = cinfo->unread_marker;
+  unsigned kind = 0;
+  if (code == JPEG_COM)
+    kind = MARKER_COM;
+  else if (code == JPEG_APP0 + 1 && has_id(payload, payload_length, exif_id, sizeof(exif_id)))
+    kind = MARKER_EXIF;
+  else if (code == JPEG_APP0 + 1 && has_id(payload, payload_length, xmp_id, sizeof(xmp_id)))
+    kind = MARKER_XMP;
+  else if (code == JPEG_APP0 + 2 && has_id(payload, payload_length, icc_id, sizeof(icc_id)))
+    kind = MARKER_ICC;
+  /* An EXIF segment is still an APP1 to someone who asked for those. */
+  if (!(kind & km->wanted) && code != JPEG_COM)
+    kind = MARKER_APP(code - JPEG_APP0);
+
+  if (kind & km->wanted) {
+    if (km->count < MAX_KEPT_MARKERS) {
+      struct marker_slice slice = { kind, code, start, payload_length };
+      km->slices[km->count++] = slice;
+    } else {
+      km->dropped++;
+    }
+  }
+  (*cinfo->src->skip_input_data)(cinfo, (long) length);
+  return TRUE;
+}
+
+
+void
+markers_begin (j_decompress_ptr cinfo, _Ptr<struct kept_markers> km, unsigned wanted,
+               _Array_ptr<const JOCTET> data : count(size), size_t size)
+{
+  km->wanted = wanted;
+  km->data = data, km->size = size;
+  km->count = km->dropped = 0;
+  _Unchecked { cinfo->client_data = (void *) km; }
+
+  if (wanted & MARKER_COM)
+    jpeg_set_marker_processor(cinfo, JPEG_COM, keep_segment);
+  for (int n = 1; n < 16; n++)
+    if (n != ADOBE_APP && (wanted & app_kinds(n)))
+      jpeg_set_marker_processor(cinfo, JPEG_APP0 + n, keep_segment);
+}
+
+void
+markers_end (j_decompress_ptr cinfo, _Ptr<struct kept_markers> km)
+{
+  /* Saving no bytes of a marker is how the library's defaults are asked
+   * for: skip it, or for APP0 and APP14 interpret it.
+   */
+  if (km->wanted & MARKER_COM)
+    jpeg_save_markers(cinfo, JPEG_COM, 0);
+  for (int n = 1; n < 16; n++)
+    if (n != ADOBE_APP && (km->wanted & app_kinds(n)))
+      jpeg_save_markers(cinfo, JPEG_APP0 + n, 0);
+  _Unchecked { cinfo->client_data = NULL; }
+}
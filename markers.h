@@ -0,0 +1,73 @@
+/*
+ * markers.h
+ *
+ * Finding selected APPn and COM segments without copying them.
+ *
+ * The library skips every APPn and COM segment it has no use for, and
+ * jpeg_save_markers would keep them by copying each one into memory of
+ * its own.  When the whole file is already in memory (mapped, say) there
+ * is no need for either: markers_begin installs a marker processor that
+ * notes where each wanted segment lies in the file and then skips it, so
+ * the caller gets EXIF, XMP or ICC data as slices of its own buffer and
+ * nothing in the segments is read or copied beyond their identifiers.
+ *
+ * APP0 (JFIF) and APP14 (Adobe) can't be kept: the library's own handlers
+ * for them decide the color space, and installing a processor would
+ * replace them.
+ *
+ * Include <stdio.h> and <jpeglib.h> before this file.
+ */
+
+#ifndef MARKERS_H
+#define MARKERS_H
+
+/* The segments one can ask for, as bits of a mask. */
+#define MARKER_APP(n)	(1U << (n))	/* any APPn, n from 1 to 15 but 14 */
+#define MARKER_EXIF	(1U << 16)	/* APP1 with the "Exif" identifier */
+#define MARKER_XMP	(1U << 17)	/* APP1 with the XMP namespace */
+#define MARKER_ICC	(1U << 18)	/* APP2 with ICC_PROFILE, one chunk each */
+#define MARKER_COM	(1U << 19)	/* comments */
+
+/* One segment found: its payload is length bytes at offset in the buffer,
+ * starting after the marker's length field (and so with the identifier).
+ */
+struct marker_slice {
+  unsigned kind;		/* a MARKER_* bit */
+  int code;			/* the marker, JPEG_APP0 + n or JPEG_COM */
+  size_t offset;
+  size_t length;
+};
+
+#define MAX_KEPT_MARKERS 32
+
+struct kept_markers {
+  unsigned wanted;		/* MARKER_* bits */
+  _Array_ptr<const JOCTET> data : count(size);	/* the whole file */
+  size_t size;
+  struct marker_slice slices _Checked[MAX_KEPT_MARKERS];
+  int count;			/* in file order */
+  int dropped;			/* wanted, but past MAX_KEPT_MARKERS */
+};
+
+/* Parse a comma-separated list of exif, xmp, icc, com and app1 to app15
+ * (but app14) into a mask.  Returns 1 on success, 0 if the list is bad.
+ */
+extern int markers_parse(_Nt_array_ptr<const char> list, _Ptr<unsigned> wanted);
+
+/* The name of a kind, as markers_parse spells it. */
+extern _Nt_array_ptr<const char> marker_kind_name(unsigned kind);
+
+/* Have cinfo, which must be reading the size bytes at data through
+ * jpeg_mem_src, note the wanted segments in km as it reads the header.
+ * Call before jpeg_read_header.
+ */
+extern void markers_begin(j_decompress_ptr cinfo, _Ptr<struct kept_markers> km,
+                          unsigned wanted, _Array_ptr<const JOCTET> data : count(size),
+                          size_t size);
+
+/* Put the library's own handling back, for the next image; km's slices
+ * stay valid as long as the buffer does.
+ */
+extern void markers_end(j_decompress_ptr cinfo, _Ptr<struct kept_markers> km);
+
+#endif /* MARKERS_H */
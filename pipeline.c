@@ -0,0 +1,308 @@
+/*
+ * pipeline.c
+ *
+ * A single-producer, single-consumer ring of row strips between the
+ * decoding thread and a converter thread; see pipeline.h.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+
+#define HAVE_PROTOTYPES
+#include <jpeglib.h>
+
+#include "sink.h"
+#include "pipeline.h"
+#pragma CHECKED_SCOPE on
+
+/* Strips in flight at once.  Two would already let the stages overlap; a
+ * few more absorb the variation in how long each strip takes either side.
+ * A power of 2, so the free-running indices wrap cleanly.
+ */
+#define RING_SLOTS 4
+
+/* One strip: num_rows rows of row_stride samples, at the front of rows. */
+struct ring_slot {
+  JSAMPROW rows : count(size);
+  size_t size;			/* samples allocated */
+  JDIMENSION num_rows;
+  size_t row_stride;
+};
+
+struct pipeline {
+  struct output_sink pub;	/* public fields */
+  _Ptr<struct output_sink> inner;	/* the sink doing the real work */
+  struct ring_slot slots _Checked[RING_SLOTS];
+  /* Slots are numbered from 0 for ever, slot n living in slots[n % RING_SLOTS].
+   * head is the next one the converter takes and tail the next one the
+   * decoder fills; only the converter writes head and only the decoder
+   * writes tail.
+   */
+  unsigned head, tail;
+  int failed;			/* inner's write_rows failed this image */
+
+  pthread_t thread;
+  pthread_mutex_t lock;		/* for sleeping only; see pipeline.h */
+  pthread_cond_t cond;		/* signalled when a sleeper may proceed */
+  int decoder_waiting, converter_waiting;	/* a side is asleep, or about to be */
+  int stop;			/* pipeline_destroy wants the thread to exit */
+};
+
+
+/*
+ * The indices and flags shared between the two threads, through the
+ * compiler's atomic builtins.  Sequential consistency on the flags and on
+ * the index stores that are followed by a flag test makes the sleep
+ * protocol safe: a side sets its waiting flag and then looks at the other
+ * side's index, while the other side stores its index and then looks at
+ * the flag, so at least one of them sees the other's store.
+ */
+
+static unsigned
+load_index (_Ptr<unsigned> index)
+{
+  unsigned value = 0;
+
+  _Unchecked { value = __atomic_load_n((unsigned *) index, __ATOMIC_SEQ_CST); }
+  return value;
+}
+
+static void
+store_index (_Ptr<unsigned> index, unsigned value)
+{
+  _Unchecked { __atomic_store_n((unsigned *) index, value, __ATOMIC_SEQ_CST); }
+}
+
+static int
+load_flag (_Ptr<int> flag)
+{
+  int value = 0;
+
+  _Unchecked { value = __atomic_load_n((int *) flag, __ATOMIC_SEQ_CST); }
+  return value;
+}
+
+static void
+store_flag (_Ptr<int> flag, int value)
+{
+  _Unchecked { __atomic_store_n((int *) flag, value, __ATOMIC_SEQ_CST); }
+}
+
+static void
+pipeline_lock (_Ptr<struct pipeline> p)
+{
+  _Unchecked { pthread_mutex_lock((pthread_mutex_t *) &p->lock); }
+}
+
+static void
+pipeline_unlock (_Ptr<struct pipeline> p)
+{
+  _Unchecked { pthread_mutex_unlock((pthread_mutex_t *) &p->lock); }
+}
+
+static void
+pipeline_wait (_Ptr<struct pipeline> p)
+{
+  _Unchecked {
+    pthread_cond_wait((pthread_cond_t *) &p->cond, (pthread_mutex_t *) &p->lock);
+  }
+}
+
+/* Wake the other side if it is asleep (or about to be) on waiting. */
+
+static void
+wake (_Ptr<struct pipeline> p, _Ptr<int> waiting)
+{
+  if (!load_flag(waiting))
+    return;
+  pipeline_lock(p);
+  _Unchecked { pthread_cond_broadcast((pthread_cond_t *) &p->cond); }
+  pipeline_unlock(p);
+}
+
+
+/* Decoder side: wait until the ring has fewer than room slots in use. */
+
+static void
+wait_for_room (_Ptr<struct pipeline> p, unsigned room)
+{
+  if (p->tail - load_index(&p->head) < room)
+    return;
+  pipeline_lock(p);
+  store_flag(&p->decoder_waiting, 1);
+  while (p->tail - load_index(&p->head) >= room)
+    pipeline_wait(p);
+  store_flag(&p->decoder_waiting, 0);
+  pipeline_unlock(p);
+}
+
+/* Converter side: wait for a slot, or to be stopped.  Returns 1 if there
+ * is a slot, 0 if told to stop.
+ */
+
+static int
+wait_for_slot (_Ptr<struct pipeline> p)
+{
+  if (load_index(&p->tail) != p->head)
+    return 1;
+  pipeline_lock(p);
+  store_flag(&p->converter_waiting, 1);
+  while (load_index(&p->tail) == p->head && !p->stop)
+    pipeline_wait(p);
+  store_flag(&p->converter_waiting, 0);
+  int more = load_index(&p->tail) != p->head;
+  pipeline_unlock(p);
+  return more;
+}
+
+
+/* The converter thread: pass each slot on to the real sink, in order.  After
+ * a failure the image's remaining slots are only drained, since the sink
+ * has already given up on it.
+ */
+
+static void
+pipeline_work (_Ptr<struct pipeline> p)
+{
+  while (wait_for_slot(p)) {
+    _Ptr<struct ring_slot> slot = &p->slots[p->head % RING_SLOTS];
+    if (!load_flag(&p->failed)) {
+      size_t n = slot->num_rows * slot->row_stride;
+      if (!(*p->inner->write_rows)(p->inner,
+                                   _Dynamic_bounds_cast<JSAMPROW>(slot->rows, count(n)),
+                                   slot->num_rows, slot->row_stride))
+        store_flag(&p->failed, 1);
+    }
+    store_index(&p->head, p->head + 1);
+    wake(p, &p->decoder_waiting);
+  }
+}
+
+/* pthread_create wants an unchecked start routine. */
+#pragma CHECKED_SCOPE push
+#pragma CHECKED_SCOPE off
+
+static void *
+pipeline_thread_main (void *arg)
+{
+  pipeline_work(_Assume_bounds_cast<_Ptr<struct pipeline>>(arg));
+  return NULL;
+}
+
+#pragma CHECKED_SCOPE pop
+
+
+/* The sink methods, all called on the decoding thread. */
+
+static _Ptr<struct pipeline>
+pipeline_of (_Ptr<struct output_sink> sink)
+{
+  return _Dynamic_bounds_cast<_Ptr<struct pipeline>>(sink);
+}
+
+static int
+pipeline_begin (_Ptr<struct output_sink> sink, _Ptr<const struct sink_image> image)
+{
+  _Ptr<struct pipeline> p = pipeline_of(sink);
+
+  /* The converter is idle between images, so nothing races with this. */
+  store_flag(&p->failed, 0);
+  return (*p->inner->begin_image)(p->inner, image);
+}
+
+static int
+pipeline_rows (_Ptr<struct output_sink> sink, JSAMPROW rows : count(num_rows * row_stride),
+               JDIMENSION num_rows, size_t row_stride)
+{
+  _Ptr<struct pipeline> p = pipeline_of(sink);
+  size_t n = num_rows * row_stride;
+
+  if (load_flag(&p->failed))
+    return 0;
+  wait_for_room(p, RING_SLOTS);
+  /* Until tail moves on, the converter won't touch this slot. */
+  _Ptr<struct ring_slot> slot = &p->slots[p->tail % RING_SLOTS];
+  if (slot->size < n) {
+    free<JSAMPLE>(slot->rows);
+    slot->rows = ((void *)0), slot->size = 0;
+    JSAMPROW grown : count(n) = malloc<JSAMPLE>(n);
+    if (grown == NULL) {
+      fprintf(stderr, "out of memory\n");
+      return 0;
+    }
+    slot->rows = grown, slot->size = n;
+  }
+  memcpy(_Dynamic_bounds_cast<JSAMPROW>(slot->rows, count(n)), rows, n);
+  slot->num_rows = num_rows, slot->row_stride = row_stride;
+  store_index(&p->tail, p->tail + 1);
+  wake(p, &p->converter_waiting);
+  return 1;
+}
+
+static int
+pipeline_end (_Ptr<struct output_sink> sink, boolean ok)
+{
+  _Ptr<struct pipeline> p = pipeline_of(sink);
+
+  /* Let the converter finish everything queued, even after an error, so
+   * the real sink is idle when it is told.
+   */
+  wait_for_room(p, 1);
+  int failed = load_flag(&p->failed);
+  return (*p->inner->end_image)(p->inner, ok && !failed) && !failed;
+}
+
+
+_Ptr<struct pipeline>
+pipeline_create (void)
+{
+  _Ptr<struct pipeline> p = calloc<struct pipeline>(1, sizeof(struct pipeline));
+  int started = 0;
+
+  if (p == NULL)
+    return ((void *)0);
+  p->pub.begin_image = pipeline_begin;
+  p->pub.write_rows = pipeline_rows;
+  p->pub.end_image = pipeline_end;
+  _Unchecked {
+    pthread_mutex_init((pthread_mutex_t *) &p->lock, NULL);
+    pthread_cond_init((pthread_cond_t *) &p->cond, NULL);
+    started = pthread_create((pthread_t *) &p->thread, NULL,
+                             pipeline_thread_main, (void *) p) == 0;
+    if (!started) {
+      pthread_cond_destroy((pthread_cond_t *) &p->cond);
+      pthread_mutex_destroy((pthread_mutex_t *) &p->lock);
+    }
+  }
+  if (!started) {
+    free<struct pipeline>(p);
+    return ((void *)0);
+  }
+  return p;
+}
+
+void
+pipeline_destroy (_Ptr<struct pipeline> p)
+{
+  pipeline_lock(p);
+  p->stop = 1;
+  _Unchecked { pthread_cond_broadcast((pthread_cond_t *) &p->cond); }
+  pipeline_unlock(p);
+  _Unchecked {
+    pthread_join(p->thread, NULL);
+    pthread_cond_destroy((pthread_cond_t *) &p->cond);
+    pthread_mutex_destroy((pthread_mutex_t *) &p->lock);
+  }
+  for (int i = 0; i < RING_SLOTS; i++)
+    free<JSAMPLE>(p->slots[i].rows);
+  free<struct pipeline>(p);
+}
+
+_Ptr<struct output_sink>
+pipeline_sink (_Ptr<struct pipeline> p, _Ptr<struct output_sink> inner)
+{
+  p->inner = inner;
+  return &p->pub;
+}
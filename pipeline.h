@@ -0,0 +1,50 @@
+/*
+ * pipeline.h
+ *
+ * Formatting decoded rows on a thread of their own.
+ *
+ * Normally the thread that runs jpeg_read_scanlines also formats every strip
+ * it decodes (ASCII samples, plane reordering) before decoding the next one.
+ * A pipeline splits that in two: its sink copies each strip into a slot of a
+ * small ring and returns at once, and a converter thread takes the slots in
+ * order and passes them to the real sink.  With a background writer (see
+ * writer.h) the output I/O is a third stage, so decoding, formatting and
+ * writing all overlap.
+ *
+ * The ring has one producer (the decoding thread) and one consumer (the
+ * converter), so handing a slot over takes no lock: each side only ever
+ * advances its own index, with release and acquire ordering so that a
+ * slot's contents are visible before its index is.  A side only takes the
+ * lock to sleep when the ring is full or empty.  The slots are allocated
+ * when first needed and grow to the largest strip seen, so after the first
+ * image a pipeline allocates nothing.
+ *
+ * begin_image and end_image are passed on from the decoding thread; end_image
+ * first waits for the converter to finish every slot of the image.  An error
+ * from the real sink's write_rows is reported by the next write_rows or by
+ * end_image, whichever comes first.
+ *
+ * Include <stdio.h> and <jpeglib.h>, and "sink.h", before this file.
+ */
+
+#ifndef PIPELINE_H
+#define PIPELINE_H
+
+struct pipeline;
+
+/* Start a pipeline and its converter thread.  Returns NULL if out of memory
+ * or if the thread can't be started.
+ */
+extern _Ptr<struct pipeline> pipeline_create(void);
+
+/* Stop the thread and free the slots.  No image may be in progress. */
+extern void pipeline_destroy(_Ptr<struct pipeline> p);
+
+/* A sink that passes everything on to inner through the pipeline; it stays
+ * valid until the next call.  Only one image at a time goes through a
+ * pipeline.
+ */
+extern _Ptr<struct output_sink> pipeline_sink(_Ptr<struct pipeline> p,
+                                              _Ptr<struct output_sink> inner);
+
+#endif /* PIPELINE_H */
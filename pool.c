@@ -0,0 +1,202 @@
+/*
+ * pool.c
+ *
+ * Work-stealing thread pool; see pool.h.
+ */
+
+#include <pthread.h>
+#include <stdlib.h>
+
+#include "pool.h"
+#pragma CHECKED_SCOPE on
+
+/* The jobs a worker has still to run: next, next+1, ..., end-1. */
+struct pool_range {
+  pthread_mutex_t lock;		/* protects next and end */
+  int next;
+  int end;
+};
+
+struct pool {
+  _Array_ptr<struct pool_range> ranges : count(num_workers);
+  _Array_ptr<_Ptr<struct pool_worker>> workers : count(num_workers);
+  int num_workers;
+  pool_job_fn run_job;
+  pthread_mutex_t lock;		/* protects failures */
+  int failures;
+};
+
+/* What each thread is started with. */
+struct pool_thread {
+  _Ptr<struct pool> pool;
+  int id;
+};
+
+
+static void
+range_lock (_Ptr<struct pool_range> range)
+{
+  _Unchecked { pthread_mutex_lock((pthread_mutex_t *) &range->lock); }
+}
+
+static void
+range_unlock (_Ptr<struct pool_range> range)
+{
+  _Unchecked { pthread_mutex_unlock((pthread_mutex_t *) &range->lock); }
+}
+
+
+/*
+ * Take the next job from the front of a worker's own range, or return -1 if
+ * the range is empty.
+ */
+
+static int
+take_job (_Ptr<struct pool_range> range)
+{
+  int job = -1;
+
+  range_lock(range);
+  if (range->next < range->end)
+    job = range->next++;
+  range_unlock(range);
+  return job;
+}
+
+/*
+ * Steal the back half of some other worker's range.  The first stolen job is
+ * returned to be run right away and the rest becomes the thief's own range.
+ * Returns -1 once every range is empty, which means the run is over: jobs
+ * are never added after the pool starts.
+ */
+
+static int
+steal_job (_Ptr<struct pool> pool, int thief)
+{
+  for (int k = 1; k < pool->num_workers; k++) {
+    _Ptr<struct pool_range> victim = &pool->ranges[(thief + k) % pool->num_workers];
+    int first = -1, end = -1;
+
+    range_lock(victim);
+    int remaining = victim->end - victim->next;
+    if (remaining > 0) {
+      first = victim->end - (remaining + 1) / 2;
+      end = victim->end;
+      victim->end = first;
+    }
+    range_unlock(victim);
+
+    if (first >= 0) {
+      _Ptr<struct pool_range> own = &pool->ranges[thief];
+      range_lock(own);
+      own->next = first + 1;
+      own->end = end;
+      range_unlock(own);
+      return first;
+    }
+  }
+  return -1;
+}
+
+/* The body of every worker thread, including the calling thread. */
+
+static void
+pool_work (_Ptr<struct pool> pool, int id)
+{
+  _Ptr<struct pool_worker> worker = pool->workers[id];
+  int failures = 0;
+
+  for (;;) {
+    int job = take_job(&pool->ranges[id]);
+    if (job < 0)
+      job = steal_job(pool, id);
+    if (job < 0)
+      break;
+    if (!(*pool->run_job)(worker, job))
+      failures++;
+  }
+
+  _Unchecked { pthread_mutex_lock((pthread_mutex_t *) &pool->lock); }
+  pool->failures += failures;
+  _Unchecked { pthread_mutex_unlock((pthread_mutex_t *) &pool->lock); }
+}
+
+/* pthread_create wants an unchecked start routine, so this trampoline is the
+ * only function compiled outside the checked scope.
+ */
+#pragma CHECKED_SCOPE push
+#pragma CHECKED_SCOPE off
+
+static void *
+pool_thread_main (void *arg)
+{
+  _Ptr<struct pool_thread> thread = _Assume_bounds_cast<_Ptr<struct pool_thread>>(arg);
+  pool_work(thread->pool, thread->id);
+  return NULL;
+}
+
+#pragma CHECKED_SCOPE pop
+
+
+int
+pool_run (int num_jobs,
+          _Array_ptr<_Ptr<struct pool_worker>> workers : count(num_workers),
+          int num_workers, pool_job_fn run_job)
+{
+  struct pool pool = {};
+
+  if (num_workers < 1)
+    return num_jobs;
+  _Array_ptr<struct pool_range> ranges : count(num_workers) =
+    calloc<struct pool_range>(num_workers, sizeof(struct pool_range));
+  _Array_ptr<struct pool_thread> threads : count(num_workers) =
+    calloc<struct pool_thread>(num_workers, sizeof(struct pool_thread));
+  _Array_ptr<pthread_t> thread_ids : count(num_workers) =
+    calloc<pthread_t>(num_workers, sizeof(pthread_t));
+  _Array_ptr<int> started : count(num_workers) =
+    calloc<int>(num_workers, sizeof(int));
+  if (ranges == NULL || threads == NULL || thread_ids == NULL || started == NULL) {
+    free<struct pool_range>(ranges);
+    free<struct pool_thread>(threads);
+    free<pthread_t>(thread_ids);
+    free<int>(started);
+    return num_jobs;
+  }
+
+  pool.ranges = ranges, pool.workers = workers, pool.num_workers = num_workers;
+  pool.run_job = run_job;
+  _Unchecked { pthread_mutex_init((pthread_mutex_t *) &pool.lock, NULL); }
+
+  /* Deal the jobs out in equal contiguous ranges. */
+  for (int w = 0; w < num_workers; w++) {
+    _Unchecked { pthread_mutex_init((pthread_mutex_t *) &ranges[w].lock, NULL); }
+    ranges[w].next = (int) ((long long) num_jobs * w / num_workers);
+    ranges[w].end = (int) ((long long) num_jobs * (w + 1) / num_workers);
+    threads[w].pool = &pool;
+    threads[w].id = w;
+  }
+
+  /* If a thread can't be started, its jobs are simply stolen by the others;
+   * worker 0 is always the calling thread, so someone is there to do so.
+   */
+  for (int w = 1; w < num_workers; w++) {
+    _Unchecked {
+      started[w] = pthread_create((pthread_t *) &thread_ids[w], NULL,
+                                  pool_thread_main, (void *) &threads[w]) == 0;
+    }
+  }
+  pool_work(&pool, 0);
+  for (int w = 1; w < num_workers; w++) {
+    if (started[w])
+      _Unchecked { pthread_join(thread_ids[w], NULL); }
+  }
+
+  for (int w = 0; w < num_workers; w++)
+    _Unchecked { pthread_mutex_destroy((pthread_mutex_t *) &ranges[w].lock); }
+  _Unchecked { pthread_mutex_destroy((pthread_mutex_t *) &pool.lock); }
+  free<struct pool_range>(ranges);
+  free<struct pool_thread>(threads);
+  free<pthread_t>(thread_ids);
+  free<int>(started);
+  return pool.failures;
+}
@@ -0,0 +1,35 @@
+/*
+ * pool.h
+ *
+ * A small work-stealing thread pool for running a fixed set of independent
+ * jobs (such as one conversion per input file) on a fixed set of workers.
+ *
+ * Jobs are numbered 0..num_jobs-1 and are handed out in contiguous ranges,
+ * one range per worker.  A worker that runs out of jobs steals the back half
+ * of another worker's remaining range, so uneven job sizes still keep every
+ * thread busy.
+ */
+
+#ifndef POOL_H
+#define POOL_H
+
+/* Per-worker state.  The pool never looks inside it; the program using the
+ * pool defines the struct and passes one per worker, so each worker can own
+ * objects (a JPEG decompressor, say) that must never be shared by threads.
+ */
+struct pool_worker;
+
+/* Run job number job using the given worker's state.  Returns nonzero on
+ * success, 0 on failure.  A failure is counted but does not stop the run.
+ */
+typedef _Ptr<int (_Ptr<struct pool_worker> worker, int job)> pool_job_fn;
+
+/* Run jobs 0..num_jobs-1 on num_workers threads, the calling thread being
+ * worker 0.  workers[w] is passed to every job run by thread w.  Returns the
+ * number of jobs that failed.
+ */
+extern int pool_run(int num_jobs,
+                    _Array_ptr<_Ptr<struct pool_worker>> workers : count(num_workers),
+                    int num_workers, pool_job_fn run_job);
+
+#endif /* POOL_H */
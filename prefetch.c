@@ -0,0 +1,626 @@
+/*
+ * prefetch.c
+ *
+ * The io_uring input prefetcher; see prefetch.h.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <unistd.h>
+
+#ifdef __linux__
+#include <sys/syscall.h>
+#endif
+#if defined(__linux__) && defined(__NR_io_uring_setup)
+#include <stdint.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <linux/io_uring.h>
+#include <linux/stat.h>
+#define HAVE_IO_URING
+#endif
+
+#define HAVE_PROTOTYPES
+#include <jpeglib.h>
+
+#include "cli.h"
+#include "prefetch.h"
+#pragma CHECKED_SCOPE on
+
+#ifdef HAVE_IO_URING
+
+#ifndef AT_EMPTY_PATH
+#define AT_EMPTY_PATH 0x1000	/* statx the descriptor itself */
+#endif
+
+#define RING_ENTRIES 64		/* submission queue size */
+#define MAX_ACTIVE 32		/* files being opened or read at once */
+#define MAX_READ (1U << 30)	/* largest single read request */
+
+/* Where an input is on its way from the file system to a worker. */
+enum slot_state {
+  SLOT_IDLE,			/* not asked for yet */
+  SLOT_QUEUED,			/* waiting for an active record */
+  SLOT_ACTIVE,			/* being opened, stat'ed or read */
+  SLOT_DONE,			/* all in memory */
+  SLOT_FAILED,			/* couldn't be read; see error */
+  SLOT_TAKEN			/* handed to a worker */
+};
+
+struct slot {
+  enum slot_state state;
+  int error;			/* errno for SLOT_FAILED, or 0 for an empty file */
+  _Array_ptr<JOCTET> data : count(size);
+  size_t size;
+};
+
+/* A file with an operation in flight.  user_data of the operation is the
+ * number of the record times 4 plus the operation.
+ */
+struct active {
+  int index;			/* the input, or -1 if the record is free */
+  int fd;
+  size_t done;			/* bytes read so far */
+  struct statx stx;		/* where the size is fetched to */
+};
+
+enum { OP_OPEN, OP_STAT, OP_READ };
+#define WAKE_USER_DATA (~(unsigned long long) 0)
+
+/* The rings shared with the kernel, as io_uring_setup(2) lays them out. */
+struct ring {
+  int fd;
+  _Ptr<unsigned> sq_head;
+  _Ptr<unsigned> sq_tail;
+  _Ptr<unsigned> sq_mask;
+  _Array_ptr<unsigned> sq_array : count(sq_entries);
+  unsigned sq_entries;
+  _Array_ptr<struct io_uring_sqe> sqes : count(sq_entries);
+  _Ptr<unsigned> cq_head;
+  _Ptr<unsigned> cq_tail;
+  _Ptr<unsigned> cq_mask;
+  _Array_ptr<struct io_uring_cqe> cqes : count(cq_entries);
+  unsigned cq_entries;
+  unsigned to_submit;		/* queued since the last io_uring_enter */
+  /* The mappings, for munmap. */
+  _Array_ptr<char> sq_map : count(sq_map_size);
+  size_t sq_map_size;
+  _Array_ptr<char> cq_map : count(cq_map_size);	/* may be sq_map */
+  size_t cq_map_size;
+};
+
+struct prefetcher {
+  _Ptr<const struct input_list> inputs;
+  int depth;
+  pthread_mutex_t lock;		/* protects everything below */
+  pthread_cond_t cond;		/* signalled whenever an input is done */
+  _Array_ptr<struct slot> slots : count(num_slots);
+  int num_slots;
+  /* Inputs asked for, in order; each is queued at most once. */
+  _Array_ptr<int> queue : count(num_slots);
+  int queue_head, queue_tail;
+  struct active active _Checked[MAX_ACTIVE];
+  int num_active;
+  int in_flight;		/* operations submitted and not completed */
+  int stop;
+  /* The I/O thread owns the ring.  Workers wake it through the eventfd,
+   * which always has a read in flight on the ring.
+   */
+  struct ring ring;
+  int wake_fd;
+  unsigned long long wake_value;
+  pthread_t thread;
+};
+
+
+static void
+prefetch_lock (_Ptr<struct prefetcher> pf)
+{
+  _Unchecked { pthread_mutex_lock((pthread_mutex_t *) &pf->lock); }
+}
+
+static void
+prefetch_unlock (_Ptr<struct prefetcher> pf)
+{
+  _Unchecked { pthread_mutex_unlock((pthread_mutex_t *) &pf->lock); }
+}
+
+static void
+prefetch_wake (_Ptr<struct prefetcher> pf)
+{
+  unsigned long long one = 1;
+
+  _Unchecked { (void) write(pf->wake_fd, &one, sizeof(one)); }
+}
+
+
+/*
+ * The ring itself.  Its memory is shared with the kernel and laid out by
+ * the offsets io_uring_setup hands back, and the operations carry raw
+ * addresses, so this part is compiled outside the checked scope.
+ */
+#pragma CHECKED_SCOPE push
+#pragma CHECKED_SCOPE off
+
+static int
+ring_setup (struct ring *ring)
+{
+  struct io_uring_params p;
+  struct io_uring_probe *probe;
+  int fd, ok;
+
+  memset(&p, 0, sizeof(p));
+  fd = (int) syscall(__NR_io_uring_setup, RING_ENTRIES, &p);
+  if (fd < 0)
+    return 0;
+
+  /* Opening and stat'ing through the ring need 5.6, as does the probe. */
+  probe = calloc(1, sizeof(*probe) + 256 * sizeof(struct io_uring_probe_op));
+  ok = probe != NULL &&
+       syscall(__NR_io_uring_register, fd, IORING_REGISTER_PROBE, probe, 256) == 0 &&
+       probe->last_op >= IORING_OP_READ &&
+       (probe->ops[IORING_OP_OPENAT].flags & IO_URING_OP_SUPPORTED) &&
+       (probe->ops[IORING_OP_STATX].flags & IO_URING_OP_SUPPORTED) &&
+       (probe->ops[IORING_OP_READ].flags & IO_URING_OP_SUPPORTED);
+  free(probe);
+  if (!ok) {
+    close(fd);
+    return 0;
+  }
+
+  size_t sq_size = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+  size_t cq_size = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+  int single = (p.features & IORING_FEAT_SINGLE_MMAP) != 0;
+  if (single && cq_size > sq_size)
+    sq_size = cq_size;
+  char *sq = mmap(NULL, sq_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                  fd, IORING_OFF_SQ_RING);
+  char *cq = single ? sq : mmap(NULL, cq_size, PROT_READ | PROT_WRITE,
+                                MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_CQ_RING);
+  size_t sqes_size = p.sq_entries * sizeof(struct io_uring_sqe);
+  void *sqes = mmap(NULL, sqes_size, PROT_READ | PROT_WRITE,
+                    MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQES);
+  if (sq == MAP_FAILED || cq == MAP_FAILED || sqes == MAP_FAILED) {
+    if (sq != MAP_FAILED)
+      munmap(sq, sq_size);
+    if (!single && cq != MAP_FAILED)
+      munmap(cq, cq_size);
+    if (sqes != MAP_FAILED)
+      munmap(sqes, sqes_size);
+    close(fd);
+    return 0;
+  }
+
+  unsigned sq_entries = p.sq_entries, cq_entries = p.cq_entries;
+  size_t cq_map_size = single ? 0 : cq_size;
+  ring->fd = fd;
+  ring->sq_head = _Assume_bounds_cast<_Ptr<unsigned>>(sq + p.sq_off.head);
+  ring->sq_tail = _Assume_bounds_cast<_Ptr<unsigned>>(sq + p.sq_off.tail);
+  ring->sq_mask = _Assume_bounds_cast<_Ptr<unsigned>>(sq + p.sq_off.ring_mask);
+  ring->sq_array = _Assume_bounds_cast<_Array_ptr<unsigned>>(sq + p.sq_off.array,
+                                                             count(sq_entries)),
+    ring->sqes = _Assume_bounds_cast<_Array_ptr<struct io_uring_sqe>>(sqes, count(sq_entries)),
+    ring->sq_entries = sq_entries;
+  ring->cq_head = _Assume_bounds_cast<_Ptr<unsigned>>(cq + p.cq_off.head);
+  ring->cq_tail = _Assume_bounds_cast<_Ptr<unsigned>>(cq + p.cq_off.tail);
+  ring->cq_mask = _Assume_bounds_cast<_Ptr<unsigned>>(cq + p.cq_off.ring_mask);
+  ring->cqes = _Assume_bounds_cast<_Array_ptr<struct io_uring_cqe>>(cq + p.cq_off.cqes,
+                                                                    count(cq_entries)),
+    ring->cq_entries = cq_entries;
+  ring->to_submit = 0;
+  ring->sq_map = _Assume_bounds_cast<_Array_ptr<char>>(sq, count(sq_size)),
+    ring->sq_map_size = sq_size;
+  ring->cq_map = _Assume_bounds_cast<_Array_ptr<char>>(single ? NULL : cq, count(cq_map_size)),
+    ring->cq_map_size = cq_map_size;
+  return 1;
+}
+
+static void
+ring_teardown (struct ring *ring)
+{
+  munmap((void *) ring->sqes, ring->sq_entries * sizeof(struct io_uring_sqe));
+  if (ring->cq_map != NULL)
+    munmap((void *) ring->cq_map, ring->cq_map_size);
+  munmap((void *) ring->sq_map, ring->sq_map_size);
+  close(ring->fd);
+}
+
+/* The next free submission entry, cleared, or NULL if the queue is full. */
+
+static struct io_uring_sqe *
+ring_sqe (struct ring *ring)
+{
+  unsigned tail = *ring->sq_tail;
+
+  if (tail - __atomic_load_n((unsigned *) ring->sq_head, __ATOMIC_ACQUIRE) >= ring->sq_entries)
+    return NULL;
+  unsigned i = tail & *ring->sq_mask;
+  struct io_uring_sqe *sqe = (struct io_uring_sqe *) &ring->sqes[i];
+  memset(sqe, 0, sizeof(*sqe));
+  ring->sq_array[i] = i;
+  /* The kernel only looks at the entry once tail has moved past it. */
+  __atomic_store_n((unsigned *) ring->sq_tail, tail + 1, __ATOMIC_RELEASE);
+  ring->to_submit++;
+  return sqe;
+}
+
+/* Submit what is queued, and wait for at least one completion. */
+
+static void
+ring_enter (struct ring *ring)
+{
+  long n = syscall(__NR_io_uring_enter, ring->fd, ring->to_submit, 1,
+                   IORING_ENTER_GETEVENTS, NULL, 0);
+  if (n > 0)
+    ring->to_submit -= n < (long) ring->to_submit ? (unsigned) n : ring->to_submit;
+}
+
+/* Queue the operations, each tagged with user_data. */
+
+static void
+prep_open (struct ring *ring, const char *path, unsigned long long user_data)
+{
+  struct io_uring_sqe *sqe = ring_sqe(ring);
+
+  sqe->opcode = IORING_OP_OPENAT;
+  sqe->fd = AT_FDCWD;
+  sqe->addr = (unsigned long) path;
+  sqe->open_flags = O_RDONLY | O_CLOEXEC;
+  sqe->user_data = user_data;
+}
+
+static void
+prep_statx (struct ring *ring, int fd, struct statx *stx, unsigned long long user_data)
+{
+  struct io_uring_sqe *sqe = ring_sqe(ring);
+
+  sqe->opcode = IORING_OP_STATX;
+  sqe->fd = fd;
+  sqe->addr = (unsigned long) "";
+  sqe->len = STATX_SIZE;
+  sqe->off = (unsigned long) stx;
+  sqe->statx_flags = AT_EMPTY_PATH;
+  sqe->user_data = user_data;
+}
+
+static void
+prep_read (struct ring *ring, int fd, void *buf, unsigned len, unsigned long long offset,
+           unsigned long long user_data)
+{
+  struct io_uring_sqe *sqe = ring_sqe(ring);
+
+  sqe->opcode = IORING_OP_READ;
+  sqe->fd = fd;
+  sqe->addr = (unsigned long) buf;
+  sqe->len = len;
+  sqe->off = offset;
+  sqe->user_data = user_data;
+}
+
+/* Take the next completion, if there is one.  Returns 1 if there was. */
+
+static int
+ring_reap (struct ring *ring, unsigned long long *user_data, int *res)
+{
+  unsigned head = *ring->cq_head;
+
+  if (head == __atomic_load_n((unsigned *) ring->cq_tail, __ATOMIC_ACQUIRE))
+    return 0;
+  struct io_uring_cqe *cqe = (struct io_uring_cqe *) &ring->cqes[head & *ring->cq_mask];
+  *user_data = cqe->user_data;
+  *res = cqe->res;
+  __atomic_store_n((unsigned *) ring->cq_head, head + 1, __ATOMIC_RELEASE);
+  return 1;
+}
+
+
+/*
+ * The I/O thread.  Each input goes through an open, a statx for its size
+ * and as many reads as it takes, one operation at a time, with up to
+ * MAX_ACTIVE inputs under way at once.  Everything here runs with the lock
+ * held except the wait in io_uring_enter.
+ */
+
+static void
+wake_read (struct prefetcher *pf)
+{
+  prep_read(&pf->ring, pf->wake_fd, &pf->wake_value, sizeof(pf->wake_value), 0,
+            WAKE_USER_DATA);
+  pf->in_flight++;
+}
+
+static void
+finish_file (struct prefetcher *pf, int a, int error)
+{
+  _Ptr<struct active> act = &pf->active[a];
+  _Ptr<struct slot> slot = &pf->slots[act->index];
+
+  if (act->fd >= 0)
+    close(act->fd);
+  if (error >= 0) {
+    free((void *) slot->data);
+    slot->data = NULL, slot->size = 0;
+    slot->error = error;
+    slot->state = SLOT_FAILED;
+  } else {
+    slot->state = SLOT_DONE;
+  }
+  act->index = -1;
+  pf->num_active--;
+}
+
+/* Start on queued inputs while there are free records. */
+
+static void
+start_files (struct prefetcher *pf)
+{
+  for (int a = 0; a < MAX_ACTIVE && pf->num_active < MAX_ACTIVE &&
+                  pf->queue_head < pf->queue_tail; a++) {
+    _Ptr<struct active> act = &pf->active[a];
+    if (act->index >= 0)
+      continue;
+    act->index = pf->queue[pf->queue_head++];
+    act->fd = -1;
+    act->done = 0;
+    pf->slots[act->index].state = SLOT_ACTIVE;
+    pf->num_active++;
+    prep_open(&pf->ring, (const char *) pf->inputs->names[act->index],
+              (unsigned long long) a * 4 + OP_OPEN);
+    pf->in_flight++;
+  }
+}
+
+/* Queue the next read of an active input, or finish it. */
+
+static void
+read_more (struct prefetcher *pf, int a)
+{
+  _Ptr<struct active> act = &pf->active[a];
+  _Ptr<struct slot> slot = &pf->slots[act->index];
+  size_t left = slot->size - act->done;
+
+  if (left == 0) {
+    finish_file(pf, a, -1);
+    return;
+  }
+  prep_read(&pf->ring, act->fd, (void *) (slot->data + act->done),
+            left < MAX_READ ? (unsigned) left : MAX_READ, act->done,
+            (unsigned long long) a * 4 + OP_READ);
+  pf->in_flight++;
+}
+
+static void
+complete (struct prefetcher *pf, unsigned long long user_data, int res)
+{
+  pf->in_flight--;
+  if (user_data == WAKE_USER_DATA) {
+    if (!pf->stop)
+      wake_read(pf);
+    return;
+  }
+
+  int a = (int) (user_data / 4);
+  _Ptr<struct active> act = &pf->active[a];
+  _Ptr<struct slot> slot = &pf->slots[act->index];
+  if (res < 0) {
+    finish_file(pf, a, -res);
+    return;
+  }
+  if (pf->stop) {
+    if ((user_data & 3) == OP_OPEN)
+      act->fd = res;
+    finish_file(pf, a, ECANCELED);
+    return;
+  }
+
+  switch (user_data & 3) {
+  case OP_OPEN:
+    act->fd = res;
+    prep_statx(&pf->ring, act->fd, (struct statx *) &act->stx,
+               (unsigned long long) a * 4 + OP_STAT);
+    pf->in_flight++;
+    break;
+  case OP_STAT: {
+    if (act->stx.stx_size == 0 || act->stx.stx_size > SIZE_MAX) {
+      finish_file(pf, a, act->stx.stx_size == 0 ? 0 : EFBIG);
+      break;
+    }
+    size_t size = (size_t) act->stx.stx_size;
+    void *data = malloc(size);
+    if (data == NULL) {
+      finish_file(pf, a, ENOMEM);
+      break;
+    }
+    slot->data = _Assume_bounds_cast<_Array_ptr<JOCTET>>(data, count(size)), slot->size = size;
+    read_more(pf, a);
+    break;
+  }
+  case OP_READ:
+    /* The file got shorter after its statx. */
+    if (res == 0) {
+      finish_file(pf, a, EIO);
+      break;
+    }
+    act->done += res;
+    read_more(pf, a);
+    break;
+  }
+}
+
+static void
+prefetch_work (struct prefetcher *pf)
+{
+  prefetch_lock(pf);
+  wake_read(pf);
+  for (;;) {
+    if (!pf->stop)
+      start_files(pf);
+    if (pf->stop && pf->in_flight == 0)
+      break;
+    prefetch_unlock(pf);
+    ring_enter(&pf->ring);
+    prefetch_lock(pf);
+    unsigned long long user_data;
+    int res;
+    while (ring_reap(&pf->ring, &user_data, &res))
+      complete(pf, user_data, res);
+    pthread_cond_broadcast(&pf->cond);
+  }
+  prefetch_unlock(pf);
+}
+
+static void *
+prefetch_thread_main (void *arg)
+{
+  prefetch_work(arg);
+  return NULL;
+}
+
+#pragma CHECKED_SCOPE pop
+
+
+_Ptr<struct prefetcher>
+prefetch_create (_Ptr<const struct input_list> inputs, int depth)
+{
+  int n = inputs->count;
+  _Ptr<struct prefetcher> pf = calloc<struct prefetcher>(1, sizeof(struct prefetcher));
+  _Array_ptr<struct slot> slots : count(n) = calloc<struct slot>(n, sizeof(struct slot));
+  _Array_ptr<int> queue : count(n) = calloc<int>(n, sizeof(int));
+  int ok = 0;
+
+  if (pf != NULL && slots != NULL && queue != NULL) {
+    _Unchecked { ok = ring_setup(&pf->ring); }
+  }
+  if (!ok) {
+    free<struct slot>(slots);
+    free<int>(queue);
+    free<struct prefetcher>(pf);
+    return ((void *)0);
+  }
+
+  pf->inputs = inputs;
+  pf->depth = depth;
+  pf->slots = slots, pf->queue = queue, pf->num_slots = n;
+  for (int a = 0; a < MAX_ACTIVE; a++)
+    pf->active[a].index = -1;
+  _Unchecked {
+    pthread_mutex_init((pthread_mutex_t *) &pf->lock, NULL);
+    pthread_cond_init((pthread_cond_t *) &pf->cond, NULL);
+    pf->wake_fd = eventfd(0, EFD_CLOEXEC);
+    ok = pf->wake_fd >= 0 &&
+         pthread_create((pthread_t *) &pf->thread, NULL, prefetch_thread_main,
+                        (void *) pf) == 0;
+  }
+  if (!ok) {
+    if (pf->wake_fd >= 0)
+      close(pf->wake_fd);
+    _Unchecked {
+      ring_teardown(&pf->ring);
+      pthread_cond_destroy((pthread_cond_t *) &pf->cond);
+      pthread_mutex_destroy((pthread_mutex_t *) &pf->lock);
+    }
+    free<struct slot>(slots);
+    free<int>(queue);
+    free<struct prefetcher>(pf);
+    return ((void *)0);
+  }
+  return pf;
+}
+
+int
+prefetch_get (_Ptr<struct prefetcher> pf, int index, _Ptr<struct mapped_file> data)
+{
+  int last = index + pf->depth < pf->num_slots ? index + pf->depth : pf->num_slots - 1;
+  int queued = 0, ok, error;
+
+  prefetch_lock(pf);
+  for (int i = index; i <= last; i++) {
+    if (pf->slots[i].state == SLOT_IDLE) {
+      pf->slots[i].state = SLOT_QUEUED;
+      pf->queue[pf->queue_tail++] = i;
+      queued = 1;
+    }
+  }
+  if (queued)
+    prefetch_wake(pf);
+  _Ptr<struct slot> slot = &pf->slots[index];
+  while (slot->state == SLOT_QUEUED || slot->state == SLOT_ACTIVE)
+    _Unchecked { pthread_cond_wait((pthread_cond_t *) &pf->cond, (pthread_mutex_t *) &pf->lock); }
+  ok = slot->state == SLOT_DONE;
+  error = slot->error;
+  if (ok)
+    data->data = slot->data, data->size = slot->size;
+  slot->state = SLOT_TAKEN;
+  prefetch_unlock(pf);
+
+  if (!ok) {
+    _Nt_array_ptr<char> name = pf->inputs->names[index];
+    if (error == 0)
+      fprintf(stderr, "%s is empty\n", name);
+    else
+      fprintf(stderr, "can't read %s: %s\n", name, strerror(error));
+  }
+  return ok;
+}
+
+void
+prefetch_release (_Ptr<struct prefetcher> pf, int index)
+{
+  _Ptr<struct slot> slot = &pf->slots[index];
+
+  /* A taken slot is the caller's alone. */
+  free<JOCTET>(slot->data);
+  slot->data = ((void *)0), slot->size = 0;
+}
+
+void
+prefetch_destroy (_Ptr<struct prefetcher> pf)
+{
+  prefetch_lock(pf);
+  pf->stop = 1;
+  prefetch_wake(pf);
+  prefetch_unlock(pf);
+  _Unchecked {
+    pthread_join(pf->thread, NULL);
+    ring_teardown(&pf->ring);
+    pthread_cond_destroy((pthread_cond_t *) &pf->cond);
+    pthread_mutex_destroy((pthread_mutex_t *) &pf->lock);
+  }
+  close(pf->wake_fd);
+  /* Inputs read but never asked for. */
+  for (int i = 0; i < pf->num_slots; i++)
+    free<JOCTET>(pf->slots[i].data);
+  free<struct slot>(pf->slots);
+  free<int>(pf->queue);
+  free<struct prefetcher>(pf);
+}
+
+#else /* !HAVE_IO_URING */
+
+_Ptr<struct prefetcher>
+prefetch_create (_Ptr<const struct input_list> inputs, int depth)
+{
+  return ((void *)0);
+}
+
+int
+prefetch_get (_Ptr<struct prefetcher> pf, int index, _Ptr<struct mapped_file> data)
+{
+  return 0;
+}
+
+void
+prefetch_release (_Ptr<struct prefetcher> pf, int index)
+{
+}
+
+void
+prefetch_destroy (_Ptr<struct prefetcher> pf)
+{
+}
+
+#endif /* HAVE_IO_URING */
@@ -0,0 +1,47 @@
+/*
+ * prefetch.h
+ *
+ * Reading a batch's input files ahead of the workers with io_uring.
+ *
+ * When the inputs live on slow storage (network file systems especially),
+ * a worker that opens and reads its next file itself spends most of its
+ * time waiting.  A prefetcher instead has a thread of its own keep many
+ * opens, stats and reads in flight at once through a single io_uring, so
+ * the latencies overlap and the workers find their files already in
+ * memory.  Every time a worker asks for an input, the prefetcher also
+ * starts on the inputs that follow it, up to depth files ahead.
+ *
+ * The ring is driven through the raw system calls, without liburing.
+ * Where io_uring isn't available (another OS, a kernel before 5.6, or a
+ * seccomp policy that forbids it) prefetch_create returns NULL and the
+ * workers simply read their own inputs.
+ *
+ * Include <stdio.h> and <jpeglib.h>, and "cli.h", before this file.
+ */
+
+#ifndef PREFETCH_H
+#define PREFETCH_H
+
+struct prefetcher;
+
+/* Start a prefetcher for the given inputs, reading up to depth files ahead
+ * of each request.  The list must outlive the prefetcher.  Returns NULL if
+ * io_uring can't be used here, or if out of memory.
+ */
+extern _Ptr<struct prefetcher> prefetch_create(_Ptr<const struct input_list> inputs,
+                                               int depth);
+
+/* Wait until the index'th input has been read, and start on the ones after
+ * it.  On success, data is set to the whole file, which stays valid until
+ * prefetch_release, and 1 is returned.  Returns 0 after printing a message
+ * if the file can't be read.  Each input may be fetched once.
+ */
+extern int prefetch_get(_Ptr<struct prefetcher> pf, int index, _Ptr<struct mapped_file> data);
+
+/* Free the buffer of an input fetched successfully. */
+extern void prefetch_release(_Ptr<struct prefetcher> pf, int index);
+
+/* Stop the thread, wait for any reads still in flight and free it all. */
+extern void prefetch_destroy(_Ptr<struct prefetcher> pf);
+
+#endif /* PREFETCH_H */
@@ -0,0 +1,166 @@
+/*
+ * pushsrc.c
+ *
+ * Suspending, caller-fed source manager; see pushsrc.h.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define HAVE_PROTOTYPES
+#include <jpeglib.h>
+#include <jerror.h>
+
+#include "pushsrc.h"
+#pragma CHECKED_SCOPE on
+
+/* The buffer's size when it is first needed. */
+#define PUSH_MIN_CAPACITY 65536
+
+static const JOCTET fake_eoi _Checked[2] = { 0xFF, JPEG_EOI };
+
+static _Ptr<struct push_source>
+push_source_of (j_decompress_ptr cinfo)
+{
+  return _Dynamic_bounds_cast<_Ptr<struct push_source>>(cinfo->src);
+}
+
+/* Make bytes offset..end of the buffer the next ones read. */
+
+static void
+push_position (_Ptr<struct push_source> src, size_t offset)
+{
+  src->pub.bytes_in_buffer = src->end - offset;
+  if (offset < src->end)
+    src->pub.next_input_byte = _Dynamic_bounds_cast<_Ptr<const JOCTET>>(src->buffer + offset);
+}
+
+static void
+push_init_source (j_decompress_ptr cinfo)
+{
+  /* no work necessary here */
+}
+
+static boolean
+push_fill_input_buffer (j_decompress_ptr cinfo)
+{
+  _Ptr<struct push_source> src = push_source_of(cinfo);
+
+  if (!src->eof)
+    return FALSE;		/* suspend until more is pushed */
+
+  cinfo->err->msg_code = JWRN_JPEG_EOF;
+  _Unchecked { (*cinfo->err->emit_message)((j_common_ptr) cinfo, -1); }
+  src->faked = TRUE;
+  src->pub.next_input_byte = fake_eoi;
+  src->pub.bytes_in_buffer = sizeof(fake_eoi);
+  return TRUE;
+}
+
+static void
+push_skip_input_data (j_decompress_ptr cinfo, long num_bytes)
+{
+  _Ptr<struct push_source> src = push_source_of(cinfo);
+
+  if (num_bytes <= 0)
+    return;
+  if ((size_t) num_bytes > src->pub.bytes_in_buffer) {
+    /* Drop the rest of the buffer now and the remainder as it arrives.
+     * After the end of the data, the next fill just gives the fake EOI.
+     */
+    if (!src->eof)
+      src->skip = (size_t) num_bytes - src->pub.bytes_in_buffer;
+    src->pub.bytes_in_buffer = 0;
+  } else if (src->faked) {
+    size_t left = src->pub.bytes_in_buffer - (size_t) num_bytes;
+    if (left > 0)
+      src->pub.next_input_byte = &fake_eoi[sizeof(fake_eoi) - left];
+    src->pub.bytes_in_buffer = left;
+  } else {
+    push_position(src, src->end - src->pub.bytes_in_buffer + (size_t) num_bytes);
+  }
+}
+
+static void
+push_term_source (j_decompress_ptr cinfo)
+{
+  /* no work necessary here */
+}
+
+
+void
+push_source_init (j_decompress_ptr cinfo, _Ptr<struct push_source> src)
+{
+  struct push_source empty = {};
+
+  *src = empty;
+  src->pub.init_source = push_init_source;
+  src->pub.fill_input_buffer = push_fill_input_buffer;
+  src->pub.skip_input_data = push_skip_input_data;
+  src->pub.resync_to_restart = jpeg_resync_to_restart;
+  src->pub.term_source = push_term_source;
+  src->pub.bytes_in_buffer = 0;
+  cinfo->src = &src->pub;
+}
+
+int
+push_source_write (_Ptr<struct push_source> src,
+                   _Array_ptr<const JOCTET> data : count(n), size_t n)
+{
+  size_t skip = src->skip < n ? src->skip : n;
+
+  src->skip -= skip;
+  if (src->eof || n == skip)
+    return 1;
+  n -= skip;
+  _Array_ptr<const JOCTET> bytes : count(n) =
+    _Dynamic_bounds_cast<_Array_ptr<const JOCTET>>(data + skip, count(n));
+
+  /* The library still needs the last bytes_in_buffer bytes. */
+  size_t keep = src->pub.bytes_in_buffer;
+  size_t start = src->end - keep;
+  if (n > src->capacity - src->end) {
+    if (keep + n <= src->capacity) {
+      memmove(src->buffer, _Dynamic_bounds_cast<_Array_ptr<JOCTET>>(src->buffer + start,
+                                                                   count(keep)),
+              keep);
+    } else {
+      size_t capacity = 2 * src->capacity;
+      if (capacity < keep + n)
+        capacity = keep + n;
+      if (capacity < PUSH_MIN_CAPACITY)
+        capacity = PUSH_MIN_CAPACITY;
+      _Array_ptr<JOCTET> buffer : count(capacity) = malloc<JOCTET>(capacity);
+      if (buffer == NULL)
+        return 0;
+      if (keep > 0)
+        memcpy(buffer, _Dynamic_bounds_cast<_Array_ptr<JOCTET>>(src->buffer + start,
+                                                                count(keep)),
+               keep);
+      free<JOCTET>(src->buffer);
+      src->buffer = buffer, src->capacity = capacity;
+    }
+    src->end = keep;
+    start = 0;
+  }
+  memcpy(_Dynamic_bounds_cast<_Array_ptr<JOCTET>>(src->buffer + src->end, count(n)), bytes, n);
+  src->end += n;
+  push_position(src, start);
+  return 1;
+}
+
+void
+push_source_close (_Ptr<struct push_source> src)
+{
+  src->eof = TRUE;
+}
+
+void
+push_source_free (_Ptr<struct push_source> src)
+{
+  free<JOCTET>(src->buffer);
+  src->buffer = ((void *)0), src->capacity = 0;
+  src->end = 0;
+  src->pub.bytes_in_buffer = 0;
+}
@@ -0,0 +1,53 @@
+/*
+ * pushsrc.h
+ *
+ * A suspending data source manager fed with chunks by the caller.
+ *
+ * The stdio and memory sources make the library wait until data is there
+ * (or pretend the file ended).  This one instead makes the library suspend:
+ * when it runs out, jpeg_read_header, jpeg_start_decompress,
+ * jpeg_read_scanlines and jpeg_finish_decompress return JPEG_SUSPENDED,
+ * FALSE or 0, having backed up to a point they can resume from.  The caller
+ * pushes whatever arrives next, from a non-blocking descriptor say, and
+ * calls the same function again.  So one thread can drive any number of
+ * decodes, each getting on as far as its data allows.
+ *
+ * The source keeps the bytes the library hasn't finished with, growing its
+ * buffer as needed.  A progressive image is consumed as it arrives (its
+ * coefficients are buffered by the library instead), so the buffer only
+ * grows when the library has to back up over a lot of data.
+ *
+ * Include <stdio.h> and <jpeglib.h> before this file.
+ */
+
+#ifndef PUSHSRC_H
+#define PUSHSRC_H
+
+struct push_source {
+  struct jpeg_source_mgr pub;	/* public fields */
+  _Array_ptr<JOCTET> buffer : count(capacity);
+  size_t capacity;
+  size_t end;			/* bytes of buffer holding data */
+  size_t skip;			/* bytes to drop as they arrive */
+  boolean eof;			/* push_source_close has been called */
+  boolean faked;		/* the library is reading the fake EOI */
+};
+
+/* Make cinfo read from src, empty to begin with. */
+extern void push_source_init(j_decompress_ptr cinfo, _Ptr<struct push_source> src);
+
+/* Add the next n bytes of the file.  Only call this when the library has
+ * returned, not from inside it.  Returns 1 on success, 0 if out of memory.
+ */
+extern int push_source_write(_Ptr<struct push_source> src,
+                             _Array_ptr<const JOCTET> data : count(n), size_t n);
+
+/* Say there is no more data.  From now on the library doesn't suspend: a
+ * truncated file gets a fake EOI after a warning, as in jdatasrc.c.
+ */
+extern void push_source_close(_Ptr<struct push_source> src);
+
+/* Release the buffer, once the decompression is finished or aborted. */
+extern void push_source_free(_Ptr<struct push_source> src);
+
+#endif /* PUSHSRC_H */
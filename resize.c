@@ -0,0 +1,391 @@
+/*
+ * resize.c
+ *
+ * The streaming resampler; see resize.h.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#define HAVE_PROTOTYPES
+#include <jpeglib.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#define RESIZE_X86
+#include <immintrin.h>
+#endif
+
+#include "sink.h"
+#include "resize.h"
+#pragma CHECKED_SCOPE on
+
+#define WEIGHT_BITS 14
+#define WEIGHT_ONE (1 << WEIGHT_BITS)
+#define WEIGHT_HALF (1 << (WEIGHT_BITS - 1))
+
+/* Samples per SIMD step of the vertical pass. */
+#define RESIZE_BLOCK 16
+
+/* Make out[from..n) from the taps rows of the ring, starting with slot
+ * first and wrapping around; each row is stride samples.
+ */
+typedef _Ptr<void (_Array_ptr<JSAMPLE> out : count(n), size_t from, size_t n,
+                   _Array_ptr<const JSAMPLE> ring : count(taps * stride), size_t stride,
+                   JDIMENSION taps, JDIMENSION first,
+                   _Array_ptr<const short> weights : count(taps))> blend_kernel;
+
+
+static JSAMPLE
+clamp_sample (int v)
+{
+  return (JSAMPLE) (v < 0 ? 0 : v > MAXJSAMPLE ? MAXJSAMPLE : v);
+}
+
+static long
+floor_long (double x)
+{
+  long i = (long) x;
+
+  return i > x ? i - 1 : i;
+}
+
+
+/*
+ * Work out the filter for scaling in samples to out.  Returns 1 on success,
+ * 0 if out of memory.
+ */
+
+static int
+axis_init (_Ptr<struct resize_axis> axis, JDIMENSION in, JDIMENSION out)
+{
+  double scale = (double) in / out;
+  double radius = scale > 1 ? scale : 1;
+  JDIMENSION taps = (JDIMENSION) (2 * radius) + 2;
+
+  if (taps > in)
+    taps = in;
+  _Array_ptr<JDIMENSION> start : count(out) = calloc<JDIMENSION>(out, sizeof(JDIMENSION));
+  _Array_ptr<short> weights : count(out * taps) = calloc<short>(out * taps, sizeof(short));
+  _Array_ptr<double> sum : count(taps) = calloc<double>(taps, sizeof(double));
+  if (start == NULL || weights == NULL || sum == NULL) {
+    free<JDIMENSION>(start);
+    free<short>(weights);
+    free<double>(sum);
+    return 0;
+  }
+
+  for (JDIMENSION i = 0; i < out; i++) {
+    /* Sample centers are at half-integers in both images. */
+    double center = (i + 0.5) * scale - 0.5;
+    long lo = floor_long(center - radius) + 1, hi = floor_long(center + radius);
+    long first = lo < 0 ? 0 : lo;
+    if (first > (long) (in - taps))
+      first = in - taps;
+    double total = 0;
+    for (JDIMENSION k = 0; k < taps; k++)
+      sum[k] = 0;
+    /* Samples past the edges count as copies of the edge sample. */
+    for (long j = lo; j <= hi; j++) {
+      double d = (j - center) / radius;
+      double w = 1 - (d < 0 ? -d : d);
+      if (w <= 0)
+        continue;
+      long at = j < 0 ? 0 : j >= (long) in ? (long) in - 1 : j;
+      sum[at - first] += w;
+      total += w;
+    }
+
+    /* Round to fixed point, and give the rounding error to the largest. */
+    int fixed = 0;
+    JDIMENSION largest = 0;
+    for (JDIMENSION k = 0; k < taps; k++) {
+      short w = (short) (total > 0 ? sum[k] / total * WEIGHT_ONE + 0.5 : 0);
+      weights[i * taps + k] = w;
+      fixed += w;
+      if (w > weights[i * taps + largest])
+        largest = k;
+    }
+    weights[i * taps + largest] += WEIGHT_ONE - fixed;
+    start[i] = (JDIMENSION) first;
+  }
+  free<double>(sum);
+
+  axis->start = start, axis->out = out;
+  axis->weights = weights, axis->taps = taps;
+  return 1;
+}
+
+static void
+axis_free (_Ptr<struct resize_axis> axis)
+{
+  free<JDIMENSION>(axis->start);
+  free<short>(axis->weights);
+  axis->start = ((void *)0), axis->out = 0;
+  axis->weights = ((void *)0), axis->taps = 0;
+}
+
+
+/* The vertical pass, one output sample at a time. */
+
+static void
+blend_scalar (_Array_ptr<JSAMPLE> out : count(n), size_t from, size_t n,
+              _Array_ptr<const JSAMPLE> ring : count(taps * stride), size_t stride,
+              JDIMENSION taps, JDIMENSION first, _Array_ptr<const short> weights : count(taps))
+{
+  for (size_t i = from; i < n; i++) {
+    int acc = WEIGHT_HALF;
+    JDIMENSION slot = first;
+    for (JDIMENSION k = 0; k < taps; k++) {
+      acc += weights[k] * ring[slot * stride + i];
+      slot = slot + 1 == taps ? 0 : slot + 1;
+    }
+    out[i] = clamp_sample(acc >> WEIGHT_BITS);
+  }
+}
+
+
+#ifdef RESIZE_X86
+
+/*
+ * Both SIMD kernels take the taps two at a time: the samples of the two
+ * rows, widened to 16 bits and interleaved, go through pmaddwd with the
+ * two weights, which gives their weighted sum as 32 bits per sample.  An
+ * odd last tap is paired with itself and a zero weight.  The sums are
+ * packed back to bytes with saturation, which clamps them too.
+ */
+
+__attribute__((target("sse2")))
+static void
+blend_sse2 (_Array_ptr<JSAMPLE> out : count(n), size_t from, size_t n,
+            _Array_ptr<const JSAMPLE> ring : count(taps * stride), size_t stride,
+            JDIMENSION taps, JDIMENSION first, _Array_ptr<const short> weights : count(taps))
+{
+  size_t i = from;
+
+  for (; i + RESIZE_BLOCK <= n; i += RESIZE_BLOCK) {
+    _Unchecked {
+      __m128i zero = _mm_setzero_si128();
+      __m128i acc0 = _mm_set1_epi32(WEIGHT_HALF), acc1 = acc0, acc2 = acc0, acc3 = acc0;
+      JDIMENSION slot = first;
+      for (JDIMENSION k = 0; k < taps; k += 2) {
+        JDIMENSION next = slot + 1 == taps ? 0 : slot + 1;
+        int w0 = weights[k], w1 = k + 1 < taps ? weights[k + 1] : 0;
+        __m128i w = _mm_set1_epi32((w1 << 16) | (w0 & 0xFFFF));
+        __m128i a = _mm_loadu_si128((const __m128i *) (ring + slot * stride + i));
+        __m128i b = _mm_loadu_si128((const __m128i *) (ring + next * stride + i));
+        __m128i a0 = _mm_unpacklo_epi8(a, zero), a1 = _mm_unpackhi_epi8(a, zero);
+        __m128i b0 = _mm_unpacklo_epi8(b, zero), b1 = _mm_unpackhi_epi8(b, zero);
+        acc0 = _mm_add_epi32(acc0, _mm_madd_epi16(_mm_unpacklo_epi16(a0, b0), w));
+        acc1 = _mm_add_epi32(acc1, _mm_madd_epi16(_mm_unpackhi_epi16(a0, b0), w));
+        acc2 = _mm_add_epi32(acc2, _mm_madd_epi16(_mm_unpacklo_epi16(a1, b1), w));
+        acc3 = _mm_add_epi32(acc3, _mm_madd_epi16(_mm_unpackhi_epi16(a1, b1), w));
+        slot = next + 1 == taps ? 0 : next + 1;
+      }
+      __m128i lo = _mm_packs_epi32(_mm_srai_epi32(acc0, WEIGHT_BITS),
+                                   _mm_srai_epi32(acc1, WEIGHT_BITS));
+      __m128i hi = _mm_packs_epi32(_mm_srai_epi32(acc2, WEIGHT_BITS),
+                                   _mm_srai_epi32(acc3, WEIGHT_BITS));
+      _mm_storeu_si128((__m128i *) (out + i), _mm_packus_epi16(lo, hi));
+    }
+  }
+  blend_scalar(out, i, n, ring, stride, taps, first, weights);
+}
+
+__attribute__((target("avx2")))
+static void
+blend_avx2 (_Array_ptr<JSAMPLE> out : count(n), size_t from, size_t n,
+            _Array_ptr<const JSAMPLE> ring : count(taps * stride), size_t stride,
+            JDIMENSION taps, JDIMENSION first, _Array_ptr<const short> weights : count(taps))
+{
+  size_t i = from;
+
+  for (; i + RESIZE_BLOCK <= n; i += RESIZE_BLOCK) {
+    _Unchecked {
+      __m256i acc_lo = _mm256_set1_epi32(WEIGHT_HALF), acc_hi = acc_lo;
+      JDIMENSION slot = first;
+      for (JDIMENSION k = 0; k < taps; k += 2) {
+        JDIMENSION next = slot + 1 == taps ? 0 : slot + 1;
+        int w0 = weights[k], w1 = k + 1 < taps ? weights[k + 1] : 0;
+        __m256i w = _mm256_set1_epi32((w1 << 16) | (w0 & 0xFFFF));
+        __m256i a = _mm256_cvtepu8_epi16(
+          _mm_loadu_si128((const __m128i *) (ring + slot * stride + i)));
+        __m256i b = _mm256_cvtepu8_epi16(
+          _mm_loadu_si128((const __m128i *) (ring + next * stride + i)));
+        acc_lo = _mm256_add_epi32(acc_lo, _mm256_madd_epi16(_mm256_unpacklo_epi16(a, b), w));
+        acc_hi = _mm256_add_epi32(acc_hi, _mm256_madd_epi16(_mm256_unpackhi_epi16(a, b), w));
+        slot = next + 1 == taps ? 0 : next + 1;
+      }
+      /* The unpacks work within 128-bit lanes, so acc_lo has samples 0-3
+       * and 8-11 and acc_hi 4-7 and 12-15; packing them does the same and
+       * so puts them back in order, two lanes of eight, and the permute
+       * brings the two halves together.
+       */
+      __m256i v = _mm256_packs_epi32(_mm256_srai_epi32(acc_lo, WEIGHT_BITS),
+                                     _mm256_srai_epi32(acc_hi, WEIGHT_BITS));
+      v = _mm256_permute4x64_epi64(_mm256_packus_epi16(v, v), 0x08);
+      _mm_storeu_si128((__m128i *) (out + i), _mm256_castsi256_si128(v));
+    }
+  }
+  blend_scalar(out, i, n, ring, stride, taps, first, weights);
+}
+
+#endif /* RESIZE_X86 */
+
+
+static blend_kernel
+choose_kernel (void)
+{
+#ifdef RESIZE_X86
+  if (__builtin_cpu_supports("avx2"))
+    return blend_avx2;
+  if (__builtin_cpu_supports("sse2"))
+    return blend_sse2;
+#endif
+  return blend_scalar;
+}
+
+
+/* The horizontal pass, into the ring slot of the next input row. */
+
+static void
+resize_across (_Ptr<struct resize_sink> rs, JSAMPROW in : count(in_stride), size_t in_stride)
+{
+  int components = rs->components;
+  JDIMENSION taps = rs->across.taps;
+  size_t slot = (size_t) (rs->rows_in % rs->down.taps) * rs->out_stride;
+  _Array_ptr<JSAMPLE> out : count(rs->out_stride) = ((void *)0);
+
+  out = _Dynamic_bounds_cast<_Array_ptr<JSAMPLE>>(rs->ring + slot, count(rs->out_stride));
+  for (JDIMENSION x = 0; x < rs->across.out; x++) {
+    size_t first = (size_t) rs->across.start[x] * components;
+    _Array_ptr<const short> w : count(taps) =
+      _Dynamic_bounds_cast<_Array_ptr<const short>>(rs->across.weights + (size_t) x * taps,
+                                                    count(taps));
+    for (int c = 0; c < components; c++) {
+      int acc = WEIGHT_HALF;
+      for (JDIMENSION k = 0; k < taps; k++)
+        acc += w[k] * in[first + (size_t) k * components + c];
+      out[(size_t) x * components + c] = clamp_sample(acc >> WEIGHT_BITS);
+    }
+  }
+}
+
+
+static _Ptr<struct resize_sink>
+resize_sink_of (_Ptr<struct output_sink> sink)
+{
+  return _Dynamic_bounds_cast<_Ptr<struct resize_sink>>(sink);
+}
+
+static void
+resize_free (_Ptr<struct resize_sink> rs)
+{
+  axis_free(&rs->across);
+  axis_free(&rs->down);
+  free<JSAMPLE>(rs->ring);
+  rs->ring = ((void *)0), rs->ring_size = 0;
+  free<JSAMPLE>(rs->row);
+  rs->row = ((void *)0), rs->out_stride = 0;
+}
+
+static int
+resize_begin (_Ptr<struct output_sink> sink, _Ptr<const struct sink_image> image)
+{
+  _Ptr<struct resize_sink> rs = resize_sink_of(sink);
+  JDIMENSION width = rs->width, height = rs->height;
+
+  /* A side left at 0 follows the other, keeping the shape. */
+  if (width == 0)
+    width = (JDIMENSION) (((double) image->width * height) / image->height + 0.5);
+  if (height == 0)
+    height = (JDIMENSION) (((double) image->height * width) / image->width + 0.5);
+  if (width == 0)
+    width = 1;
+  if (height == 0)
+    height = 1;
+
+  rs->components = image->components;
+  rs->in_stride = (size_t) image->width * image->components;
+  rs->rows_in = rs->rows_out = 0;
+  if (!axis_init(&rs->across, image->width, width) ||
+      !axis_init(&rs->down, image->height, height)) {
+    fprintf(stderr, "out of memory\n");
+    return 0;
+  }
+  size_t out_stride = (size_t) width * image->components;
+  size_t ring_size = out_stride * rs->down.taps;
+  _Array_ptr<JSAMPLE> ring : count(ring_size) = malloc<JSAMPLE>(ring_size);
+  _Array_ptr<JSAMPLE> row : count(out_stride) = malloc<JSAMPLE>(out_stride);
+  if (ring == NULL || row == NULL) {
+    free<JSAMPLE>(ring);
+    free<JSAMPLE>(row);
+    fprintf(stderr, "out of memory\n");
+    return 0;
+  }
+  rs->ring = ring, rs->ring_size = ring_size;
+  rs->row = row, rs->out_stride = out_stride;
+
+  struct sink_image resized = { width, height, image->components };
+  return (*rs->inner->begin_image)(rs->inner, &resized);
+}
+
+static int
+resize_rows (_Ptr<struct output_sink> sink, JSAMPROW rows : count(num_rows * row_stride),
+             JDIMENSION num_rows, size_t row_stride)
+{
+  _Ptr<struct resize_sink> rs = resize_sink_of(sink);
+  blend_kernel blend = choose_kernel();
+  JDIMENSION taps = rs->down.taps;
+
+  if (row_stride != rs->in_stride)
+    return 0;
+  for (JDIMENSION r = 0; r < num_rows; r++) {
+    resize_across(rs, _Dynamic_bounds_cast<JSAMPROW>(rows + r * row_stride, count(row_stride)),
+                  row_stride);
+    rs->rows_in++;
+    /* Every output row whose last tap has now arrived; their first taps
+     * are still in the ring, since it holds taps rows.
+     */
+    while (rs->rows_out < rs->down.out &&
+           rs->down.start[rs->rows_out] + taps <= rs->rows_in) {
+      JDIMENSION y = rs->rows_out;
+      (*blend)(rs->row, 0, rs->out_stride,
+               _Dynamic_bounds_cast<_Array_ptr<const JSAMPLE>>(rs->ring,
+                                                               count(taps * rs->out_stride)),
+               rs->out_stride, taps, rs->down.start[y] % taps,
+               _Dynamic_bounds_cast<_Array_ptr<const short>>(rs->down.weights + (size_t) y * taps,
+                                                             count(taps)));
+      if (!(*rs->inner->write_rows)(rs->inner,
+                                    _Dynamic_bounds_cast<JSAMPROW>(rs->row, count(rs->out_stride)),
+                                    1, rs->out_stride))
+        return 0;
+      rs->rows_out++;
+    }
+  }
+  return 1;
+}
+
+static int
+resize_end (_Ptr<struct output_sink> sink, boolean ok)
+{
+  _Ptr<struct resize_sink> rs = resize_sink_of(sink);
+
+  ok = ok && rs->rows_out == rs->down.out;
+  resize_free(rs);
+  return (*rs->inner->end_image)(rs->inner, ok);
+}
+
+_Ptr<struct output_sink>
+sink_resize (_Ptr<struct resize_sink> sink, _Ptr<struct output_sink> inner,
+             JDIMENSION width, JDIMENSION height)
+{
+  struct resize_sink empty = {};
+
+  *sink = empty;
+  sink->pub.begin_image = resize_begin;
+  sink->pub.write_rows = resize_rows;
+  sink->pub.end_image = resize_end;
+  sink->inner = inner;
+  sink->width = width, sink->height = height;
+  return &sink->pub;
+}
@@ -0,0 +1,61 @@
+/*
+ * resize.h
+ *
+ * Resampling decoded images to an exact size as the rows go by.
+ *
+ * The library can only scale by M/8 in the IDCT, which is why to_ppm first
+ * asks it for the smallest such size that still covers the target.  The
+ * resize sink then takes the image the rest of the way, to exactly the
+ * requested size, before passing it on to another sink.  It is a separable
+ * filter: every incoming row is first resampled horizontally, into a ring
+ * holding as many rows as the vertical filter has taps, and each output row
+ * is made from the ring as soon as the last input row it needs has arrived.
+ * So the image is never held whole; the sink needs memory for a few dozen
+ * output-width rows at most, whatever the size of the input.
+ *
+ * The filter is a triangle (linear interpolation) when enlarging, widened
+ * to cover the whole footprint of each output pixel when reducing, so that
+ * reductions average rather than alias.  Weights are 14-bit fixed point.
+ * The vertical pass, which touches every output sample once per tap, has
+ * SIMD kernels picked at run time as in ascii.c.
+ *
+ * Include <stdio.h> and <jpeglib.h>, and "sink.h", before this file.
+ */
+
+#ifndef RESIZE_H
+#define RESIZE_H
+
+/* The filter of one direction: output pixel i is made from the taps input
+ * pixels starting at start[i], weighted by weights[i * taps ...].
+ */
+struct resize_axis {
+  _Array_ptr<JDIMENSION> start : count(out);
+  _Array_ptr<short> weights : count(out * taps);
+  JDIMENSION out;
+  JDIMENSION taps;
+};
+
+struct resize_sink {
+  struct output_sink pub;	/* public fields */
+  _Ptr<struct output_sink> inner;	/* gets the resized image */
+  JDIMENSION width, height;	/* asked for; 0 keeps the aspect ratio */
+  int components;
+  size_t in_stride, out_stride;	/* samples per input and output row */
+  struct resize_axis across, down;
+  /* The last down.taps horizontally resized rows; input row r is in
+   * ring[(r % down.taps) * out_stride ...].
+   */
+  _Array_ptr<JSAMPLE> ring : count(ring_size);
+  size_t ring_size;
+  _Array_ptr<JSAMPLE> row : count(out_stride);	/* the output row being made */
+  JDIMENSION rows_in, rows_out;
+};
+
+/* Fill in sink, to resize every image to width x height (one of them may
+ * be 0 to keep the aspect ratio) and pass it on to inner.
+ */
+extern _Ptr<struct output_sink> sink_resize(_Ptr<struct resize_sink> sink,
+                                            _Ptr<struct output_sink> inner,
+                                            JDIMENSION width, JDIMENSION height);
+
+#endif /* RESIZE_H */
@@ -0,0 +1,312 @@
+/*
+ * restart.c
+ *
+ * Restart interval index and strip source manager; see restart.h.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define HAVE_PROTOTYPES
+#include <jpeglib.h>
+
+#include "restart.h"
+#pragma CHECKED_SCOPE on
+
+/* Marker codes, the byte after the 0xFF. */
+#define M_SOF0  0xC0
+#define M_SOF1  0xC1
+#define M_SOF15 0xCF
+#define M_DHT   0xC4
+#define M_DAC   0xCC
+#define M_RST0  0xD0
+#define M_RST7  0xD7
+#define M_SOI   0xD8
+#define M_EOI   0xD9
+#define M_SOS   0xDA
+#define M_APP0  0xE0
+#define M_APP14 0xEE
+#define M_APP15 0xEF
+#define M_COM   0xFE
+#define M_TEM   0x01
+
+/* One marker segment of a file. */
+struct segment {
+  size_t start;			/* offset of its 0xFF */
+  size_t end;			/* offset just past it */
+  int code;
+};
+
+/*
+ * Find the marker segment at or after pos (fill bytes are allowed before
+ * a marker).  Returns 1 on success, 0 if there isn't a well-formed one.
+ */
+
+static int
+next_segment (_Array_ptr<const JOCTET> data : count(size), size_t size, size_t pos,
+              _Ptr<struct segment> seg)
+{
+  if (pos >= size || data[pos] != 0xFF)
+    return 0;
+  while (pos + 1 < size && data[pos + 1] == 0xFF)
+    pos++;
+  if (pos + 1 >= size)
+    return 0;
+  seg->start = pos;
+  seg->code = data[pos + 1];
+  pos += 2;
+  if (seg->code == M_SOI || seg->code == M_EOI || seg->code == M_TEM ||
+      (seg->code >= M_RST0 && seg->code <= M_RST7)) {
+    seg->end = pos;
+    return 1;
+  }
+  if (pos + 2 > size)
+    return 0;
+  size_t length = (size_t) data[pos] << 8 | data[pos + 1];
+  if (length < 2 || length > size - pos)
+    return 0;
+  seg->end = pos + length;
+  return 1;
+}
+
+/* Only baseline and extended sequential Huffman images can be split. */
+
+static int
+is_sof (int code)
+{
+  return code >= M_SOF0 && code <= M_SOF15 && code != M_DHT && code != M_DAC;
+}
+
+/* Segments the strips can do without: comments and APPn, except for the
+ * JFIF APP0 and Adobe APP14, from which the library works out the color
+ * space (YCCK rather than CMYK, RGB rather than YCbCr).
+ */
+
+static int
+is_droppable (int code)
+{
+  return (code > M_APP0 && code < M_APP14) || code == M_APP15 || code == M_COM;
+}
+
+static int
+add_interval (_Ptr<struct restart_index> index, size_t start)
+{
+  if (index->num_intervals == index->capacity) {
+    size_t capacity = index->capacity ? 2 * index->capacity : 256;
+    _Array_ptr<size_t> starts : count(capacity) = calloc<size_t>(capacity, sizeof(size_t));
+    if (starts == NULL)
+      return 0;
+    for (size_t k = 0; k < index->num_intervals; k++)
+      starts[k] = index->starts[k];
+    free<size_t>(index->starts);
+    index->starts = starts, index->capacity = capacity;
+  }
+  index->starts[index->num_intervals++] = start;
+  return 1;
+}
+
+
+int
+restart_index_build (_Ptr<struct restart_index> index,
+                     _Array_ptr<const JOCTET> data : count(size), size_t size)
+{
+  struct restart_index empty = {};
+  struct segment seg = {};
+  size_t pos = 0, kept = 0, entropy = 0;
+  int have_sof = 0;
+
+  *index = empty;
+  if (!next_segment(data, size, 0, &seg) || seg.code != M_SOI)
+    return 0;
+
+  /* Check the header and measure the part of it that we keep. */
+  for (pos = seg.end; ; pos = seg.end) {
+    if (!next_segment(data, size, pos, &seg))
+      return 0;
+    if (is_sof(seg.code)) {
+      if (seg.code != M_SOF0 && seg.code != M_SOF1)
+        return 0;
+      if (seg.end - seg.start < 9)
+        return 0;
+      have_sof = 1;
+    }
+    if (seg.code == M_EOI)
+      return 0;
+    if (!is_droppable(seg.code))
+      kept += seg.end - seg.start;
+    if (seg.code == M_SOS)
+      break;
+  }
+  if (!have_sof)
+    return 0;
+  entropy = seg.end;
+
+  /* Copy it, with SOI first. */
+  size_t header_size = 2 + kept;
+  _Array_ptr<JOCTET> header : count(header_size) = malloc<JOCTET>(header_size);
+  if (header == NULL)
+    return 0;
+  size_t len = 0;
+  header[len++] = 0xFF, header[len++] = M_SOI;
+  next_segment(data, size, 0, &seg);
+  for (pos = seg.end; pos < entropy; pos = seg.end) {
+    next_segment(data, size, pos, &seg);
+    if (is_droppable(seg.code))
+      continue;
+    if (is_sof(seg.code))
+      index->height_offset = len + 5;
+    for (size_t k = seg.start; k < seg.end; k++)
+      header[len++] = data[k];
+  }
+  index->header = header, index->header_size = header_size;
+
+  /* Walk the entropy-coded data, noting where each interval begins.  Other
+   * than stuffed zeros, fill bytes and RSTn, the only marker allowed is
+   * the EOI; anything else means more scans, which we can't split.
+   */
+  int ok = add_interval(index, entropy);
+  for (size_t i = entropy; ok && i + 1 < size; i++) {
+    if (data[i] != 0xFF)
+      continue;
+    int code = data[i + 1];
+    if (code == 0x00) {
+      i++;
+    } else if (code >= M_RST0 && code <= M_RST7) {
+      ok = add_interval(index, i + 2);
+      i++;
+    } else if (code == M_EOI) {
+      break;
+    } else if (code != 0xFF) {
+      ok = 0;
+    }
+  }
+  if (!ok) {
+    restart_index_free(index);
+    return 0;
+  }
+  return 1;
+}
+
+void
+restart_index_free (_Ptr<struct restart_index> index)
+{
+  free<JOCTET>(index->header);
+  free<size_t>(index->starts);
+  index->header = ((void *)0), index->header_size = 0;
+  index->starts = ((void *)0), index->capacity = 0;
+  index->num_intervals = 0;
+}
+
+
+/*
+ * The strip source manager.  It hands the library the header, then the
+ * data, then (should the data run out) a fake EOI, as jdatasrc.c does.
+ */
+
+static const JOCTET fake_eoi _Checked[2] = { 0xFF, M_EOI };
+
+static _Ptr<struct strip_source>
+strip_of (j_decompress_ptr cinfo)
+{
+  return _Dynamic_bounds_cast<_Ptr<struct strip_source>>(cinfo->src);
+}
+
+/* Make bytes offset.. of the given buffer the next ones read. */
+
+static void
+strip_position (_Ptr<struct strip_source> src,
+                _Array_ptr<const JOCTET> base : count(size), size_t size, size_t offset)
+{
+  src->pub.bytes_in_buffer = size - offset;
+  if (offset < size)
+    src->pub.next_input_byte = _Dynamic_bounds_cast<_Ptr<const JOCTET>>(base + offset);
+}
+
+static void
+strip_init_source (j_decompress_ptr cinfo)
+{
+  _Ptr<struct strip_source> src = strip_of(cinfo);
+
+  src->part = 0;
+  strip_position(src, src->header, src->header_size, 0);
+}
+
+static boolean
+strip_fill_input_buffer (j_decompress_ptr cinfo)
+{
+  _Ptr<struct strip_source> src = strip_of(cinfo);
+
+  if (src->part == 0 && src->data_size > 0) {
+    src->part = 1;
+    strip_position(src, src->data, src->data_size, 0);
+  } else {
+    src->part = 2;
+    strip_position(src, fake_eoi, sizeof(fake_eoi), 0);
+  }
+  return TRUE;
+}
+
+static void
+strip_skip_input_data (j_decompress_ptr cinfo, long num_bytes)
+{
+  _Ptr<struct strip_source> src = strip_of(cinfo);
+
+  if (num_bytes <= 0)
+    return;
+  while ((size_t) num_bytes > src->pub.bytes_in_buffer) {
+    num_bytes -= (long) src->pub.bytes_in_buffer;
+    (void) strip_fill_input_buffer(cinfo);
+  }
+  size_t left = src->pub.bytes_in_buffer - (size_t) num_bytes;
+  if (src->part == 0)
+    strip_position(src, src->header, src->header_size, src->header_size - left);
+  else if (src->part == 1)
+    strip_position(src, src->data, src->data_size, src->data_size - left);
+  else
+    strip_position(src, fake_eoi, sizeof(fake_eoi), sizeof(fake_eoi) - left);
+}
+
+static void
+strip_term_source (j_decompress_ptr cinfo)
+{
+  /* no work necessary here */
+}
+
+int
+strip_source_init (j_decompress_ptr cinfo, _Ptr<struct strip_source> src,
+                   _Ptr<const struct restart_index> index,
+                   _Array_ptr<const JOCTET> data : count(size), size_t size,
+                   size_t interval, JDIMENSION height)
+{
+  struct strip_source empty = {};
+  size_t header_size = index->header_size;
+  _Array_ptr<JOCTET> header : count(header_size) = malloc<JOCTET>(header_size);
+
+  *src = empty;
+  if (header == NULL)
+    return 0;
+  memcpy(header, index->header, header_size);
+  header[index->height_offset] = (JOCTET) (height >> 8);
+  header[index->height_offset + 1] = (JOCTET) (height & 0xFF);
+
+  size_t start = index->starts[interval];
+  src->header = header, src->header_size = header_size;
+  src->data = _Dynamic_bounds_cast<_Array_ptr<const JOCTET>>(data + start, count(size - start)),
+    src->data_size = size - start;
+  src->pub.init_source = strip_init_source;
+  src->pub.fill_input_buffer = strip_fill_input_buffer;
+  src->pub.skip_input_data = strip_skip_input_data;
+  src->pub.resync_to_restart = jpeg_resync_to_restart;
+  src->pub.term_source = strip_term_source;
+  src->pub.bytes_in_buffer = 0;
+  cinfo->src = &src->pub;
+  return 1;
+}
+
+void
+strip_source_free (_Ptr<struct strip_source> src)
+{
+  free<JOCTET>(src->header);
+  src->header = ((void *)0), src->header_size = 0;
+}
@@ -0,0 +1,70 @@
+/*
+ * restart.h
+ *
+ * Splitting a JPEG with restart markers into independently decodable strips.
+ *
+ * Each restart interval of a sequential JPEG is entropy coded on its own:
+ * the DC predictions and the Huffman decoder's bit buffer are reset at every
+ * RST marker.  So a decoder can start at any interval, given the tables from
+ * the file's header, an SOF that describes only the rows from there down,
+ * and a data stream whose first marker is RST0, which the library expects
+ * after the SOS.  As markers count modulo 8, a strip can begin at any
+ * interval whose index is a multiple of 8 and which starts a fresh MCU row.
+ *
+ * restart_index_build finds the intervals of a file in memory and keeps a
+ * compact copy of its header; strip_source_init then makes a decompressor
+ * read the header (with a new height) followed by the file's own data from a
+ * given interval on, without copying any entropy-coded data.
+ *
+ * Include <stdio.h> and <jpeglib.h> before this file.
+ */
+
+#ifndef RESTART_H
+#define RESTART_H
+
+struct restart_index {
+  /* The file's markers from SOI through the SOS header, less the COM and
+   * APPn segments the strips don't need: all but APP0 (JFIF) and APP14
+   * (Adobe), which decide the color space.
+   */
+  _Array_ptr<JOCTET> header : count(header_size);
+  size_t header_size;
+  size_t height_offset;		/* of the SOF's 16-bit image height in header */
+  /* Offsets in the file of the entropy-coded data of each interval. */
+  _Array_ptr<size_t> starts : count(capacity);
+  size_t num_intervals;
+  size_t capacity;
+};
+
+/* Index the single-scan sequential JPEG in data.  Returns 1 on success, 0
+ * if it is not one (progressive, several scans, malformed, ...) or if out of
+ * memory, leaving the index empty.
+ */
+extern int restart_index_build(_Ptr<struct restart_index> index,
+                               _Array_ptr<const JOCTET> data : count(size), size_t size);
+extern void restart_index_free(_Ptr<struct restart_index> index);
+
+/* A source manager for one strip: a copy of the header, then the file from
+ * the start of one interval to its end.
+ */
+struct strip_source {
+  struct jpeg_source_mgr pub;	/* public fields */
+  _Array_ptr<JOCTET> header : count(header_size);
+  size_t header_size;
+  _Array_ptr<const JOCTET> data : count(data_size);
+  size_t data_size;
+  int part;			/* 0 for the header, 1 for the data, 2 past the end */
+};
+
+/* Point cinfo->src at a strip_source that reads the image from interval
+ * number interval on, as if it were an image height rows high.  Returns 1
+ * on success, 0 if out of memory; strip_source_free releases the header
+ * copy afterwards.
+ */
+extern int strip_source_init(j_decompress_ptr cinfo, _Ptr<struct strip_source> src,
+                             _Ptr<const struct restart_index> index,
+                             _Array_ptr<const JOCTET> data : count(size), size_t size,
+                             size_t interval, JDIMENSION height);
+extern void strip_source_free(_Ptr<struct strip_source> src);
+
+#endif /* RESTART_H */
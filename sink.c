@@ -0,0 +1,489 @@
+/*
+ * sink.c
+ *
+ * The built-in output sinks; see sink.h.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define HAVE_PROTOTYPES
+#include <jpeglib.h>
+
+#include "ascii.h"
+#include "sink.h"
+#include "writer.h"
+#pragma CHECKED_SCOPE on
+
+/* sink really points to the pub member of one of the structs below. */
+
+static _Ptr<struct file_sink>
+file_sink_of (_Ptr<struct output_sink> sink)
+{
+  return _Dynamic_bounds_cast<_Ptr<struct file_sink>>(sink);
+}
+
+static _Ptr<struct memory_sink>
+memory_sink_of (_Ptr<struct output_sink> sink)
+{
+  return _Dynamic_bounds_cast<_Ptr<struct memory_sink>>(sink);
+}
+
+static _Ptr<struct null_sink>
+null_sink_of (_Ptr<struct output_sink> sink)
+{
+  return _Dynamic_bounds_cast<_Ptr<struct null_sink>>(sink);
+}
+
+
+/*
+ * PPM/PGM.  Grayscale and RGB have a PPM form, ASCII or binary; four
+ * components (CMYK) only have the binary PAM form, P7.
+ */
+
+static int
+ppm_begin (_Ptr<struct output_sink> sink, _Ptr<const struct sink_image> image,
+           boolean binary)
+{
+  _Ptr<struct file_sink> fs = file_sink_of(sink);
+  char header _Nt_checked[112];
+  int len;
+
+  if (image->components == 4 && binary) {
+    len = snprintf(header, sizeof(header),
+                   "P7\nWIDTH %u\nHEIGHT %u\nDEPTH 4\nMAXVAL 255\nTUPLTYPE CMYK\nENDHDR\n",
+                   image->width, image->height);
+  } else if (image->components == 1 || image->components == 3) {
+    len = snprintf(header, sizeof(header), "%s\n%u %u\n255\n",
+                   image->components == 1 ? (binary ? "P5" : "P2") : (binary ? "P6" : "P3"),
+                   image->width, image->height);
+  } else {
+    fprintf(stderr, "%d-component images can't be written as %s\n", image->components,
+            image->components == 4 ? "ASCII PPM (try --binary)" : "PPM");
+    return 0;
+  }
+  return writer_write(fs->out, _Dynamic_bounds_cast<_Array_ptr<const char>>(header, count(len)),
+                      len);
+}
+
+static int
+ascii_begin (_Ptr<struct output_sink> sink, _Ptr<const struct sink_image> image)
+{
+  return ppm_begin(sink, image, FALSE);
+}
+
+static int
+binary_begin (_Ptr<struct output_sink> sink, _Ptr<const struct sink_image> image)
+{
+  return ppm_begin(sink, image, TRUE);
+}
+
+static int
+ascii_rows (_Ptr<struct output_sink> sink, JSAMPROW rows : count(num_rows * row_stride),
+            JDIMENSION num_rows, size_t row_stride)
+{
+  _Ptr<struct writer> out = file_sink_of(sink)->out;
+  /* Samples formatted per reservation, leaving room for the newline.  The
+   * text goes straight into the writer's buffer (see ascii.h).
+   */
+  size_t chunk = (writer_buffer_size(out) - 1) / ASCII_SAMPLE_SIZE;
+
+  for (JDIMENSION r = 0; r < num_rows; r++) {
+    JSAMPROW row : count(row_stride) =
+      _Dynamic_bounds_cast<JSAMPROW>(rows + r * row_stride, count(row_stride));
+    for (size_t i = 0; i < row_stride; ) {
+      size_t n = row_stride - i < chunk ? row_stride - i : chunk;
+      boolean last = i + n == row_stride;
+      size_t len = ASCII_SAMPLE_SIZE * n + last;
+      _Array_ptr<char> text : count(len) = writer_reserve(out, len);
+      ascii_format(_Dynamic_bounds_cast<_Array_ptr<char>>(text, count(ASCII_SAMPLE_SIZE * n)),
+                   _Dynamic_bounds_cast<_Array_ptr<const JSAMPLE>>(row + i, count(n)), n);
+      if (last)
+        text[ASCII_SAMPLE_SIZE * n] = '\n';
+      writer_commit(out, len);
+      i += n;
+    }
+  }
+  return 1;
+}
+
+static int
+binary_rows (_Ptr<struct output_sink> sink, JSAMPROW rows : count(num_rows * row_stride),
+             JDIMENSION num_rows, size_t row_stride)
+{
+  size_t n = num_rows * row_stride;
+
+  return writer_write(file_sink_of(sink)->out,
+                      _Dynamic_bounds_cast<_Array_ptr<const char>>(rows, count(n)), n);
+}
+
+static int
+file_end (_Ptr<struct output_sink> sink, boolean ok)
+{
+  /* Flush even after a failure, so the writer is idle for its next file. */
+  return writer_flush(file_sink_of(sink)->out) && ok;
+}
+
+GLOBAL(_Ptr<struct output_sink>)
+sink_ascii_ppm (_Ptr<struct file_sink> sink, _Ptr<struct writer> out)
+{
+  struct file_sink zero = {};
+
+  *sink = zero;
+  sink->pub.begin_image = ascii_begin;
+  sink->pub.write_rows = ascii_rows;
+  sink->pub.end_image = file_end;
+  sink->out = out;
+  return &sink->pub;
+}
+
+GLOBAL(_Ptr<struct output_sink>)
+sink_binary_ppm (_Ptr<struct file_sink> sink, _Ptr<struct writer> out)
+{
+  struct file_sink zero = {};
+
+  *sink = zero;
+  sink->pub.begin_image = binary_begin;
+  sink->pub.write_rows = binary_rows;
+  sink->pub.end_image = file_end;
+  sink->out = out;
+  return &sink->pub;
+}
+
+
+/*
+ * Raw planar.  A single-component image is already planar, so it streams
+ * straight through; anything else is gathered plane by plane in fs->image
+ * and written out at the end.
+ *
+ * Splitting the pixels into planes is the only loop over components on
+ * the output path.  planar_begin picks a version of it for the image's
+ * component count, so the common counts get a loop whose stride is a
+ * constant the compiler can unroll and vectorize, rather than one that
+ * branches on the count for every sample.
+ */
+
+/* Do what deinterleave_fn describes for pixels of n components.  Always
+ * inlined with a constant n; see the versions below.  (One component needs
+ * no splitting, and never gets here.)
+ */
+
+static inline void
+deinterleave (_Array_ptr<JSAMPLE> image : count(n * plane_size), size_t plane_size,
+              size_t offset, JSAMPROW rows : count(n * pixels), size_t pixels, int n)
+{
+  for (int c = 0; c < n; c++) {
+    _Array_ptr<JSAMPLE> plane : count(pixels) =
+      _Dynamic_bounds_cast<_Array_ptr<JSAMPLE>>(image + c * plane_size + offset,
+                                                count(pixels));
+    for (size_t i = 0; i < pixels; i++)
+      plane[i] = rows[i * n + c];
+  }
+}
+
+static void
+deinterleave_3 (_Array_ptr<JSAMPLE> image : count(components * plane_size), size_t plane_size,
+                size_t offset, JSAMPROW rows : count(components * pixels), size_t pixels,
+                int components)
+{
+  deinterleave(image, plane_size, offset, rows, pixels, 3);
+}
+
+static void
+deinterleave_4 (_Array_ptr<JSAMPLE> image : count(components * plane_size), size_t plane_size,
+                size_t offset, JSAMPROW rows : count(components * pixels), size_t pixels,
+                int components)
+{
+  deinterleave(image, plane_size, offset, rows, pixels, 4);
+}
+
+/* Any other count. */
+
+static void
+deinterleave_n (_Array_ptr<JSAMPLE> image : count(components * plane_size), size_t plane_size,
+                size_t offset, JSAMPROW rows : count(components * pixels), size_t pixels,
+                int components)
+{
+  deinterleave(image, plane_size, offset, rows, pixels, components);
+}
+
+static void
+planar_release (_Ptr<struct file_sink> fs)
+{
+  free<JSAMPLE>(fs->image);
+  fs->image = ((void *)0), fs->image_size = 0;
+}
+
+static int
+planar_begin (_Ptr<struct output_sink> sink, _Ptr<const struct sink_image> image)
+{
+  _Ptr<struct file_sink> fs = file_sink_of(sink);
+
+  fs->info = *image;
+  fs->rows_written = 0;
+  planar_release(fs);
+  if (image->components == 1)
+    return 1;
+  size_t size = (size_t) image->width * image->height * image->components;
+  _Array_ptr<JSAMPLE> buffer : count(size) = malloc<JSAMPLE>(size);
+  if (buffer == NULL) {
+    fprintf(stderr, "out of memory for a %ux%u planar image\n",
+            image->width, image->height);
+    return 0;
+  }
+  fs->image = buffer, fs->image_size = size;
+  fs->deinterleave = image->components == 3 ? deinterleave_3 :
+                     image->components == 4 ? deinterleave_4 : deinterleave_n;
+  return 1;
+}
+
+static int
+planar_rows (_Ptr<struct output_sink> sink, JSAMPROW rows : count(num_rows * row_stride),
+             JDIMENSION num_rows, size_t row_stride)
+{
+  _Ptr<struct file_sink> fs = file_sink_of(sink);
+
+  if (fs->info.components == 1)
+    return writer_write(fs->out, _Dynamic_bounds_cast<_Array_ptr<const char>>
+                                   (rows, count(num_rows * row_stride)),
+                        num_rows * row_stride);
+
+  /* rows continues each plane from row rows_written. */
+  size_t plane_size = (size_t) fs->info.width * fs->info.height;
+  size_t pixels = (size_t) num_rows * fs->info.width;
+  int components = fs->info.components;
+  if (num_rows > fs->info.height - fs->rows_written)
+    return 0;
+  (*fs->deinterleave)(_Dynamic_bounds_cast<_Array_ptr<JSAMPLE>>
+                        (fs->image, count(components * plane_size)),
+                      plane_size, (size_t) fs->rows_written * fs->info.width,
+                      _Dynamic_bounds_cast<JSAMPROW>(rows, count(components * pixels)),
+                      pixels, components);
+  fs->rows_written += num_rows;
+  return 1;
+}
+
+static int
+planar_end (_Ptr<struct output_sink> sink, boolean ok)
+{
+  _Ptr<struct file_sink> fs = file_sink_of(sink);
+
+  if (ok && fs->info.components != 1)
+    ok = writer_write(fs->out, _Dynamic_bounds_cast<_Array_ptr<const char>>
+                                 (fs->image, count(fs->image_size)),
+                      fs->image_size);
+  planar_release(fs);
+  return writer_flush(fs->out) && ok;
+}
+
+GLOBAL(_Ptr<struct output_sink>)
+sink_raw_planar (_Ptr<struct file_sink> sink, _Ptr<struct writer> out)
+{
+  struct file_sink zero = {};
+
+  *sink = zero;
+  sink->pub.begin_image = planar_begin;
+  sink->pub.write_rows = planar_rows;
+  sink->pub.end_image = planar_end;
+  sink->out = out;
+  return &sink->pub;
+}
+
+
+/*
+ * Framed.  Every image is a header and its samples, and a status word after
+ * them; see sink.h for the layout.  The header promises a sample count, so
+ * an image that fails part way is padded out with zeros to keep the frames
+ * in step, and the status word says it is bad.
+ */
+
+/* Store v at out[0..4) least significant byte first. */
+
+static void
+put_le32 (_Array_ptr<char> out : count(4), unsigned long v)
+{
+  for (int i = 0; i < 4; i++)
+    out[i] = (char) ((v >> (8 * i)) & 0xFF);
+}
+
+static int
+framed_begin (_Ptr<struct output_sink> sink, _Ptr<const struct sink_image> image)
+{
+  _Ptr<struct file_sink> fs = file_sink_of(sink);
+  char header _Checked[FRAME_HEADER_SIZE];
+  size_t size = (size_t) image->width * image->height * image->components;
+  _Nt_array_ptr<const char> format = "";
+
+  switch (image->components) {
+  case 1: format = "GRAY"; break;
+  case 3: format = "RGB "; break;
+  case 4: format = "CMYK"; break;
+  default:
+    fprintf(stderr, "%d-component images have no frame format\n", image->components);
+    return 0;
+  }
+  fs->info = *image;
+  fs->rows_written = 0;
+  put_le32(header, FRAME_HEADER_SIZE);
+  put_le32(_Dynamic_bounds_cast<_Array_ptr<char>>(header + 4, count(4)), image->width);
+  put_le32(_Dynamic_bounds_cast<_Array_ptr<char>>(header + 8, count(4)), image->height);
+  put_le32(_Dynamic_bounds_cast<_Array_ptr<char>>(header + 12, count(4)), image->components);
+  for (int i = 0; i < 4; i++)
+    header[16 + i] = format[i];
+  /* The sample count as two halves, low first. */
+  put_le32(_Dynamic_bounds_cast<_Array_ptr<char>>(header + 20, count(4)), size & 0xFFFFFFFF);
+  put_le32(_Dynamic_bounds_cast<_Array_ptr<char>>(header + 24, count(4)),
+           (unsigned long) ((unsigned long long) size >> 32));
+  /* From here on end_image owes the stream the rest of the frame. */
+  fs->in_frame = TRUE;
+  return writer_write(fs->out, header, FRAME_HEADER_SIZE);
+}
+
+static int
+framed_rows (_Ptr<struct output_sink> sink, JSAMPROW rows : count(num_rows * row_stride),
+             JDIMENSION num_rows, size_t row_stride)
+{
+  _Ptr<struct file_sink> fs = file_sink_of(sink);
+  size_t n = num_rows * row_stride;
+
+  if (num_rows > fs->info.height - fs->rows_written)
+    return 0;
+  fs->rows_written += num_rows;
+  return writer_write(fs->out, _Dynamic_bounds_cast<_Array_ptr<const char>>(rows, count(n)), n);
+}
+
+static int
+framed_end (_Ptr<struct output_sink> sink, boolean ok)
+{
+  _Ptr<struct file_sink> fs = file_sink_of(sink);
+  char status _Checked[4];
+
+  if (fs->in_frame) {
+    size_t missing = (size_t) (fs->info.height - fs->rows_written) *
+                     fs->info.width * fs->info.components;
+    size_t chunk = writer_buffer_size(fs->out);
+    while (missing > 0) {
+      size_t n = missing < chunk ? missing : chunk;
+      _Array_ptr<char> zeros : count(n) = writer_reserve(fs->out, n);
+      memset(zeros, 0, n);
+      writer_commit(fs->out, n);
+      missing -= n;
+    }
+    ok = ok && fs->rows_written == fs->info.height;
+    put_le32(status, ok ? 0 : 1);
+    writer_write(fs->out, status, 4);
+    fs->in_frame = FALSE;
+  }
+  return writer_flush(fs->out) && ok;
+}
+
+GLOBAL(_Ptr<struct output_sink>)
+sink_framed (_Ptr<struct file_sink> sink, _Ptr<struct writer> out)
+{
+  struct file_sink zero = {};
+
+  *sink = zero;
+  sink->pub.begin_image = framed_begin;
+  sink->pub.write_rows = framed_rows;
+  sink->pub.end_image = framed_end;
+  sink->out = out;
+  return &sink->pub;
+}
+
+
+/*
+ * Caller-supplied memory.  Samples land interleaved, row after row, from the
+ * start of the buffer.
+ */
+
+static int
+memory_begin (_Ptr<struct output_sink> sink, _Ptr<const struct sink_image> image)
+{
+  _Ptr<struct memory_sink> ms = memory_sink_of(sink);
+
+  ms->info = *image;
+  ms->used = 0;
+  if ((size_t) image->width * image->height * image->components > ms->size) {
+    fprintf(stderr, "%ux%u image doesn't fit in the output buffer\n",
+            image->width, image->height);
+    return 0;
+  }
+  return 1;
+}
+
+static int
+memory_rows (_Ptr<struct output_sink> sink, JSAMPROW rows : count(num_rows * row_stride),
+             JDIMENSION num_rows, size_t row_stride)
+{
+  _Ptr<struct memory_sink> ms = memory_sink_of(sink);
+  size_t n = num_rows * row_stride;
+
+  /* begin_image checked the image fits, but a sink can't trust that. */
+  if (n > ms->size - ms->used)
+    return 0;
+  memcpy(_Dynamic_bounds_cast<_Array_ptr<JSAMPLE>>(ms->buffer + ms->used, count(n)),
+         rows, n);
+  ms->used += n;
+  return 1;
+}
+
+static int
+memory_end (_Ptr<struct output_sink> sink, boolean ok)
+{
+  return ok;
+}
+
+GLOBAL(_Ptr<struct output_sink>)
+sink_memory (_Ptr<struct memory_sink> sink, _Array_ptr<JSAMPLE> buffer : count(size),
+             size_t size)
+{
+  struct memory_sink zero = {};
+
+  *sink = zero;
+  sink->pub.begin_image = memory_begin;
+  sink->pub.write_rows = memory_rows;
+  sink->pub.end_image = memory_end;
+  sink->buffer = buffer, sink->size = size;
+  return &sink->pub;
+}
+
+
+/*
+ * Nothing.
+ */
+
+static int
+null_begin (_Ptr<struct output_sink> sink, _Ptr<const struct sink_image> image)
+{
+  return 1;
+}
+
+static int
+null_rows (_Ptr<struct output_sink> sink, JSAMPROW rows : count(num_rows * row_stride),
+           JDIMENSION num_rows, size_t row_stride)
+{
+  _Ptr<struct null_sink> ns = null_sink_of(sink);
+
+  ns->rows += num_rows;
+  ns->samples += num_rows * row_stride;
+  return 1;
+}
+
+static int
+null_end (_Ptr<struct output_sink> sink, boolean ok)
+{
+  return ok;
+}
+
+GLOBAL(_Ptr<struct output_sink>)
+sink_null (_Ptr<struct null_sink> sink)
+{
+  struct null_sink zero = {};
+
+  *sink = zero;
+  sink->pub.begin_image = null_begin;
+  sink->pub.write_rows = null_rows;
+  sink->pub.end_image = null_end;
+  return &sink->pub;
+}
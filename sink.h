@@ -0,0 +1,138 @@
+/*
+ * sink.h
+ *
+ * Output sinks: where decoded scanlines go.
+ *
+ * The decoder hands every image to a sink in three steps.  begin_image is
+ * told the dimensions of the image that is about to be written, write_rows is
+ * given the image's scanlines top to bottom in strips of whole rows, and
+ * end_image is told whether the image was completed.  Formatting (PPM
+ * headers, ASCII samples, plane reordering) is entirely up to the sink, so the
+ * decoder itself never does any output.
+ *
+ * Like the IJG library's own managers, a sink is a struct whose first member
+ * is a struct output_sink holding the methods; the methods get a pointer to
+ * that member and cast it back to the containing struct.  The structs for the
+ * built-in sinks are declared here so callers can allocate them anywhere.
+ *
+ * Include <stdio.h> and <jpeglib.h> before this file.
+ */
+
+#ifndef SINK_H
+#define SINK_H
+
+/* What begin_image is told about the image. */
+struct sink_image {
+  JDIMENSION width;		/* pixels per row */
+  JDIMENSION height;		/* rows that will be written */
+  int components;		/* samples per pixel */
+};
+
+struct output_sink;
+struct writer;			/* see writer.h */
+
+/* Prepare for an image.  Returns 1 on success, 0 if the sink can't take it. */
+typedef _Ptr<int (_Ptr<struct output_sink> sink,
+                  _Ptr<const struct sink_image> image)> sink_begin_fn;
+
+/* Take the next num_rows rows of the image, stored back to back; row_stride
+ * is always width * components.  Returns 1 on success, 0 on error.
+ */
+typedef _Ptr<int (_Ptr<struct output_sink> sink,
+                  JSAMPROW rows : count(num_rows * row_stride),
+                  JDIMENSION num_rows, size_t row_stride)> sink_rows_fn;
+
+/* Finish an image.  ok is FALSE if decoding failed part way, in which case
+ * begin_image may not have been called (or may have failed) and the sink
+ * should just release whatever it holds.  Returns 1 on success, 0 on error.
+ */
+typedef _Ptr<int (_Ptr<struct output_sink> sink, boolean ok)> sink_end_fn;
+
+struct output_sink {
+  sink_begin_fn begin_image;
+  sink_rows_fn write_rows;
+  sink_end_fn end_image;
+};
+
+
+/* Copy the given number of pixels, each of components interleaved
+ * samples, from rows into the planes of a planar image, starting offset
+ * samples into each plane.  plane_size is the number of samples per plane.
+ */
+typedef _Ptr<void (_Array_ptr<JSAMPLE> image : count(components * plane_size),
+                   size_t plane_size, size_t offset,
+                   JSAMPROW rows : count(components * pixels), size_t pixels,
+                   int components)> deinterleave_fn;
+
+/* Output through a writer: PPM/PGM, ASCII (P2/P3) or binary (P5/P6, or
+ * P7 PAM for CMYK), raw planar or framed.  end_image flushes the writer.
+ */
+struct file_sink {
+  struct output_sink pub;	/* public fields */
+  _Ptr<struct writer> out;
+  /* The planar sink gathers the whole image here before writing it. */
+  _Array_ptr<JSAMPLE> image : count(image_size);
+  size_t image_size;
+  struct sink_image info;
+  JDIMENSION rows_written;	/* rows gathered (or framed) so far */
+  deinterleave_fn deinterleave;	/* chosen for the image's components */
+  boolean in_frame;		/* the framed sink owes the rest of a frame */
+};
+
+/* A caller-supplied buffer that receives the interleaved samples. */
+struct memory_sink {
+  struct output_sink pub;	/* public fields */
+  _Array_ptr<JSAMPLE> buffer : count(size);
+  size_t size;
+  size_t used;			/* samples stored so far */
+  struct sink_image info;	/* the last image begun */
+};
+
+/* Throws the samples away, counting them; for timing the decoder alone. */
+struct null_sink {
+  struct output_sink pub;	/* public fields */
+  size_t rows;
+  size_t samples;
+};
+
+/* Each of these fills in the caller's struct and returns its public part. */
+
+extern _Ptr<struct output_sink> sink_ascii_ppm(_Ptr<struct file_sink> sink,
+                                               _Ptr<struct writer> out);
+/* Binary PPM/PGM, or PAM for four components. */
+extern _Ptr<struct output_sink> sink_binary_ppm(_Ptr<struct file_sink> sink,
+                                                _Ptr<struct writer> out);
+/* Headerless raw samples, all of the first component, then all of the
+ * second, and so on.  Multi-component images are held in memory until
+ * end_image, since the first plane can't be finished before the last row.
+ */
+extern _Ptr<struct output_sink> sink_raw_planar(_Ptr<struct file_sink> sink,
+                                                _Ptr<struct writer> out);
+/* A stream of frames, for sending many images down one pipe.  Each frame
+ * is a header of FRAME_HEADER_SIZE bytes, the image's samples interleaved
+ * row after row, and a 4-byte status word.  All the numbers are unsigned
+ * and little-endian:
+ *
+ *	offset	size	field
+ *	0	4	header size, FRAME_HEADER_SIZE (skip any fields past ours)
+ *	4	4	width
+ *	8	4	height
+ *	12	4	components
+ *	16	4	format: "GRAY", "RGB " or "CMYK"
+ *	20	8	sample bytes that follow, width * height * components
+ *
+ * The status word is 0 if the image decoded completely.  If it didn't, the
+ * samples are padded out with zeros and the status is 1, so a reader can
+ * allocate the image up front and read it in a single call either way.
+ */
+#define FRAME_HEADER_SIZE 28
+
+extern _Ptr<struct output_sink> sink_framed(_Ptr<struct file_sink> sink,
+                                            _Ptr<struct writer> out);
+/* Images that don't fit in size samples are refused by begin_image. */
+extern _Ptr<struct output_sink> sink_memory(_Ptr<struct memory_sink> sink,
+                                            _Array_ptr<JSAMPLE> buffer : count(size),
+                                            size_t size);
+extern _Ptr<struct output_sink> sink_null(_Ptr<struct null_sink> sink);
+
+#endif /* SINK_H */
@@ -0,0 +1,88 @@
+/*
+ * stats.c
+ *
+ * Per-image JSON records for instrumented builds; see stats.h.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "stats.h"
+#pragma CHECKED_SCOPE on
+
+#ifdef TO_PPM_STATS
+
+/* Longest input name written out; longer ones are cut short. */
+#define STATS_NAME_MAX 4096
+
+static _Ptr<FILE> stats_file = ((void *)0);	/* NULL for stderr */
+
+double
+stats_clock (void)
+{
+  double now = 0;
+
+  _Unchecked {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    now = ts.tv_sec + ts.tv_nsec * 1e-9;
+  }
+  return now;
+}
+
+int
+stats_open (_Nt_array_ptr<const char> path)
+{
+  if (strcmp(path, "-") == 0)
+    return 1;
+  if ((stats_file = fopen(path, "w")) == NULL) {
+    fprintf(stderr, "can't create %s\n", path);
+    return 0;
+  }
+  /* Each record goes out whole, however the workers interleave. */
+  setvbuf(stats_file, NULL, _IOLBF, 0);
+  return 1;
+}
+
+/* Copy name into out as the body of a JSON string. */
+
+static void
+json_escape (_Array_ptr<char> out : count(size), size_t size,
+             _Nt_array_ptr<const char> name)
+{
+  size_t len = 0;
+
+  for (_Nt_array_ptr<const char> p = name; *p && len + 7 <= size; p++) {
+    unsigned char c = *p;
+    if (c == '"' || c == '\\') {
+      out[len++] = '\\';
+      out[len++] = c;
+    } else if (c < 0x20) {
+      _Unchecked { len += snprintf((char *) out + len, 7, "\\u%04x", c); }
+    } else {
+      out[len++] = c;
+    }
+  }
+  out[len] = '\0';
+}
+
+void
+stats_report (_Nt_array_ptr<const char> name, int ok,
+              _Ptr<const struct image_stats> stats)
+{
+  char escaped _Nt_checked[STATS_NAME_MAX + 1];
+  _Ptr<FILE> out = stats_file != NULL ? stats_file : stderr;
+
+  json_escape(escaped, STATS_NAME_MAX, name);
+  fprintf(out, "{\"file\":\"%s\",\"ok\":%s,\"header_ms\":%.3f,\"start_ms\":%.3f,"
+          "\"decode_ms\":%.3f,\"sink_ms\":%.3f,\"total_ms\":%.3f,\"rows\":%zu,"
+          "\"bytes\":%zu,\"warnings\":%ld,\"memory\":%zu}\n",
+          escaped, ok ? "true" : "false",
+          stats->header_time * 1e3, stats->start_time * 1e3, stats->decode_time * 1e3,
+          stats->sink_time * 1e3, stats->total_time * 1e3, stats->rows,
+          stats->bytes, stats->warnings, stats->memory);
+}
+
+#endif /* TO_PPM_STATS */
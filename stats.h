@@ -0,0 +1,77 @@
+/*
+ * stats.h
+ *
+ * Per-image timings and counters, for builds with TO_PPM_STATS defined
+ * (make to_ppm-stats).
+ *
+ * An instrumented to_ppm writes one line of JSON per input, to stderr or
+ * to the file given with --stats, such as
+ *
+ *	{"file":"a.jpg","ok":true,"header_ms":0.041,"start_ms":0.210,
+ *	 "decode_ms":5.902,"sink_ms":1.377,"total_ms":7.610,"rows":480,
+ *	 "bytes":921615,"warnings":0,"memory":1048576}
+ *
+ * (on one line).  header_ms and start_ms are the time spent in
+ * jpeg_read_header and jpeg_start_decompress, decode_ms in
+ * jpeg_read_scanlines, sink_ms in the output sink, including its final
+ * flush, and total_ms the whole conversion.  rows counts the scanlines
+ * decoded, bytes the output written, warnings the library's corrupt-data
+ * warnings (jerr.pub.num_warnings), and memory the most image memory in
+ * use at once (see arena_peak).  Only plain conversions are timed; the
+ * other modes report the counters alone.
+ *
+ * In other builds the macros below compile to just the statements they
+ * wrap, and nothing is collected.
+ *
+ * Include <stdio.h> before this file.
+ */
+
+#ifndef STATS_H
+#define STATS_H
+
+struct image_stats {
+  double header_time, start_time, decode_time, sink_time, total_time;	/* seconds */
+  size_t rows;
+  size_t bytes;
+  long warnings;
+  size_t memory;
+};
+
+#ifdef TO_PPM_STATS
+
+/* A monotonic clock, in seconds. */
+extern double stats_clock(void);
+
+/* Send the records to path, or to stderr if path is "-".  Returns 1 on
+ * success, 0 after printing a message if path can't be created.
+ */
+extern int stats_open(_Nt_array_ptr<const char> path);
+
+/* Write the record for one input. */
+extern void stats_report(_Nt_array_ptr<const char> name, int ok,
+                         _Ptr<const struct image_stats> stats);
+
+/* Run stmt, adding the time it takes to s->field; s may be NULL. */
+#define STATS_TIME(s, field, stmt) \
+  do { \
+    double stats_start_ = (s) != NULL ? stats_clock() : 0; \
+    stmt; \
+    if ((s) != NULL) \
+      (s)->field += stats_clock() - stats_start_; \
+  } while (0)
+
+/* Add n to s->field; s may be NULL. */
+#define STATS_ADD(s, field, n) \
+  do { \
+    if ((s) != NULL) \
+      (s)->field += (n); \
+  } while (0)
+
+#else
+
+#define STATS_TIME(s, field, stmt) do { stmt; } while (0)
+#define STATS_ADD(s, field, n) do { } while (0)
+
+#endif /* TO_PPM_STATS */
+
+#endif /* STATS_H */
@@ -1,65 +1,175 @@
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
 #include <setjmp.h>
+#include <limits.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <sys/mman.h>
+#include <unistd.h>
 
 #define HAVE_PROTOTYPES
 #include <jpeglib.h>
+
+#include "arena.h"
+#include "cache.h"
+#include "cli.h"
+#include "coef.h"
+#include "decoder.h"
+#include "fdsrc.h"
+#include "markers.h"
+#include "pipeline.h"
+#include "pool.h"
+#include "prefetch.h"
+#include "pushsrc.h"
+#include "restart.h"
+#include "sink.h"
+#include "resize.h"
+#include "stats.h"
+#include "writer.h"
+#include "yuv.h"
 #pragma CHECKED_SCOPE on
 
-void put_scanline_someplace(JSAMPROW buffer : count(row_stride), int row_stride) {
-  for (int i = 0; i < row_stride; i++)
-    printf("%3d ", buffer[i]);
-  printf("\n");
-}
+/* Size of each of the two buffers in a worker's output writer.  Binary
+ * strips are queued whole, so this only needs to be large enough to batch
+ * many rows into one write(2).
+ */
+#define OUTPUT_BUFFER_SIZE (1 << 20)
+
+/* By default the decode loop asks jpeg_read_scanlines for this many iMCU
+ * rows per call, so each call hands back whole iMCU rows.
+ */
+#define DEFAULT_BATCH_IMCU_ROWS 4
+
+/* Size budget of a --cache directory unless --cache-size says otherwise. */
+#define DEFAULT_CACHE_MB 256
 
-struct my_error_mgr {
-  struct jpeg_error_mgr pub;	/* "public" fields */
-  jmp_buf setjmp_buffer : itype(struct __jmp_buf_tag _Checked[1]);	/* for return to caller */
+/* The output formats we know how to write; each has a sink in sink.c. */
+enum output_format {
+  PPM_ASCII,			/* P2/P3: one "%3d " token per sample */
+  PPM_BINARY,			/* P5/P6: raw bytes, one per sample */
+  RAW_PLANAR,			/* headerless, one plane per component */
+  FRAMED,			/* binary headers for a stream of images */
+  NULL_OUTPUT,			/* decode only, for timing */
+  /* The rest don't go through a sink; see inspect_JPEG_file. */
+  PROBE_INFO,			/* one line of header fields */
+  COEF_DUMP,			/* the quantized DCT coefficients (coef.h) */
+  DCT_HASH,			/* a perceptual hash of the DC terms (coef.h) */
+  RAW_YUV			/* the components as coded, unconverted (yuv.h) */
+};
+
+/* Where the compressed data comes from. */
+enum input_mode {
+  INPUT_STDIO,			/* fopen + jpeg_stdio_src */
+  INPUT_MMAP			/* mmap + jpeg_mem_src, no copying */
+};
+
+/* Options controlling a single conversion, filled in from the command line. */
+struct to_ppm_options {
+  enum output_format format;
+  enum input_mode input;
+  JDIMENSION batch_rows;	/* scanlines per read call, 0 for the default */
+  /* Smallest acceptable output size, 0 if unconstrained.  The image is
+   * scaled down in the IDCT as far as possible while still meeting it.
+   */
+  JDIMENSION target_width, target_height;
+  J_DCT_METHOD dct_method;	/* IDCT algorithm */
+  boolean fancy_upsampling;	/* FALSE trades chroma quality for speed */
+  /* Decode to grayscale.  For YCbCr and grayscale JPEGs that is just the
+   * luma, and the library skips the chroma's IDCT, upsampling and color
+   * conversion altogether.
+   */
+  boolean grayscale;
+  /* Region of the (scaled) output image to write.  A zero width or height
+   * extends the region to the right or bottom edge.
+   */
+  boolean crop;
+  JDIMENSION crop_x, crop_y, crop_width, crop_height;
+  /* Split images with restart markers into strips decoded by all the
+   * workers at once (see read_JPEG_strips); implies INPUT_MMAP.
+   */
+  boolean strips;
+  /* Decode as the data arrives, a frame per batch of progressive scans
+   * (see stream_JPEG_file).
+   */
+  boolean stream;
+  /* Keep converted images in this directory, and serve repeats from it
+   * (see cached_convert); NULL for no cache.
+   */
+  _Nt_array_ptr<const char> cache_dir;
+  unsigned long long cache_budget;	/* bytes the cache may hold */
+  unsigned keep_markers;	/* MARKER_* bits of the segments a probe lists */
+  /* Resample every image to exactly this size after decoding it (see
+   * resize.h), 0 for either side to keep the aspect ratio; 0x0 for none.
+   */
+  JDIMENSION resize_width, resize_height;
 };
 
-typedef _Ptr<struct my_error_mgr> my_error_ptr;
 
 /*
- * Here's the routine that will replace the standard error_exit method:
+ * Scanlines to decode per jpeg_read_scanlines call, for an image of rows
+ * rows: what the options ask for, or a few iMCU rows, but never fewer rows
+ * than the library recommends nor more than the image has.
  */
 
-METHODDEF(void)
-my_error_exit (j_common_ptr cinfo)
+LOCAL(JDIMENSION)
+choose_batch_rows (j_decompress_ptr cinfo, _Ptr<const struct to_ppm_options> opts,
+                   JDIMENSION rows)
 {
-  /* cinfo->err really points to a my_error_mgr struct, so coerce pointer */
-  my_error_ptr myerr = _Dynamic_bounds_cast<_Ptr<struct my_error_mgr>>(cinfo->err);
+  JDIMENSION batch_rows = opts->batch_rows;
 
-  /* Always display the message. */
-  /* We could postpone this until after returning, if we chose. */
-  (*cinfo->err->output_message) (cinfo);
+  if (batch_rows == 0)
+    batch_rows = DEFAULT_BATCH_IMCU_ROWS * imcu_output_rows(cinfo);
+  if (batch_rows < (JDIMENSION) cinfo->rec_outbuf_height)
+    batch_rows = cinfo->rec_outbuf_height;
+  if (batch_rows > rows)
+    batch_rows = rows;
+  return batch_rows;
+}
+
+
+/*
+ * Keep only samples skip..skip+width-1 of each of the num_rows rows of a
+ * strip, packing the kept parts together at the front of the strip.
+ */
 
-  /* Return control to the setjmp point */
-  _Unchecked { longjmp(myerr->setjmp_buffer, 1); }
+LOCAL(void)
+crop_strip (JSAMPROW strip : count(num_rows * stride), JDIMENSION num_rows,
+            size_t stride, size_t skip, size_t width)
+{
+  for (JDIMENSION r = 0; r < num_rows; r++)
+    memmove(_Dynamic_bounds_cast<JSAMPROW>(strip + r * width, count(width)),
+            _Dynamic_bounds_cast<JSAMPROW>(strip + r * stride + skip, count(width)),
+            width);
 }
 
 
 /*
- * Sample routine for JPEG decompression.  We assume that the source file name
- * is passed in.  We want to return 1 on success, 0 on error.
+ * Sample routine for JPEG decompression.  We assume that the decompressor,
+ * the source file name, the sink that takes the decoded rows and the
+ * conversion options are passed in, and the file's contents if they are
+ * already in memory (see prefetch.h), or else NULL.  We want to return 1 on
+ * success, 0 on error.  Either way the decompressor is left ready for the
+ * next image, and the sink's end_image has been called.
  */
 
 
 GLOBAL(int)
-read_JPEG_file (_Nt_array_ptr<char> filename)
+read_JPEG_file (_Ptr<struct decoder> dec, _Nt_array_ptr<char> filename,
+                _Ptr<struct output_sink> sink, _Ptr<const struct to_ppm_options> opts,
+                _Ptr<const struct mapped_file> input)
 {
-
-  /* This struct contains the JPEG decompression parameters and pointers to
-   * working space (which is allocated as needed by the JPEG library).
-   */
-  struct jpeg_decompress_struct cinfo = {};
-  /* We use our private extension JPEG error handler.
-   * Note that this struct must live as long as the main JPEG parameter
-   * struct, to avoid dangling-pointer problems.
+  /* The JPEG decompression parameters and pointers to working space (which
+   * is allocated as needed by the JPEG library) live in the decoder.
    */
-  struct my_error_mgr jerr = {};
+  j_decompress_ptr cinfo = &dec->cinfo;
   /* More stuff */
   _Ptr<FILE> infile = ((void *)0);		/* source file */
-  JSAMPARRAY buffer : count(1) = ((void *)0);		/* Output row buffer */
+  struct mapped_file map = {};	/* or the mapped source file */
   int row_stride;		/* physical row width in output buffer */
+  int out_stride;		/* samples per row actually written */
+  JDIMENSION batch_rows;	/* scanlines decoded per jpeg_read_scanlines */
 
   /* In this example we want to open the input file before doing anything else,
    * so that the setjmp() error recovery below can assume the file is open.
@@ -67,52 +177,73 @@ read_JPEG_file (_Nt_array_ptr<char> filename)
    * requires it in order to read binary files.
    */
 
-  if ((infile = fopen(filename, "rb")) == NULL) {
+  if (input != NULL) {
+    /* Decoded in place, like a mapping, but never unmapped. */
+    map = *input;
+  } else if (opts->input == INPUT_MMAP) {
+    /* The decoder reads the file front to back exactly once. */
+    if (!map_file(filename, &map, MADV_SEQUENTIAL)) {
+      (void) (*sink->end_image)(sink, FALSE);
+      return 0;
+    }
+  } else if ((infile = fopen(filename, "rb")) == NULL) {
     fprintf(stderr, "can't open %s\n", filename);
+    (void) (*sink->end_image)(sink, FALSE);
     return 0;
   }
 
-  /* Step 1: allocate and initialize JPEG decompression object */
+  /* Step 1: the decompression object was created by decoder_init. */
 
-  /* We set up the normal JPEG error routines, then override error_exit. */
-  cinfo.err = jpeg_std_error(&jerr.pub);
-  jerr.pub.error_exit = my_error_exit;
   /* Establish the setjmp return context for my_error_exit to use. */
   int jmp = 0;
-  _Unchecked { jmp = setjmp(jerr.setjmp_buffer); }
+  _Unchecked { jmp = setjmp(dec->jerr.setjmp_buffer); }
   if (jmp) {
     /* If we get here, the JPEG code has signaled an error.
-     * We need to clean up the JPEG object, close the input file, and return.
+     * We need to abort this image, close the input file, and return.
+     * jpeg_abort_decompress releases the image's memory but keeps the
+     * JPEG object usable for the next file.
      */
-    jpeg_destroy_decompress(&cinfo);
-    fclose(infile);
+    decoder_recover(dec);
+    jpeg_abort_decompress(cinfo);
+    if (infile != NULL)
+      fclose(infile);
+    else if (input == NULL)
+      unmap_file(&map);
+    (void) (*sink->end_image)(sink, FALSE);
     return 0;
   }
-  /* Now we can initialize the JPEG decompression object. */
-  jpeg_create_decompress(&cinfo);
 
   /* Step 2: specify data source (eg, a file) */
 
-  jpeg_stdio_src(&cinfo, infile);
+  if (infile != NULL)
+    jpeg_stdio_src(cinfo, infile);
+  else
+    jpeg_mem_src(cinfo, map.data, map.size);
 
   /* Step 3: read file parameters with jpeg_read_header() */
 
-  (void) jpeg_read_header(&cinfo, TRUE);
+  STATS_TIME(dec->stats, header_time, (void) jpeg_read_header(cinfo, TRUE));
   /* We can ignore the return value from jpeg_read_header since
-   *   (a) suspension is not possible with the stdio data source, and
+   *   (a) suspension is not possible with the stdio and memory data sources,
    *   (b) we passed TRUE to reject a tables-only JPEG file as an error.
    * See libjpeg.txt for more info.
    */
 
   /* Step 4: set parameters for decompression */
 
-  /* In this example, we don't need to change any of the defaults set by
-   * jpeg_read_header(), so we do nothing here.
+  /* The defaults set by jpeg_read_header() give a full-size, full-quality
+   * decode; the options may trade some of that for speed.
    */
+  if (opts->target_width != 0 || opts->target_height != 0)
+    choose_scale(cinfo, opts->target_width, opts->target_height);
+  cinfo->dct_method = opts->dct_method;
+  cinfo->do_fancy_upsampling = opts->fancy_upsampling;
+  if (opts->grayscale)
+    cinfo->out_color_space = JCS_GRAYSCALE;
 
   /* Step 5: Start decompressor */
 
-  (void) jpeg_start_decompress(&cinfo);
+  STATS_TIME(dec->stats, start_time, (void) jpeg_start_decompress(cinfo));
   /* We can ignore the return value since suspension is not possible
    * with the stdio data source.
    */
@@ -123,72 +254,1558 @@ read_JPEG_file (_Nt_array_ptr<char> filename)
    * if we asked for color quantization.
    * In this example, we need to make an output work buffer of the right size.
    */ 
-  /* JSAMPLEs per row in output buffer */
-  row_stride = cinfo.output_width * cinfo.output_components;
-  /* Make a one-row-high sample array that will go away when done with image */
-  buffer = (*cinfo.mem->alloc_sarray)
-		((_Ptr<struct jpeg_common_struct>) &cinfo, JPOOL_IMAGE, row_stride, 1);
-
-  if (cinfo.output_components == 1) {
-    printf("P2\n");
-  } else if (cinfo.output_components == 3) {
-    printf("P3\n");
-  } else {
-    _Unchecked { longjmp(jerr.setjmp_buffer, 1); }
+  /* The rows and columns of the output image that we write: all of them
+   * unless cropping.  Rows above first_row are skipped and those from end_row
+   * on are never decoded.  The library can only crop horizontally to iMCU
+   * boundaries, so it may hand back a few extra columns on the left; skip
+   * counts the samples to drop from the start of each decoded row.  We also
+   * ask for one more iMCU column on either side than we need, since fancy
+   * upsampling treats the edges of the decoded region as the edges of the
+   * image; the extra columns keep the ones we write exact.
+   */
+  JDIMENSION first_row = 0, end_row = cinfo->output_height;
+  JDIMENSION out_width = cinfo->output_width;
+  size_t skip = 0;
+  if (opts->crop) {
+    JDIMENSION x = opts->crop_x, y = opts->crop_y;
+    JDIMENSION w = opts->crop_width, h = opts->crop_height;
+    if (x >= cinfo->output_width || y >= cinfo->output_height) {
+      fprintf(stderr, "%s: crop origin %u,%u is outside the %ux%u image\n",
+              filename, x, y, cinfo->output_width, cinfo->output_height);
+      _Unchecked { longjmp(dec->jerr.setjmp_buffer, 1); }
+    }
+    if (w == 0 || w > cinfo->output_width - x)
+      w = cinfo->output_width - x;
+    if (h == 0 || h > cinfo->output_height - y)
+      h = cinfo->output_height - y;
+    JDIMENSION margin = imcu_output_cols(cinfo);
+    JDIMENSION xoffset = x > margin ? x - margin : 0;
+    JDIMENSION width = x + w - xoffset + margin;
+    if (width > cinfo->output_width - xoffset)
+      width = cinfo->output_width - xoffset;
+    jpeg_crop_scanline(cinfo, &xoffset, &width);
+    skip = (size_t) (x - xoffset) * cinfo->output_components;
+    out_width = w;
+    first_row = y, end_row = y + h;
+  }
+  /* JSAMPLEs per row in output buffer; output_width reflects any crop */
+  row_stride = cinfo->output_width * cinfo->output_components;
+  out_stride = out_width * cinfo->output_components;
+  batch_rows = choose_batch_rows(cinfo, opts, end_row - first_row);
+  size_t strip_size = (size_t) row_stride * batch_rows;
+  /* Make a contiguous strip of batch_rows scanlines, and the array of row
+   * pointers into it that jpeg_read_scanlines wants.  Both will go away when
+   * done with image.
+   */
+  JSAMPROW strip : count(strip_size) = ((void *)0);
+  JSAMPARRAY buffer : count(batch_rows) = ((void *)0);
+  _Unchecked {
+    strip = _Assume_bounds_cast<JSAMPROW>((*cinfo->mem->alloc_large)
+		((_Ptr<struct jpeg_common_struct>) cinfo, JPOOL_IMAGE, strip_size),
+		count(strip_size));
+    buffer = _Assume_bounds_cast<JSAMPARRAY>((*cinfo->mem->alloc_small)
+		((_Ptr<struct jpeg_common_struct>) cinfo, JPOOL_IMAGE,
+		 batch_rows * sizeof(JSAMPROW)),
+		count(batch_rows));
+  }
+  for (JDIMENSION r = 0; r < batch_rows; r++)
+    buffer[r] = strip + (size_t) r * row_stride;
+
+  /* Tell the sink what's coming.  A sink that can't take the image (a PPM
+   * sink given CMYK, say) fails the conversion like any other error.
+   */
+  struct sink_image image = { out_width, end_row - first_row, cinfo->output_components };
+  int sink_ok = 0;
+  STATS_TIME(dec->stats, sink_time, sink_ok = (*sink->begin_image)(sink, &image));
+  if (!sink_ok) {
+    _Unchecked { longjmp(dec->jerr.setjmp_buffer, 1); }
   }
-  printf("%d %d\n255\n", cinfo.output_width, cinfo.output_height);
 
   /* Step 6: while (scan lines remain to be read) */
   /*           jpeg_read_scanlines(...); */
 
 
-  /* Here we use the library's state variable cinfo.output_scanline as the
+  /* Skipped rows are still entropy decoded, but never go through the IDCT,
+   * upsampling or color conversion.
+   */
+  if (first_row > 0)
+    (void) jpeg_skip_scanlines(cinfo, first_row);
+
+  /* Here we use the library's state variable cinfo->output_scanline as the
    * loop counter, so that we don't have to keep track ourselves.
    */
-  while (cinfo.output_scanline < cinfo.output_height) {
+  while (cinfo->output_scanline < end_row) {
     /* jpeg_read_scanlines expects an array of pointers to scanlines.
-     * Here the array is only one element long, but you could ask for
-     * more than one scanline at a time if that's more convenient.
+     * We ask for up to batch_rows scanlines at a time; the library may
+     * return fewer, e.g. at the bottom of the image.
      */
-    (void) jpeg_read_scanlines(&cinfo, buffer, 1);
-    /* Assume put_scanline_someplace wants a pointer and sample count. */
-    JSAMPROW row_unkb : bounds(unknown) = buffer[0];
-    JSAMPROW row : count(row_stride) = 0;
-    _Unchecked {
-      row = _Assume_bounds_cast<JSAMPROW>(row_unkb,  count(row_stride));
+    JDIMENSION num_rows = end_row - cinfo->output_scanline;
+    if (num_rows > batch_rows)
+      num_rows = batch_rows;
+    STATS_TIME(dec->stats, decode_time,
+               num_rows = jpeg_read_scanlines(cinfo, buffer, num_rows));
+    STATS_ADD(dec->stats, rows, num_rows);
+    /* The rows returned are the first num_rows rows of the strip. */
+    if (out_stride != row_stride)
+      crop_strip(_Dynamic_bounds_cast<JSAMPROW>(strip, count(num_rows * row_stride)),
+                 num_rows, row_stride, skip, out_stride);
+    STATS_TIME(dec->stats, sink_time,
+               sink_ok = (*sink->write_rows)(sink, _Dynamic_bounds_cast<JSAMPROW>
+						(strip, count(num_rows * out_stride)),
+                                             num_rows, out_stride));
+    if (!sink_ok) {
+      _Unchecked { longjmp(dec->jerr.setjmp_buffer, 1); }
     }
-    put_scanline_someplace(row, row_stride);
   }
 
+  /* Everything below the crop can be skipped without decoding it at all,
+   * since the library skips straight to the end of the image.
+   */
+  if (cinfo->output_scanline < cinfo->output_height)
+    (void) jpeg_skip_scanlines(cinfo, cinfo->output_height - cinfo->output_scanline);
+
   /* Step 7: Finish decompression */
 
-  (void) jpeg_finish_decompress(&cinfo);
+  (void) jpeg_finish_decompress(cinfo);
   /* We can ignore the return value since suspension is not possible
    * with the stdio data source.
    */
 
   /* Step 8: Release JPEG decompression object */
 
-  /* This is an important step since it will release a good deal of memory. */
-  jpeg_destroy_decompress(&cinfo);
+  /* Nothing to do here: jpeg_finish_decompress released the image's memory,
+   * and the object itself is kept for the next image.  decoder_destroy
+   * releases it at the end of the batch.
+   */
 
   /* After finish_decompress, we can close the input file.
    * Here we postpone it until after no more JPEG errors are possible,
-   * so as to simplify the setjmp error logic above.  (Actually, I don't
-   * think that jpeg_destroy can do an error exit, but why assume anything...)
+   * so as to simplify the setjmp error logic above.
    */
-  fclose(infile);
+  if (infile != NULL)
+    fclose(infile);
+  else if (input == NULL)
+    unmap_file(&map);
 
   /* At this point you may want to check to see whether any corrupt-data
-   * warnings occurred (test whether jerr.pub.num_warnings is nonzero).
+   * warnings occurred (test whether dec->jerr.pub.num_warnings is nonzero).
+   * Instrumented builds report them for every image; see stats.h.
    */
 
-  /* And we're done! */
+  /* And we're done!  The sink may still fail, eg flushing its output. */
+  STATS_TIME(dec->stats, sink_time, sink_ok = (*sink->end_image)(sink, TRUE));
+  return sink_ok;
+}
+
+
+/*
+ * Name of a JPEG color space as the probe prints it.
+ */
+
+LOCAL(_Nt_array_ptr<const char>)
+color_space_name (J_COLOR_SPACE space)
+{
+  switch (space) {
+  case JCS_GRAYSCALE: return "gray";
+  case JCS_RGB: return "rgb";
+  case JCS_YCbCr: return "ycbcr";
+  case JCS_CMYK: return "cmyk";
+  case JCS_YCCK: return "ycck";
+  default: return "unknown";
+  }
+}
+
+/*
+ * The conversions that stop short of decoding pixels: write to out, for
+ * PROBE_INFO, the line
+ *
+ *	name width height components color_space progressive|sequential
+ *
+ * from the header alone, reading nothing past the first SOS marker; or for
+ * COEF_DUMP and DCT_HASH, what coef.h describes, from the entropy-decoded
+ * coefficients, without running the IDCT or color conversion; or for
+ * RAW_YUV, the planes yuv.h describes, which go through the IDCT (scaled
+ * as the options ask) but no further.  Returns 1 on success, 0 on error.
+ * Like read_JPEG_file, this leaves the decompressor ready for the next
+ * image.
+ */
+
+GLOBAL(int)
+inspect_JPEG_file (_Ptr<struct decoder> dec, _Nt_array_ptr<char> filename,
+                   _Ptr<struct writer> out, _Ptr<const struct to_ppm_options> opts)
+{
+  j_decompress_ptr cinfo = &dec->cinfo;
+  _Ptr<FILE> infile = ((void *)0);
+  struct mapped_file map = {};
+  struct kept_markers kept = {};
+  char line _Nt_checked[PATH_MAX + 128];
+
+  /* A probe only touches the first few pages of the file. */
+  if (opts->input == INPUT_MMAP) {
+    if (!map_file(filename, &map,
+                  opts->format == PROBE_INFO ? MADV_RANDOM : MADV_SEQUENTIAL))
+      return 0;
+  } else if ((infile = fopen(filename, "rb")) == NULL) {
+    fprintf(stderr, "can't open %s\n", filename);
+    return 0;
+  }
+
+  int jmp = 0;
+  _Unchecked { jmp = setjmp(dec->jerr.setjmp_buffer); }
+  if (jmp) {
+    decoder_recover(dec);
+    jpeg_abort_decompress(cinfo);
+    if (opts->keep_markers != 0)
+      markers_end(cinfo, &kept);
+    if (infile != NULL)
+      fclose(infile);
+    else
+      unmap_file(&map);
+    return 0;
+  }
+
+  if (infile != NULL)
+    jpeg_stdio_src(cinfo, infile);
+  else
+    jpeg_mem_src(cinfo, map.data, map.size);
+  /* --markers implies --mmap, so the segments can be pointed at in place. */
+  if (opts->keep_markers != 0)
+    markers_begin(cinfo, &kept, opts->keep_markers, map.data, map.size);
+  (void) jpeg_read_header(cinfo, TRUE);
+
+  int ok = 0;
+  if (opts->format == PROBE_INFO) {
+    int len = snprintf(line, sizeof(line), "%s %u %u %d %s %s", filename,
+                       cinfo->image_width, cinfo->image_height, cinfo->num_components,
+                       color_space_name(cinfo->jpeg_color_space),
+                       cinfo->progressive_mode ? "progressive" : "sequential");
+    if (len < 0)
+      len = 0;
+    if ((size_t) len >= sizeof(line))
+      len = sizeof(line) - 1;
+    ok = writer_write(out, _Dynamic_bounds_cast<_Array_ptr<const char>>(line, count(len)),
+                      (size_t) len);
+    /* Then where each kept segment's payload is in the file. */
+    for (int k = 0; k < kept.count; k++) {
+      len = snprintf(line, sizeof(line), " %s:%zu+%zu", marker_kind_name(kept.slices[k].kind),
+                     kept.slices[k].offset, kept.slices[k].length);
+      ok = ok && writer_write(out, _Dynamic_bounds_cast<_Array_ptr<const char>>(line, count(len)),
+                              (size_t) len);
+    }
+    if (kept.dropped > 0) {
+      len = snprintf(line, sizeof(line), " +%d", kept.dropped);
+      ok = ok && writer_write(out, _Dynamic_bounds_cast<_Array_ptr<const char>>(line, count(len)),
+                              (size_t) len);
+    }
+    ok = ok && writer_write(out, "\n", 1);
+  } else if (opts->format == COEF_DUMP) {
+    ok = coef_dump(cinfo, out);
+  } else if (opts->format == RAW_YUV) {
+    if (opts->target_width != 0 || opts->target_height != 0)
+      choose_scale(cinfo, opts->target_width, opts->target_height);
+    cinfo->dct_method = opts->dct_method;
+    /* Luma is the first plane as coded; other color spaces have none. */
+    if (opts->grayscale && cinfo->jpeg_color_space != JCS_YCbCr &&
+        cinfo->jpeg_color_space != JCS_GRAYSCALE)
+      fprintf(stderr, "%s: --gray --yuv needs a YCbCr or grayscale image\n", filename);
+    else
+      ok = yuv_write(cinfo, out, opts->grayscale);
+  } else {
+    ok = coef_hash(cinfo, filename, out);
+  }
+
+  /* We have all we want; for a probe the rest of the file is never read. */
+  jpeg_abort_decompress(cinfo);
+  if (opts->keep_markers != 0)
+    markers_end(cinfo, &kept);
+  if (infile != NULL)
+    fclose(infile);
+  else
+    unmap_file(&map);
+
+  return ok;
+}
+
+
+/*
+ * Decode filename, or stdin if it is "-", as its data arrives, for a pipe
+ * or socket that is slow to deliver.  The decompressor runs in buffered-image
+ * mode: each time it catches up with the input, it writes out a frame of
+ * the scans read so far, and then waits for more.  A progressive image
+ * thus comes out as a series of complete images of increasing quality, the
+ * first of them as soon as its first scan has arrived; the last is the
+ * fully decoded image.  Scans whose data is already there when the one
+ * before them ends get no frame of their own, so a file on disk gives just
+ * the one.
+ * Every frame goes to the sink as an image of its own.  Returns 1 on
+ * success, 0 on error; either way the sink's end_image has been called.
+ */
+
+GLOBAL(int)
+stream_JPEG_file (_Ptr<struct decoder> dec, _Nt_array_ptr<char> filename,
+                  _Ptr<struct output_sink> sink, _Ptr<const struct to_ppm_options> opts)
+{
+  j_decompress_ptr cinfo = &dec->cinfo;
+  int fd = STDIN_FILENO;
+  _Ptr<struct fd_source> src = ((void *)0);
+  /* The decoder is reused after this, so don't leave it pointing at src
+   * once that is freed: the library's own sources look at the old one.
+   */
+  _Ptr<struct jpeg_source_mgr> saved_src = cinfo->src;
+
+  if (strcmp(filename, "-") != 0) {
+    _Unchecked { fd = open((const char *) filename, O_RDONLY); }
+    if (fd < 0) {
+      fprintf(stderr, "can't open %s\n", filename);
+      (void) (*sink->end_image)(sink, FALSE);
+      return 0;
+    }
+  }
+  src = malloc<struct fd_source>(sizeof(struct fd_source));
+  if (src == NULL) {
+    fprintf(stderr, "out of memory\n");
+    if (fd != STDIN_FILENO)
+      close(fd);
+    (void) (*sink->end_image)(sink, FALSE);
+    return 0;
+  }
+
+  int jmp = 0;
+  _Unchecked { jmp = setjmp(dec->jerr.setjmp_buffer); }
+  if (jmp) {
+    decoder_recover(dec);
+    jpeg_abort_decompress(cinfo);
+    cinfo->src = saved_src;
+    free<struct fd_source>(src);
+    if (fd != STDIN_FILENO)
+      close(fd);
+    (void) (*sink->end_image)(sink, FALSE);
+    return 0;
+  }
+
+  fd_source_init(cinfo, src, fd);
+  (void) jpeg_read_header(cinfo, TRUE);
+  if (opts->target_width != 0 || opts->target_height != 0)
+    choose_scale(cinfo, opts->target_width, opts->target_height);
+  cinfo->dct_method = opts->dct_method;
+  cinfo->do_fancy_upsampling = opts->fancy_upsampling;
+  if (opts->grayscale)
+    cinfo->out_color_space = JCS_GRAYSCALE;
+  cinfo->buffered_image = TRUE;
+  (void) jpeg_start_decompress(cinfo);
+
+  size_t row_stride = (size_t) cinfo->output_width * cinfo->output_components;
+  JDIMENSION batch_rows = choose_batch_rows(cinfo, opts, cinfo->output_height);
+  size_t strip_size = row_stride * batch_rows;
+  JSAMPROW strip : count(strip_size) = ((void *)0);
+  JSAMPARRAY buffer : count(batch_rows) = ((void *)0);
+  _Unchecked {
+    strip = _Assume_bounds_cast<JSAMPROW>((*cinfo->mem->alloc_large)
+		((_Ptr<struct jpeg_common_struct>) cinfo, JPOOL_IMAGE, strip_size),
+		count(strip_size));
+    buffer = _Assume_bounds_cast<JSAMPARRAY>((*cinfo->mem->alloc_small)
+		((_Ptr<struct jpeg_common_struct>) cinfo, JPOOL_IMAGE,
+		 batch_rows * sizeof(JSAMPROW)),
+		count(batch_rows));
+  }
+  for (JDIMENSION r = 0; r < batch_rows; r++)
+    buffer[r] = strip + (size_t) r * row_stride;
+
+  int last_scan = 0;		/* the scan the last frame showed */
+  for (;;) {
+    /* Read on to the end of a scan, and on past it while more data is
+     * already waiting; a file on disk is thus read to its end here.
+     */
+    int ret;
+    do {
+      ret = jpeg_consume_input(cinfo);
+    } while (ret != JPEG_REACHED_EOI &&
+             !(ret == JPEG_SCAN_COMPLETED && !fd_source_ready(src)));
+    /* The last frame may already have all the scans. */
+    if (ret == JPEG_REACHED_EOI && cinfo->input_scan_number == last_scan)
+      break;
+    last_scan = cinfo->input_scan_number;
+
+    (void) jpeg_start_output(cinfo, last_scan);
+    struct sink_image image = { cinfo->output_width, cinfo->output_height,
+                                cinfo->output_components };
+    if (!(*sink->begin_image)(sink, &image)) {
+      _Unchecked { longjmp(dec->jerr.setjmp_buffer, 1); }
+    }
+    while (cinfo->output_scanline < cinfo->output_height) {
+      JDIMENSION num_rows = jpeg_read_scanlines(cinfo, buffer, batch_rows);
+      if (!(*sink->write_rows)(sink, _Dynamic_bounds_cast<JSAMPROW>(strip, count(num_rows * row_stride)),
+                               num_rows, row_stride)) {
+        _Unchecked { longjmp(dec->jerr.setjmp_buffer, 1); }
+      }
+    }
+    (void) jpeg_finish_output(cinfo);
+    /* The frame's end flushes it, so it can be shown straight away. */
+    if (!(*sink->end_image)(sink, TRUE)) {
+      _Unchecked { longjmp(dec->jerr.setjmp_buffer, 1); }
+    }
+    if (ret == JPEG_REACHED_EOI)
+      break;
+  }
+
+  (void) jpeg_finish_decompress(cinfo);
+  cinfo->src = saved_src;
+  free<struct fd_source>(src);
+  if (fd != STDIN_FILENO)
+    close(fd);
   return 1;
 }
 
 
+/*
+ * A batch of conversions, shared read-only by all the workers.
+ */
+
+struct batch {
+  _Ptr<const struct input_list> inputs;
+  _Ptr<const struct to_ppm_options> opts;
+  _Nt_array_ptr<const char> output_template;	/* or NULL for stdout */
+  /* All the workers, for splitting one image among them. */
+  _Array_ptr<_Ptr<struct pool_worker>> workers : count(num_workers);
+  int num_workers;
+  /* Reads the inputs ahead of the workers, or NULL (see prefetch.h). */
+  _Ptr<struct prefetcher> prefetch;
+};
+
+struct strip_batch;
+
+/*
+ * Each worker thread owns a decompressor, and with it an error manager and
+ * setjmp buffer, so my_error_exit never longjmps into another thread.  It
+ * also owns the writer that every image it converts is written through.
+ */
+
+struct pool_worker {
+  struct decoder dec;
+  _Ptr<struct writer> writer;
+  _Ptr<struct pipeline> pipeline;	/* formats the output, or NULL */
+  _Ptr<const struct batch> batch;
+  _Ptr<const struct strip_batch> strips;	/* the image being split, if any */
+};
+
+/*
+ * Splitting one image across the workers.  A sequential JPEG with restart
+ * markers is cut into horizontal strips at restart intervals (see
+ * restart.h), every strip is decoded by its own worker's decompressor
+ * straight into a buffer holding the whole output image, and the buffer
+ * then goes to the sink in order.
+ *
+ * The strips must come out exactly as a whole-image decode would.  Fancy
+ * upsampling of vertically subsampled chroma looks one row beyond each edge
+ * of the image, so each strip is decoded as part of a taller image: it
+ * starts at the previous usable interval boundary and goes one MCU row past
+ * its own end.  The rows above the strip are skipped and the ones below it
+ * are never read.
+ */
+
+struct strip_job {
+  JDIMENSION first_row;		/* MCU row this strip's decode starts at */
+  JDIMENSION start_row, end_row;	/* MCU rows of the image it writes */
+};
+
+struct strip_batch {
+  _Ptr<const struct to_ppm_options> opts;
+  _Ptr<const struct mapped_file> map;
+  _Ptr<const struct restart_index> index;
+  _Array_ptr<const struct strip_job> jobs : count(num_strips);
+  int num_strips;
+  JDIMENSION mcu_height;	/* image rows per MCU row */
+  JDIMENSION mcus_per_row;
+  JDIMENSION mcu_rows;		/* in the whole image */
+  unsigned int restart_interval;	/* MCUs */
+  JDIMENSION image_height;
+  unsigned int scale_num, scale_denom;
+  JDIMENSION rows_per_mcu_row;	/* output scanlines per MCU row */
+  JDIMENSION output_width, output_height;
+  size_t row_stride;
+  _Array_ptr<JSAMPLE> image : count(image_size);
+  size_t image_size;
+};
+
+/*
+ * Decode the job'th strip of worker->strips into its part of the image.
+ * Returns 1 on success, 0 on error.
+ */
+
+METHODDEF(int)
+strip_job (_Ptr<struct pool_worker> worker, int job)
+{
+  _Ptr<const struct strip_batch> sb = worker->strips;
+  j_decompress_ptr cinfo = &worker->dec.cinfo;
+  struct strip_job strip = sb->jobs[job];
+  struct strip_source src = {};
+  _Ptr<struct jpeg_source_mgr> saved_src = cinfo->src;
+
+  int jmp = 0;
+  _Unchecked { jmp = setjmp(worker->dec.jerr.setjmp_buffer); }
+  if (jmp) {
+    decoder_recover(&worker->dec);
+    jpeg_abort_decompress(cinfo);
+    cinfo->src = saved_src;
+    strip_source_free(&src);
+    return 0;
+  }
+
+  /* The image this strip's decoder sees. */
+  JDIMENSION top = strip.first_row * sb->mcu_height;
+  JDIMENSION bottom = strip.end_row < sb->mcu_rows ?
+                      (strip.end_row + 1) * sb->mcu_height : sb->image_height;
+  if (bottom > sb->image_height)
+    bottom = sb->image_height;
+  size_t interval = (size_t) strip.first_row * sb->mcus_per_row / sb->restart_interval;
+  if (!strip_source_init(cinfo, &src, sb->index, sb->map->data, sb->map->size,
+                         interval, bottom - top)) {
+    cinfo->src = saved_src;
+    return 0;
+  }
+
+  (void) jpeg_read_header(cinfo, TRUE);
+  cinfo->scale_num = sb->scale_num, cinfo->scale_denom = sb->scale_denom;
+  cinfo->dct_method = sb->opts->dct_method;
+  cinfo->do_fancy_upsampling = sb->opts->fancy_upsampling;
+  if (sb->opts->grayscale)
+    cinfo->out_color_space = JCS_GRAYSCALE;
+  (void) jpeg_start_decompress(cinfo);
+  if (cinfo->output_width != sb->output_width) {
+    _Unchecked { longjmp(worker->dec.jerr.setjmp_buffer, 1); }
+  }
+
+  JDIMENSION skip = (strip.start_row - strip.first_row) * sb->rows_per_mcu_row;
+  JDIMENSION out_start = strip.start_row * sb->rows_per_mcu_row;
+  JDIMENSION out_end = strip.end_row * sb->rows_per_mcu_row;
+  if (out_end > sb->output_height)
+    out_end = sb->output_height;
+  if (skip > 0)
+    (void) jpeg_skip_scanlines(cinfo, skip);
+
+  /* The library decodes straight into the image buffer. */
+  JDIMENSION batch_rows = cinfo->rec_outbuf_height;
+  JSAMPARRAY rows : count(batch_rows) = ((void *)0);
+  _Unchecked {
+    rows = _Assume_bounds_cast<JSAMPARRAY>((*cinfo->mem->alloc_small)
+		((_Ptr<struct jpeg_common_struct>) cinfo, JPOOL_IMAGE,
+		 batch_rows * sizeof(JSAMPROW)),
+		count(batch_rows));
+  }
+  while (cinfo->output_scanline < skip + (out_end - out_start)) {
+    JDIMENSION y = out_start + (cinfo->output_scanline - skip);
+    JDIMENSION num_rows = out_end - y;
+    if (num_rows > batch_rows)
+      num_rows = batch_rows;
+    for (JDIMENSION r = 0; r < num_rows; r++)
+      rows[r] = sb->image + (y + r) * sb->row_stride;
+    (void) jpeg_read_scanlines(cinfo, rows, num_rows);
+  }
+
+  /* The rest of the strip's image is of no interest. */
+  jpeg_abort_decompress(cinfo);
+  cinfo->src = saved_src;
+  strip_source_free(&src);
+  return 1;
+}
+
+/*
+ * Work out how to split the image whose header cinfo has just read, with
+ * the decompression parameters set.  Fills in sb apart from the image
+ * buffer.  Returns the number of strips, or 0 if the image can't be split
+ * usefully.
+ */
+
+LOCAL(int)
+plan_strips (j_decompress_ptr cinfo, _Ptr<const struct restart_index> index,
+             _Ptr<struct strip_batch> sb,
+             _Array_ptr<struct strip_job> jobs : count(max_strips), int max_strips)
+{
+  if (cinfo->restart_interval == 0 || cinfo->progressive_mode)
+    return 0;
+  if (cinfo->num_components == 1) {
+    if (cinfo->max_h_samp_factor != 1 || cinfo->max_v_samp_factor != 1)
+      return 0;
+  } else if (cinfo->comps_in_scan != cinfo->num_components) {
+    return 0;
+  }
+
+  JDIMENSION mcu_width = cinfo->max_h_samp_factor * DCTSIZE;
+  sb->mcu_height = cinfo->max_v_samp_factor * DCTSIZE;
+  sb->mcus_per_row = (cinfo->image_width + mcu_width - 1) / mcu_width;
+  sb->mcu_rows = (cinfo->image_height + sb->mcu_height - 1) / sb->mcu_height;
+  sb->restart_interval = cinfo->restart_interval;
+  sb->image_height = cinfo->image_height;
+  sb->scale_num = cinfo->scale_num, sb->scale_denom = cinfo->scale_denom;
+  sb->rows_per_mcu_row = imcu_output_rows(cinfo);
+  sb->output_width = cinfo->output_width, sb->output_height = cinfo->output_height;
+  sb->row_stride = (size_t) cinfo->output_width * cinfo->output_components;
+
+  /* Does some strip but the first need the row above it decoded? */
+  boolean context = FALSE;
+  if (cinfo->do_fancy_upsampling) {
+    for (int c = 0; c < cinfo->num_components; c++) {
+      if (cinfo->comp_info[c].v_samp_factor < cinfo->max_v_samp_factor)
+        context = TRUE;
+    }
+  }
+
+  /* Pick boundaries near equal divisions of the image among the strips,
+   * from the MCU rows that start an interval numbered 0 modulo 8.  All
+   * rows are counted in MCU rows here.
+   */
+  int num_strips = 1;
+  JDIMENSION last_boundary = 0;	/* the last usable one seen */
+  jobs[0].first_row = jobs[0].start_row = 0;
+  for (JDIMENSION r = 1; r < sb->mcu_rows && num_strips < max_strips; r++) {
+    size_t mcus = (size_t) r * sb->mcus_per_row;
+    if (mcus % sb->restart_interval != 0)
+      continue;
+    size_t interval = mcus / sb->restart_interval;
+    if (interval % 8 != 0 || interval >= index->num_intervals)
+      continue;
+    JDIMENSION target = (JDIMENSION) ((size_t) sb->mcu_rows * num_strips / max_strips);
+    if (r >= target) {
+      jobs[num_strips - 1].end_row = r;
+      jobs[num_strips].start_row = r;
+      jobs[num_strips].first_row = context ? last_boundary : r;
+      num_strips++;
+    }
+    last_boundary = r;
+  }
+  jobs[num_strips - 1].end_row = sb->mcu_rows;
+  return num_strips > 1 ? num_strips : 0;
+}
+
+/*
+ * Convert one image using all of the batch's workers, if it has restart
+ * markers that let it be split.  Otherwise, and for a single worker, this
+ * is just read_JPEG_file on the first worker's decoder.  Returns 1 on
+ * success, 0 on error; either way the sink's end_image has been called.
+ */
+
+LOCAL(int)
+read_JPEG_strips (_Ptr<const struct batch> batch, _Nt_array_ptr<char> filename,
+                  _Ptr<struct output_sink> sink)
+{
+  _Ptr<struct pool_worker> first = batch->workers[0];
+  j_decompress_ptr cinfo = &first->dec.cinfo;
+  _Ptr<const struct to_ppm_options> opts = batch->opts;
+  int max_strips = 2 * batch->num_workers;
+  struct mapped_file map = {};
+  struct restart_index index = {};
+  struct strip_batch sb = {};
+  int num_strips = 0;
+
+  if (batch->num_workers < 2 || opts->crop)
+    return read_JPEG_file(&first->dec, filename, sink, opts, ((void *)0));
+  /* Strips read the file in pieces, but each piece front to back. */
+  if (!map_file(filename, &map, MADV_SEQUENTIAL)) {
+    (void) (*sink->end_image)(sink, FALSE);
+    return 0;
+  }
+  _Array_ptr<struct strip_job> jobs : count(max_strips) =
+    calloc<struct strip_job>(max_strips, sizeof(struct strip_job));
+
+  int jmp = 0;
+  _Unchecked { jmp = setjmp(first->dec.jerr.setjmp_buffer); }
+  if (jmp) {
+    decoder_recover(&first->dec);
+    jpeg_abort_decompress(cinfo);
+    restart_index_free(&index);
+    free<struct strip_job>(jobs);
+    unmap_file(&map);
+    (void) (*sink->end_image)(sink, FALSE);
+    return 0;
+  }
+  if (jobs != NULL && restart_index_build(&index, map.data, map.size)) {
+    /* Read the header of the whole image to see if it can be split. */
+    jpeg_mem_src(cinfo, map.data, map.size);
+    (void) jpeg_read_header(cinfo, TRUE);
+    if (opts->target_width != 0 || opts->target_height != 0)
+      choose_scale(cinfo, opts->target_width, opts->target_height);
+    cinfo->dct_method = opts->dct_method;
+    cinfo->do_fancy_upsampling = opts->fancy_upsampling;
+    if (opts->grayscale)
+      cinfo->out_color_space = JCS_GRAYSCALE;
+    jpeg_calc_output_dimensions(cinfo);
+    num_strips = plan_strips(cinfo, &index, &sb, jobs, max_strips);
+    jpeg_abort_decompress(cinfo);
+  }
+
+  size_t image_size = sb.row_stride * sb.output_height;
+  _Array_ptr<JSAMPLE> image : count(image_size) = ((void *)0);
+  if (num_strips > 0)
+    image = malloc<JSAMPLE>(image_size);
+  if (image == NULL) {
+    /* Not splittable after all: decode it the ordinary way. */
+    restart_index_free(&index);
+    free<struct strip_job>(jobs);
+    unmap_file(&map);
+    return read_JPEG_file(&first->dec, filename, sink, opts, ((void *)0));
+  }
+
+  sb.opts = opts, sb.map = &map, sb.index = &index;
+  sb.jobs = jobs, sb.num_strips = num_strips;
+  sb.image = image, sb.image_size = image_size;
+  for (int w = 0; w < batch->num_workers; w++)
+    batch->workers[w]->strips = &sb;
+  int failures = pool_run(num_strips, batch->workers, batch->num_workers, strip_job);
+
+  int ok = failures == 0;
+  if (ok) {
+    struct sink_image info = { sb.output_width, sb.output_height, cinfo->output_components };
+    ok = (*sink->begin_image)(sink, &info) &&
+         (*sink->write_rows)(sink, image, sb.output_height, sb.row_stride);
+  }
+  ok = (*sink->end_image)(sink, ok) && ok;
+
+  free<JSAMPLE>(image);
+  restart_index_free(&index);
+  free<struct strip_job>(jobs);
+  unmap_file(&map);
+  return ok;
+}
+
+/*
+ * Set up the sink for a pixel output format in fs or ns, whichever it
+ * needs, writing through out.  Returns NULL for the formats that don't
+ * decode to pixels.
+ */
+
+LOCAL(_Ptr<struct output_sink>)
+choose_sink (enum output_format format, _Ptr<struct file_sink> fs,
+             _Ptr<struct null_sink> ns, _Ptr<struct writer> out)
+{
+  switch (format) {
+  case PPM_ASCII:
+    return sink_ascii_ppm(fs, out);
+  case PPM_BINARY:
+    return sink_binary_ppm(fs, out);
+  case RAW_PLANAR:
+    return sink_raw_planar(fs, out);
+  case FRAMED:
+    return sink_framed(fs, out);
+  case NULL_OUTPUT:
+    return sink_null(ns);
+  default:
+    return ((void *)0);
+  }
+}
+
+
+/*
+ * The cache key for converting map with opts: the JPEG's bytes, and every
+ * option that changes the output.  The library version goes in too, as
+ * the fast IDCTs needn't give the same samples from one version to the
+ * next.
+ */
+
+LOCAL(unsigned long long)
+cache_key (_Ptr<const struct mapped_file> map, _Ptr<const struct to_ppm_options> opts)
+{
+  unsigned long long params _Checked[14] = {
+    JPEG_LIB_VERSION, opts->format, opts->target_width, opts->target_height,
+    opts->dct_method, opts->fancy_upsampling, opts->grayscale, opts->crop,
+    opts->crop ? opts->crop_x : 0, opts->crop ? opts->crop_y : 0,
+    opts->crop ? opts->crop_width : 0, opts->crop ? opts->crop_height : 0,
+    opts->resize_width, opts->resize_height
+  };
+  _Array_ptr<const JOCTET> bytes : count(sizeof(params)) = ((void *)0);
+
+  _Unchecked {
+    bytes = _Assume_bounds_cast<_Array_ptr<const JOCTET>>(params, count(sizeof(params)));
+  }
+  return cache_hash(bytes, sizeof(params), cache_hash(map->data, map->size, 0));
+}
+
+/*
+ * Copy the rest of the file open on fd to out, reading straight into the
+ * writer's buffer, and flush.  Returns 1 on success, 0 on error.
+ */
+
+LOCAL(int)
+copy_to_writer (int fd, _Ptr<struct writer> out)
+{
+  size_t room = writer_buffer_size(out);
+  int ok = 1;
+
+  for (;;) {
+    _Array_ptr<char> space : count(room) = writer_reserve(out, room);
+    ssize_t n = read(fd, space, room);
+    if (n <= 0) {
+      writer_commit(out, 0);
+      ok = n == 0;
+      break;
+    }
+    writer_commit(out, n);
+  }
+  return writer_flush(out) && ok;
+}
+
+/*
+ * Convert the job'th input through the cache (see cache.h).  On a hit the
+ * stored output is copied to worker's writer without decoding anything.
+ * On a miss the image is decoded as usual, but into a new cache entry,
+ * which then goes to the writer.  Returns 1 on success, 0 on error.
+ */
+
+LOCAL(int)
+cached_convert (_Ptr<struct pool_worker> worker, _Nt_array_ptr<char> file,
+                _Ptr<struct output_sink> sink, int fd)
+{
+  _Ptr<const struct batch> batch = worker->batch;
+  _Ptr<const struct to_ppm_options> opts = batch->opts;
+  struct mapped_file map = {};
+  char path _Nt_checked[CACHE_DIR_MAX + 16];
+
+  /* Hashing reads the whole file, which leaves it in the page cache for
+   * the decode on a miss.
+   */
+  if (!map_file(file, &map, MADV_SEQUENTIAL))
+    return 0;
+  unsigned long long key = cache_key(&map, opts);
+  unmap_file(&map);
+
+  int entry = cache_lookup(opts->cache_dir, key);
+  if (entry >= 0) {
+    int ok = copy_to_writer(entry, worker->writer);
+    close(entry);
+    return ok;
+  }
+
+  if ((entry = cache_create(opts->cache_dir, path, sizeof(path) - 1)) < 0)
+    return 0;
+  writer_attach(worker->writer, entry);
+  int ok = opts->strips ? read_JPEG_strips(batch, file, sink)
+                        : read_JPEG_file(&worker->dec, file, sink, opts, ((void *)0));
+  writer_attach(worker->writer, fd);
+  if (ok)
+    ok = lseek(entry, 0, SEEK_SET) == 0 && copy_to_writer(entry, worker->writer);
+  close(entry);
+  /* Even a good image isn't worth keeping if we couldn't deliver it.  A
+   * failure to keep it is no failure of the conversion.
+   */
+  if (!ok)
+    remove(path);
+  else
+    (void) cache_insert(opts->cache_dir, path, key, opts->cache_budget);
+  return ok;
+}
+
+
+/*
+ * Convert the job'th input of the batch.  Failures are reported here, so the
+ * rest of the batch carries on.  Returns 1 on success, 0 on error.
+ */
+
+METHODDEF(int)
+convert_job (_Ptr<struct pool_worker> worker, int job)
+{
+  _Ptr<const struct batch> batch = worker->batch;
+  _Nt_array_ptr<char> file = batch->inputs->names[job];
+  char path _Nt_checked[PATH_MAX + 1];
+  int fd = STDOUT_FILENO;
+  struct file_sink file_sink = {};
+  struct null_sink null_sink = {};
+  struct resize_sink resize_sink = {};
+  _Ptr<struct output_sink> sink = ((void *)0);
+
+  if (batch->output_template != NULL) {
+    if (!expand_output_template(batch->output_template, file, job, path, PATH_MAX)) {
+      fprintf(stderr, "%s: output file name too long\n", file);
+      return 0;
+    }
+    _Unchecked { fd = open((const char *) path, O_WRONLY | O_CREAT | O_TRUNC, 0666); }
+    if (fd < 0) {
+      fprintf(stderr, "can't create %s\n", path);
+      return 0;
+    }
+  }
+  writer_attach(worker->writer, fd);
+
+#ifdef TO_PPM_STATS
+  struct image_stats stats = {};
+  double started = stats_clock();
+  worker->dec.stats = &stats;
+#endif
+
+  sink = choose_sink(batch->opts->format, &file_sink, &null_sink, worker->writer);
+  /* Resizing goes before the pipeline, so it is done by the converter. */
+  if (sink != NULL && (batch->opts->resize_width != 0 || batch->opts->resize_height != 0))
+    sink = sink_resize(&resize_sink, sink, batch->opts->resize_width,
+                       batch->opts->resize_height);
+  if (sink != NULL && worker->pipeline != NULL)
+    sink = pipeline_sink(worker->pipeline, sink);
+  int ok = 0;
+  if (sink == NULL) {
+    /* Each image goes out in a single flush, so workers sharing stdout for
+     * probes and hashes never split one another's lines.
+     */
+    ok = inspect_JPEG_file(&worker->dec, file, worker->writer, batch->opts) &&
+         writer_flush(worker->writer);
+  } else if (batch->opts->stream) {
+    ok = stream_JPEG_file(&worker->dec, file, sink, batch->opts);
+  } else if (batch->opts->cache_dir != NULL) {
+    ok = cached_convert(worker, file, sink, fd);
+  } else if (batch->opts->strips) {
+    ok = read_JPEG_strips(batch, file, sink);
+  } else if (batch->prefetch != NULL) {
+    struct mapped_file input = {};
+    if (prefetch_get(batch->prefetch, job, &input)) {
+      ok = read_JPEG_file(&worker->dec, file, sink, batch->opts, &input);
+      prefetch_release(batch->prefetch, job);
+    } else {
+      (void) (*sink->end_image)(sink, FALSE);
+    }
+  } else {
+    ok = read_JPEG_file(&worker->dec, file, sink, batch->opts, ((void *)0));
+  }
+
+#ifdef TO_PPM_STATS
+  worker->dec.stats = ((void *)0);
+  stats.total_time = stats_clock() - started;
+  stats.bytes = writer_queued(worker->writer);
+  stats.warnings = worker->dec.jerr.pub.num_warnings;
+  if (worker->dec.arena != NULL)
+    stats.memory = arena_peak(worker->dec.arena);
+  stats_report(file, ok, &stats);
+#endif
+
+  if (fd != STDOUT_FILENO) {
+    if (close(fd) != 0)
+      ok = 0;
+    /* Don't leave truncated images behind. */
+    if (!ok)
+      remove(path);
+  }
+  if (!ok)
+    fprintf(stderr, "%s: conversion failed\n", file);
+  return ok;
+}
+
+
+/*
+ * Decoding many inputs on one thread.  Each input gets its own decompressor
+ * reading from a push source (see pushsrc.h), which suspends the library
+ * instead of waiting when it runs out of data.  The loop polls all the
+ * inputs, hands each whatever has arrived for it, and lets it decode as far
+ * as that goes, so a slow upload holds up nothing but itself.
+ */
+
+/* Output buffer size per input.  Many decodes may be open at once, so
+ * this is smaller than OUTPUT_BUFFER_SIZE.
+ */
+#define EVENT_BUFFER_SIZE (64 << 10)
+
+/* Bytes read from an input each time poll(2) says it is readable. */
+#define EVENT_READ_SIZE 65536
+
+/* Where an incremental decode has got to: the library call to make next. */
+enum step_state {
+  STEP_HEADER,			/* jpeg_read_header */
+  STEP_START,			/* jpeg_start_decompress */
+  STEP_ROWS,			/* jpeg_read_scanlines */
+  STEP_FINISH			/* jpeg_finish_decompress */
+};
+
+enum step_result {
+  STEP_SUSPENDED,		/* needs more data */
+  STEP_DONE,
+  STEP_FAILED
+};
+
+struct incremental {
+  struct decoder dec;
+  struct push_source src;
+  _Ptr<struct writer> writer;
+  struct file_sink file_sink;
+  struct null_sink null_sink;
+  _Ptr<struct output_sink> sink;
+  enum step_state state;
+  int in_fd, out_fd;
+  char path _Nt_checked[PATH_MAX + 1];	/* the output file, if any */
+  /* The strip of scanlines each jpeg_read_scanlines fills. */
+  JSAMPROW strip : count(strip_size);
+  size_t strip_size;
+  JSAMPARRAY buffer : count(batch_rows);
+  JDIMENSION batch_rows;
+  size_t row_stride;
+};
+
+/*
+ * Make what progress the data pushed so far allows.  Every library call
+ * that can suspend is retried from the top on the next step; none of them
+ * has any effect when it suspends.
+ */
+
+LOCAL(enum step_result)
+incremental_step (_Ptr<struct incremental> inc, _Ptr<const struct to_ppm_options> opts)
+{
+  j_decompress_ptr cinfo = &inc->dec.cinfo;
+
+  int jmp = 0;
+  _Unchecked { jmp = setjmp(inc->dec.jerr.setjmp_buffer); }
+  if (jmp) {
+    decoder_recover(&inc->dec);
+    jpeg_abort_decompress(cinfo);
+    (void) (*inc->sink->end_image)(inc->sink, FALSE);
+    return STEP_FAILED;
+  }
+
+  switch (inc->state) {
+  case STEP_HEADER:
+    if (jpeg_read_header(cinfo, TRUE) == JPEG_SUSPENDED)
+      return STEP_SUSPENDED;
+    if (opts->target_width != 0 || opts->target_height != 0)
+      choose_scale(cinfo, opts->target_width, opts->target_height);
+    cinfo->dct_method = opts->dct_method;
+    cinfo->do_fancy_upsampling = opts->fancy_upsampling;
+    if (opts->grayscale)
+      cinfo->out_color_space = JCS_GRAYSCALE;
+    inc->state = STEP_START;
+    /* FALLTHROUGH */
+
+  case STEP_START:
+    /* For a progressive image this suspends until the file is all in. */
+    if (!jpeg_start_decompress(cinfo))
+      return STEP_SUSPENDED;
+    inc->row_stride = (size_t) cinfo->output_width * cinfo->output_components;
+    JDIMENSION batch_rows = choose_batch_rows(cinfo, opts, cinfo->output_height);
+    size_t strip_size = inc->row_stride * batch_rows;
+    _Unchecked {
+      inc->strip = _Assume_bounds_cast<JSAMPROW>((*cinfo->mem->alloc_large)
+		((_Ptr<struct jpeg_common_struct>) cinfo, JPOOL_IMAGE, strip_size),
+		count(strip_size)), inc->strip_size = strip_size;
+      inc->buffer = _Assume_bounds_cast<JSAMPARRAY>((*cinfo->mem->alloc_small)
+		((_Ptr<struct jpeg_common_struct>) cinfo, JPOOL_IMAGE,
+		 batch_rows * sizeof(JSAMPROW)),
+		count(batch_rows)), inc->batch_rows = batch_rows;
+    }
+    for (JDIMENSION r = 0; r < inc->batch_rows; r++)
+      inc->buffer[r] = inc->strip + (size_t) r * inc->row_stride;
+    struct sink_image image = { cinfo->output_width, cinfo->output_height,
+                                cinfo->output_components };
+    if (!(*inc->sink->begin_image)(inc->sink, &image)) {
+      _Unchecked { longjmp(inc->dec.jerr.setjmp_buffer, 1); }
+    }
+    inc->state = STEP_ROWS;
+    /* FALLTHROUGH */
+
+  case STEP_ROWS:
+    while (cinfo->output_scanline < cinfo->output_height) {
+      JDIMENSION num_rows = jpeg_read_scanlines(cinfo, inc->buffer, inc->batch_rows);
+      if (num_rows == 0)
+        return STEP_SUSPENDED;
+      if (!(*inc->sink->write_rows)(inc->sink,
+                                    _Dynamic_bounds_cast<JSAMPROW>(inc->strip,
+                                                                   count(num_rows * inc->row_stride)),
+                                    num_rows, inc->row_stride)) {
+        _Unchecked { longjmp(inc->dec.jerr.setjmp_buffer, 1); }
+      }
+    }
+    inc->state = STEP_FINISH;
+    /* FALLTHROUGH */
+
+  case STEP_FINISH:
+    if (!jpeg_finish_decompress(cinfo))
+      return STEP_SUSPENDED;
+    break;
+  }
+  return (*inc->sink->end_image)(inc->sink, TRUE) ? STEP_DONE : STEP_FAILED;
+}
+
+/*
+ * Set up the job'th input of the batch for decoding.  Returns 1 on success,
+ * 0 on error, after printing a message and releasing whatever was set up.
+ */
+
+LOCAL(int)
+incremental_open (_Ptr<struct incremental> inc, _Ptr<const struct batch> batch, int job)
+{
+  _Nt_array_ptr<char> file = batch->inputs->names[job];
+
+  inc->in_fd = STDIN_FILENO, inc->out_fd = STDOUT_FILENO;
+  /* A FIFO opened without O_NONBLOCK would wait here for its writer.
+   * Reads only follow poll(2), so stdin is left as it is.
+   */
+  if (strcmp(file, "-") != 0) {
+    _Unchecked { inc->in_fd = open((const char *) file, O_RDONLY | O_NONBLOCK); }
+    if (inc->in_fd < 0) {
+      fprintf(stderr, "can't open %s\n", file);
+      return 0;
+    }
+  }
+  if (batch->output_template != NULL) {
+    if (!expand_output_template(batch->output_template, file, job, inc->path, PATH_MAX)) {
+      fprintf(stderr, "%s: output file name too long\n", file);
+      inc->out_fd = -1;
+    } else {
+      _Unchecked { inc->out_fd = open((const char *) inc->path, O_WRONLY | O_CREAT | O_TRUNC, 0666); }
+      if (inc->out_fd < 0)
+        fprintf(stderr, "can't create %s\n", inc->path);
+    }
+  }
+  if (inc->out_fd >= 0 && decoder_init(&inc->dec)) {
+    inc->writer = writer_create(EVENT_BUFFER_SIZE, 0);
+    if (inc->writer != NULL) {
+      writer_attach(inc->writer, inc->out_fd);
+      inc->sink = choose_sink(batch->opts->format, &inc->file_sink, &inc->null_sink,
+                              inc->writer);
+      push_source_init(&inc->dec.cinfo, &inc->src);
+      inc->state = STEP_HEADER;
+      return 1;
+    }
+    fprintf(stderr, "out of memory\n");
+    decoder_destroy(&inc->dec);
+  }
+  if (inc->out_fd > STDOUT_FILENO) {
+    close(inc->out_fd);
+    remove(inc->path);
+  }
+  if (inc->in_fd != STDIN_FILENO)
+    close(inc->in_fd);
+  return 0;
+}
+
+/* Release an input's decode.  Returns ok, or 0 if closing the output fails. */
+
+LOCAL(int)
+incremental_close (_Ptr<struct incremental> inc, _Nt_array_ptr<char> file, int ok)
+{
+  push_source_free(&inc->src);
+  decoder_destroy(&inc->dec);
+  writer_destroy(inc->writer);
+  if (inc->in_fd != STDIN_FILENO)
+    close(inc->in_fd);
+  if (inc->out_fd != STDOUT_FILENO) {
+    if (close(inc->out_fd) != 0)
+      ok = 0;
+    if (!ok)
+      remove(inc->path);
+  }
+  if (!ok)
+    fprintf(stderr, "%s: conversion failed\n", file);
+  return ok;
+}
+
+/*
+ * Convert every input of the batch at once on this thread.  Returns the
+ * number of conversions that failed.
+ */
+
+LOCAL(int)
+run_event_loop (_Ptr<const struct batch> batch)
+{
+  int n = batch->inputs->count;
+  _Array_ptr<struct incremental> incs : count(n) =
+    calloc<struct incremental>(n, sizeof(struct incremental));
+  _Array_ptr<struct pollfd> fds : count(n) = calloc<struct pollfd>(n, sizeof(struct pollfd));
+  _Array_ptr<int> polled : count(n) = calloc<int>(n, sizeof(int));
+  JOCTET chunk _Checked[EVENT_READ_SIZE];
+  int failures = 0, active = 0;
+
+  if (incs == NULL || fds == NULL || polled == NULL) {
+    fprintf(stderr, "out of memory\n");
+    free<struct incremental>(incs);
+    free<struct pollfd>(fds);
+    free<int>(polled);
+    return n;
+  }
+  for (int i = 0; i < n; i++) {
+    if (incremental_open(&incs[i], batch, i)) {
+      active++;
+    } else {
+      incs[i].in_fd = -1;
+      failures++;
+    }
+  }
+
+  while (active > 0) {
+    /* Wait for any of the inputs still being decoded. */
+    int k = 0;
+    for (int i = 0; i < n; i++) {
+      if (incs[i].in_fd < 0)
+        continue;
+      fds[k].fd = incs[i].in_fd, fds[k].events = POLLIN, fds[k].revents = 0;
+      polled[k++] = i;
+    }
+    int ready = -1;
+    _Unchecked { ready = poll((struct pollfd *) fds, (nfds_t) k, -1); }
+    if (ready < 0) {
+      if (errno == EINTR)
+        continue;
+      fprintf(stderr, "poll failed\n");
+      break;
+    }
+
+    for (int j = 0; j < k; j++) {
+      if (fds[j].revents == 0)
+        continue;
+      _Ptr<struct incremental> inc = &incs[polled[j]];
+      ssize_t got = -1;
+      _Unchecked { got = read(inc->in_fd, (void *) chunk, sizeof(chunk)); }
+      if (got < 0 && (errno == EAGAIN || errno == EINTR))
+        continue;
+      if (got > 0) {
+        if (!push_source_write(&inc->src, chunk, (size_t) got)) {
+          fprintf(stderr, "out of memory\n");
+          push_source_close(&inc->src);
+        }
+      } else {
+        /* The end of the data, or a read error, which truncates it. */
+        push_source_close(&inc->src);
+      }
+      enum step_result result = incremental_step(inc, batch->opts);
+      if (result == STEP_SUSPENDED)
+        continue;
+      if (!incremental_close(inc, batch->inputs->names[polled[j]], result == STEP_DONE))
+        failures++;
+      inc->in_fd = -1;
+      active--;
+    }
+  }
+
+  /* Only left over if poll failed. */
+  for (int i = 0; i < n; i++) {
+    if (incs[i].in_fd >= 0) {
+      (void) (*incs[i].sink->end_image)(incs[i].sink, FALSE);
+      (void) incremental_close(&incs[i], batch->inputs->names[i], 0);
+      failures++;
+    }
+  }
+  free<int>(polled);
+  free<struct pollfd>(fds);
+  free<struct incremental>(incs);
+  return failures;
+}
+
+
+void usage(void) {
+  fprintf(stderr, "usage: to_ppm [options] file.jpg...\n");
+  fprintf(stderr, "  --binary, -b   write raw P5/P6 instead of ASCII P2/P3 (P7 PAM for CMYK)\n");
+  fprintf(stderr, "  --planar       write headerless raw samples, one plane per component\n");
+  fprintf(stderr, "  --framed       write a stream of images, each a fixed binary header (size,\n");
+  fprintf(stderr, "                 components, format) and its samples; see sink.h\n");
+  fprintf(stderr, "  --null         decode but write nothing, for timing\n");
+  fprintf(stderr, "  --probe        print each image's size, components, color space and\n");
+  fprintf(stderr, "                 progressive or sequential coding, without decoding it\n");
+  fprintf(stderr, "  --markers LIST with --probe, also give the offset and length in the file\n");
+  fprintf(stderr, "                 of each APPn or COM segment in LIST, from exif, xmp, icc,\n");
+  fprintf(stderr, "                 com and app1 to app15 (not app14); implies --mmap\n");
+  fprintf(stderr, "  --coefs        dump the quantization tables and DCT coefficients\n");
+  fprintf(stderr, "  --dct-hash     print a 64-bit perceptual hash of each image's DC terms\n");
+  fprintf(stderr, "  --yuv          write the components as coded, headerless, one plane each\n");
+  fprintf(stderr, "                 at its own resolution (I420 for YCbCr 4:2:0)\n");
+  fprintf(stderr, "  --mmap         map the input and decode it in place\n");
+  fprintf(stderr, "  --rows N       decode N scanlines per call (default: %d iMCU rows)\n",
+          DEFAULT_BATCH_IMCU_ROWS);
+  fprintf(stderr, "  --size WxH     scale down in the IDCT to the smallest M/8 size that is\n");
+  fprintf(stderr, "                 still at least WxH (0 leaves a side unconstrained)\n");
+  fprintf(stderr, "  --resize WxH   resample each image to exactly WxH (0 for a side keeps the\n");
+  fprintf(stderr, "                 aspect ratio), decoding at the nearest larger M/8 size\n");
+  fprintf(stderr, "  --dct METHOD   IDCT to use: islow (default), ifast or float\n");
+  fprintf(stderr, "  --nofancy      use fast, blockier chroma upsampling\n");
+  fprintf(stderr, "  --gray         decode the luma only, and write PGM (P2/P5), or with --yuv\n");
+  fprintf(stderr, "                 the Y plane alone; CMYK and YCCK images can't be converted\n");
+  fprintf(stderr, "  --crop X,Y,W,H write only this region of the (scaled) image;\n");
+  fprintf(stderr, "                 a 0 width or height extends to the edge\n");
+  fprintf(stderr, "  --files-from F read more input names from F, one per line (- for stdin)\n");
+  fprintf(stderr, "  -o TEMPLATE    write each image to its own file instead of stdout;\n");
+  fprintf(stderr, "                 %%b is the input name without extension, %%n its index\n");
+  fprintf(stderr, "  --jobs N, -j N convert N files at a time (0: one per CPU); needs -o\n");
+  fprintf(stderr, "                 unless probing or hashing\n");
+  fprintf(stderr, "  --write-thread write output on a separate thread, overlapping decoding\n");
+  fprintf(stderr, "  --pipeline     also format the output on a thread of its own, so that\n");
+  fprintf(stderr, "                 decoding, formatting and writing all overlap\n");
+  fprintf(stderr, "  --prefetch K   read up to K inputs ahead of each worker with io_uring, for\n");
+  fprintf(stderr, "                 slow storage (ignored where io_uring isn't available)\n");
+  fprintf(stderr, "  --strips       decode each image with restart markers in strips on\n");
+  fprintf(stderr, "                 all the --jobs threads, one image at a time; implies --mmap\n");
+  fprintf(stderr, "  --stream       decode as the data arrives (- reads stdin), writing a\n");
+  fprintf(stderr, "                 frame each time more scans of a progressive image are in\n");
+  fprintf(stderr, "  --event-loop   decode all the inputs at once on one thread, each as its\n");
+  fprintf(stderr, "                 data arrives (for pipes and sockets; - reads stdin)\n");
+  fprintf(stderr, "  --cache DIR    keep converted images in DIR, keyed by a hash of the input\n");
+  fprintf(stderr, "                 and the options, and copy repeats from there\n");
+  fprintf(stderr, "  --cache-size M drop the least recently used images to keep DIR under\n");
+  fprintf(stderr, "                 M megabytes (default: %d)\n", DEFAULT_CACHE_MB);
+#ifdef TO_PPM_STATS
+  fprintf(stderr, "  --stats FILE   write each image's timings and counters to FILE, a line\n");
+  fprintf(stderr, "                 of JSON per image, instead of to stderr\n");
+#endif
+}
+
+
 int main(int argc, _Array_ptr<_Nt_array_ptr<char>> argv : count(argc)) {
-  _Nt_array_ptr<char> file = argv[1];
-  return read_JPEG_file(file);
+  struct to_ppm_options opts = {
+    .format = PPM_ASCII,
+    .input = INPUT_STDIO,
+    .batch_rows = 0,
+    .target_width = 0, .target_height = 0,
+    .dct_method = JDCT_DEFAULT,
+    .fancy_upsampling = TRUE,
+    .grayscale = FALSE,
+    .crop = FALSE,
+    .strips = FALSE,
+    .stream = FALSE,
+    .cache_dir = ((void *)0),
+    .cache_budget = (unsigned long long) DEFAULT_CACHE_MB << 20,
+    .keep_markers = 0,
+    .resize_width = 0, .resize_height = 0
+  };
+  struct input_list inputs = {};
+  _Nt_array_ptr<char> files_from = ((void *)0);
+  _Nt_array_ptr<char> output_template = ((void *)0);
+  int num_jobs = 1;
+  int write_thread = 0;
+  int pipeline = 0;
+  int prefetch_depth = 0;
+  int event_loop = 0;
+
+  for (int i = 1; i < argc; i++) {
+    _Nt_array_ptr<char> arg = argv[i];
+    if (strcmp(arg, "--binary") == 0 || strcmp(arg, "-b") == 0) {
+      opts.format = PPM_BINARY;
+    } else if (strcmp(arg, "--planar") == 0) {
+      opts.format = RAW_PLANAR;
+    } else if (strcmp(arg, "--framed") == 0) {
+      opts.format = FRAMED;
+    } else if (strcmp(arg, "--null") == 0) {
+      opts.format = NULL_OUTPUT;
+    } else if (strcmp(arg, "--probe") == 0) {
+      opts.format = PROBE_INFO;
+    } else if (strcmp(arg, "--markers") == 0 && i + 1 < argc) {
+      if (!markers_parse(argv[++i], &opts.keep_markers)) {
+        usage();
+        return EXIT_FAILURE;
+      }
+      opts.input = INPUT_MMAP;
+    } else if (strcmp(arg, "--coefs") == 0) {
+      opts.format = COEF_DUMP;
+    } else if (strcmp(arg, "--dct-hash") == 0) {
+      opts.format = DCT_HASH;
+    } else if (strcmp(arg, "--yuv") == 0) {
+      opts.format = RAW_YUV;
+    } else if (strcmp(arg, "--mmap") == 0) {
+      opts.input = INPUT_MMAP;
+    } else if (strcmp(arg, "--rows") == 0 && i + 1 < argc) {
+      int rows = atoi(argv[++i]);
+      if (rows <= 0) {
+        usage();
+        return EXIT_FAILURE;
+      }
+      opts.batch_rows = rows;
+    } else if (strcmp(arg, "--size") == 0 && i + 1 < argc) {
+      JDIMENSION size _Checked[2];
+      if (!parse_numbers(argv[++i], 'x', size, 2)) {
+        usage();
+        return EXIT_FAILURE;
+      }
+      opts.target_width = size[0], opts.target_height = size[1];
+    } else if (strcmp(arg, "--resize") == 0 && i + 1 < argc) {
+      JDIMENSION size _Checked[2];
+      if (!parse_numbers(argv[++i], 'x', size, 2) || (size[0] == 0 && size[1] == 0)) {
+        usage();
+        return EXIT_FAILURE;
+      }
+      /* The IDCT gets as close as it can without going under. */
+      opts.target_width = size[0], opts.target_height = size[1];
+      opts.resize_width = size[0], opts.resize_height = size[1];
+    } else if (strcmp(arg, "--dct") == 0 && i + 1 < argc) {
+      if (!parse_dct_method(argv[++i], &opts.dct_method)) {
+        usage();
+        return EXIT_FAILURE;
+      }
+    } else if (strcmp(arg, "--nofancy") == 0) {
+      opts.fancy_upsampling = FALSE;
+    } else if (strcmp(arg, "--gray") == 0) {
+      opts.grayscale = TRUE;
+    } else if (strcmp(arg, "--crop") == 0 && i + 1 < argc) {
+      JDIMENSION region _Checked[4];
+      if (!parse_numbers(argv[++i], ',', region, 4)) {
+        usage();
+        return EXIT_FAILURE;
+      }
+      opts.crop = TRUE;
+      opts.crop_x = region[0], opts.crop_y = region[1];
+      opts.crop_width = region[2], opts.crop_height = region[3];
+    } else if (strcmp(arg, "--files-from") == 0 && i + 1 < argc) {
+      files_from = argv[++i];
+    } else if (strcmp(arg, "-o") == 0 && i + 1 < argc) {
+      output_template = argv[++i];
+    } else if ((strcmp(arg, "--jobs") == 0 || strcmp(arg, "-j") == 0) && i + 1 < argc) {
+      num_jobs = atoi(argv[++i]);
+      if (num_jobs < 0) {
+        usage();
+        return EXIT_FAILURE;
+      }
+    } else if (strcmp(arg, "--write-thread") == 0) {
+      write_thread = 1;
+    } else if (strcmp(arg, "--pipeline") == 0) {
+      pipeline = 1;
+    } else if (strcmp(arg, "--prefetch") == 0 && i + 1 < argc) {
+      prefetch_depth = atoi(argv[++i]);
+      if (prefetch_depth <= 0) {
+        usage();
+        return EXIT_FAILURE;
+      }
+    } else if (strcmp(arg, "--strips") == 0) {
+      opts.strips = TRUE;
+      opts.input = INPUT_MMAP;
+    } else if (strcmp(arg, "--stream") == 0) {
+      opts.stream = TRUE;
+    } else if (strcmp(arg, "--event-loop") == 0) {
+      event_loop = 1;
+    } else if (strcmp(arg, "--cache") == 0 && i + 1 < argc) {
+      opts.cache_dir = argv[++i];
+    } else if (strcmp(arg, "--cache-size") == 0 && i + 1 < argc) {
+      long long mb = atoll(argv[++i]);
+      if (mb <= 0) {
+        usage();
+        return EXIT_FAILURE;
+      }
+      opts.cache_budget = (unsigned long long) mb << 20;
+#ifdef TO_PPM_STATS
+    } else if (strcmp(arg, "--stats") == 0 && i + 1 < argc) {
+      if (!stats_open(argv[++i]))
+        return EXIT_FAILURE;
+#endif
+    } else if (arg[0] == '-' && arg[1] != '\0') {
+      usage();
+      return EXIT_FAILURE;
+    } else if (!input_list_add(&inputs, arg)) {
+      fprintf(stderr, "out of memory\n");
+      return EXIT_FAILURE;
+    }
+  }
+  if (files_from != NULL && !input_list_read(&inputs, files_from))
+    return EXIT_FAILURE;
+  if (inputs.count == 0) {
+    usage();
+    return EXIT_FAILURE;
+  }
+  if (opts.stream && (opts.crop || opts.strips)) {
+    fprintf(stderr, "--stream can't be combined with --crop or --strips\n");
+    return EXIT_FAILURE;
+  }
+  if (opts.grayscale && opts.format >= PROBE_INFO && opts.format != RAW_YUV) {
+    fprintf(stderr, "--gray can't be combined with --probe, --coefs or --dct-hash\n");
+    return EXIT_FAILURE;
+  }
+  /* The formats that don't go through a sink never crop, upsample or stream. */
+  if (opts.format >= PROBE_INFO && (opts.crop || !opts.fancy_upsampling || opts.stream)) {
+    fprintf(stderr, "--crop, --nofancy and --stream can't be combined with --probe, --coefs,\n"
+                    "--dct-hash or --yuv\n");
+    return EXIT_FAILURE;
+  }
+  if (opts.cache_dir != NULL) {
+    if (opts.stream || event_loop || opts.format == NULL_OUTPUT || opts.format >= PROBE_INFO) {
+      fprintf(stderr, "--cache only keeps plain conversions to pixels\n");
+      return EXIT_FAILURE;
+    }
+    if (strlen(opts.cache_dir) > CACHE_DIR_MAX) {
+      fprintf(stderr, "cache directory name too long\n");
+      return EXIT_FAILURE;
+    }
+  }
+  if (prefetch_depth > 0 && (opts.strips || opts.stream || event_loop || opts.cache_dir != NULL ||
+                             opts.format >= PROBE_INFO)) {
+    fprintf(stderr, "--prefetch only reads ahead for plain conversions\n");
+    return EXIT_FAILURE;
+  }
+  if (opts.keep_markers != 0 && opts.format != PROBE_INFO) {
+    fprintf(stderr, "--markers only applies to --probe\n");
+    return EXIT_FAILURE;
+  }
+  if ((opts.resize_width != 0 || opts.resize_height != 0) &&
+      (opts.crop || event_loop || opts.format >= PROBE_INFO)) {
+    fprintf(stderr, "--resize can't be combined with --crop, --event-loop or --probe\n");
+    return EXIT_FAILURE;
+  }
+  if (pipeline && (opts.strips || event_loop || opts.format >= PROBE_INFO)) {
+    fprintf(stderr, "--pipeline only applies to images converted one per worker\n");
+    return EXIT_FAILURE;
+  }
+  if (event_loop) {
+    if (opts.crop || opts.strips || opts.stream || opts.format >= PROBE_INFO) {
+      fprintf(stderr, "--event-loop only does plain conversions\n");
+      return EXIT_FAILURE;
+    }
+    if (inputs.count > 1 && output_template == NULL) {
+      fprintf(stderr, "--event-loop needs -o for more than one input\n");
+      return EXIT_FAILURE;
+    }
+  }
+
+  if (num_jobs == 0)
+    num_jobs = (int) sysconf(_SC_NPROCESSORS_ONLN);
+  /* Split images keep every worker busy however few of them there are. */
+  if (num_jobs > inputs.count && !opts.strips)
+    num_jobs = inputs.count;
+  if (num_jobs < 1)
+    num_jobs = 1;
+  if (num_jobs > 1 && output_template == NULL && !opts.strips &&
+      opts.format != PROBE_INFO && opts.format != DCT_HASH) {
+    fprintf(stderr, "--jobs needs -o: parallel images can't share stdout\n");
+    return EXIT_FAILURE;
+  }
+
+  struct batch batch = { &inputs, &opts, output_template, ((void *)0), 0, ((void *)0) };
+  _Array_ptr<struct pool_worker> workers : count(num_jobs) =
+    calloc<struct pool_worker>(num_jobs, sizeof(struct pool_worker));
+  _Array_ptr<_Ptr<struct pool_worker>> worker_ptrs : count(num_jobs) =
+    calloc<_Ptr<struct pool_worker>>(num_jobs, sizeof(_Ptr<struct pool_worker>));
+  if (workers == NULL || worker_ptrs == NULL) {
+    fprintf(stderr, "out of memory\n");
+    return EXIT_FAILURE;
+  }
+  for (int w = 0; w < num_jobs; w++) {
+    if (!decoder_init(&workers[w].dec)) {
+      fprintf(stderr, "can't create JPEG decompressor\n");
+      return EXIT_FAILURE;
+    }
+    /* The third stage of a pipeline is the writer's thread. */
+    workers[w].writer = writer_create(OUTPUT_BUFFER_SIZE, write_thread || pipeline);
+    if (workers[w].writer == NULL) {
+      fprintf(stderr, "out of memory\n");
+      return EXIT_FAILURE;
+    }
+    if (pipeline && (workers[w].pipeline = pipeline_create()) == NULL) {
+      fprintf(stderr, "can't start the pipeline's thread\n");
+      return EXIT_FAILURE;
+    }
+    workers[w].batch = &batch;
+    worker_ptrs[w] = &workers[w];
+  }
+  batch.workers = worker_ptrs, batch.num_workers = num_jobs;
+  /* Without io_uring the workers just read their own inputs. */
+  if (prefetch_depth > 0)
+    batch.prefetch = prefetch_create(&inputs, prefetch_depth);
+
+  /* With --strips the images go one at a time, each on all the workers. */
+  int failures = 0;
+  if (event_loop) {
+    failures = run_event_loop(&batch);
+  } else if (opts.strips && opts.format < PROBE_INFO) {
+    for (int job = 0; job < inputs.count; job++)
+      failures += !convert_job(worker_ptrs[0], job);
+  } else {
+    failures = pool_run(inputs.count, worker_ptrs, num_jobs, convert_job);
+  }
+  if (failures > 0)
+    fprintf(stderr, "%d of %d conversions failed\n", failures, inputs.count);
+
+  if (batch.prefetch != NULL)
+    prefetch_destroy(batch.prefetch);
+  for (int w = 0; w < num_jobs; w++) {
+    decoder_destroy(&workers[w].dec);
+    if (workers[w].pipeline != NULL)
+      pipeline_destroy(workers[w].pipeline);
+    writer_destroy(workers[w].writer);
+  }
+  free<_Ptr<struct pool_worker>>(worker_ptrs);
+  free<struct pool_worker>(workers);
+  input_list_free(&inputs);
+  return failures == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
 }
@@ -0,0 +1,338 @@
+/*
+ * writer.c
+ *
+ * Double-buffered output writer; see writer.h.
+ */
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+#include "writer.h"
+#pragma CHECKED_SCOPE on
+
+struct writer {
+  _Array_ptr<char> base : count(2 * size);	/* both buffers, back to back */
+  size_t size;			/* bytes per buffer */
+  int active;			/* the buffer being filled, 0 or 1 */
+  size_t used;			/* bytes queued in it so far */
+  size_t reserved;		/* bytes handed out by writer_reserve */
+  size_t queued;		/* bytes queued since writer_attach */
+  int fd;
+  int failed;			/* a write since writer_attach has failed */
+
+  /* The rest is only used with a background thread. */
+  int background;
+  pthread_t thread;
+  pthread_mutex_t lock;		/* protects everything below */
+  pthread_cond_t cond;		/* signalled when pending or stop changes */
+  size_t pending;		/* bytes of buffer pending_buf still to write */
+  int pending_buf;
+  int pending_fd;
+  int thread_failed;		/* the thread's write failed */
+  int stop;			/* writer_destroy wants the thread to exit */
+};
+
+
+/*
+ * Write first[0..first_len) and then second[0..second_len) to fd, retrying
+ * after short writes and signals.  Returns 1 on success, 0 on error.
+ */
+
+static int
+write_out (int fd, _Array_ptr<const char> first : count(first_len), size_t first_len,
+           _Array_ptr<const char> second : count(second_len), size_t second_len)
+{
+  size_t done = 0, total = first_len + second_len;
+
+  while (done < total) {
+    ssize_t k = -1;
+    _Unchecked {
+      struct iovec iov[2];
+      int iovcnt = 0;
+      size_t second_done = done > first_len ? done - first_len : 0;
+      if (done < first_len) {
+        iov[iovcnt].iov_base = (char *) first + done;
+        iov[iovcnt].iov_len = first_len - done;
+        iovcnt++;
+      }
+      if (second_len > 0) {
+        iov[iovcnt].iov_base = (char *) second + second_done;
+        iov[iovcnt].iov_len = second_len - second_done;
+        iovcnt++;
+      }
+      k = writev(fd, iov, iovcnt);
+    }
+    if (k < 0 && errno == EINTR)
+      continue;
+    if (k <= 0)
+      return 0;
+    done += (size_t) k;
+  }
+  return 1;
+}
+
+static void
+writer_lock (_Ptr<struct writer> w)
+{
+  _Unchecked { pthread_mutex_lock((pthread_mutex_t *) &w->lock); }
+}
+
+static void
+writer_unlock (_Ptr<struct writer> w)
+{
+  _Unchecked { pthread_mutex_unlock((pthread_mutex_t *) &w->lock); }
+}
+
+static void
+writer_wait (_Ptr<struct writer> w)
+{
+  _Unchecked {
+    pthread_cond_wait((pthread_cond_t *) &w->cond, (pthread_mutex_t *) &w->lock);
+  }
+}
+
+static void
+writer_signal (_Ptr<struct writer> w)
+{
+  _Unchecked { pthread_cond_broadcast((pthread_cond_t *) &w->cond); }
+}
+
+
+/* The background thread: write each buffer handed over until told to stop. */
+
+static void
+writer_work (_Ptr<struct writer> w)
+{
+  writer_lock(w);
+  for (;;) {
+    while (w->pending == 0 && !w->stop)
+      writer_wait(w);
+    if (w->pending == 0)
+      break;
+    size_t n = w->pending;
+    int fd = w->pending_fd;
+    _Array_ptr<const char> data : count(n) =
+      _Dynamic_bounds_cast<_Array_ptr<const char>>(w->base + w->pending_buf * w->size,
+                                                   count(n));
+    writer_unlock(w);
+    int ok = write_out(fd, data, n, ((void *)0), 0);
+    writer_lock(w);
+    if (!ok)
+      w->thread_failed = 1;
+    w->pending = 0;
+    writer_signal(w);
+  }
+  writer_unlock(w);
+}
+
+/* pthread_create wants an unchecked start routine. */
+#pragma CHECKED_SCOPE push
+#pragma CHECKED_SCOPE off
+
+static void *
+writer_thread_main (void *arg)
+{
+  writer_work(_Assume_bounds_cast<_Ptr<struct writer>>(arg));
+  return NULL;
+}
+
+#pragma CHECKED_SCOPE pop
+
+
+/* Wait for the background thread to finish the buffer it was given. */
+
+static void
+wait_idle (_Ptr<struct writer> w)
+{
+  if (!w->background)
+    return;
+  writer_lock(w);
+  while (w->pending != 0)
+    writer_wait(w);
+  if (w->thread_failed)
+    w->failed = 1, w->thread_failed = 0;
+  writer_unlock(w);
+}
+
+/* Send the active buffer on its way, leaving an empty buffer active. */
+
+static void
+flush_active (_Ptr<struct writer> w)
+{
+  size_t n = w->used;
+
+  w->used = 0;
+  if (n == 0 || w->failed)
+    return;
+  if (w->background) {
+    writer_lock(w);
+    while (w->pending != 0)
+      writer_wait(w);
+    w->pending_buf = w->active, w->pending_fd = w->fd, w->pending = n;
+    writer_signal(w);
+    writer_unlock(w);
+    w->active = 1 - w->active;
+  } else {
+    _Array_ptr<const char> data : count(n) =
+      _Dynamic_bounds_cast<_Array_ptr<const char>>(w->base + w->active * w->size, count(n));
+    if (!write_out(w->fd, data, n, ((void *)0), 0))
+      w->failed = 1;
+  }
+}
+
+/* The free part of the active buffer, n bytes of it. */
+
+static _Array_ptr<char>
+active_space (_Ptr<struct writer> w, size_t n) : count(n)
+{
+  return _Dynamic_bounds_cast<_Array_ptr<char>>(w->base + w->active * w->size + w->used,
+                                                count(n));
+}
+
+
+_Ptr<struct writer>
+writer_create (size_t size, int background)
+{
+  size_t page = (size_t) sysconf(_SC_PAGESIZE);
+  _Ptr<struct writer> w = calloc<struct writer>(1, sizeof(struct writer));
+
+  if (w == NULL)
+    return ((void *)0);
+  size = (size + page - 1) / page * page;
+  _Array_ptr<char> base : count(2 * size) = ((void *)0);
+  _Unchecked {
+    void *mem = NULL;
+    if (posix_memalign(&mem, page, 2 * size) == 0)
+      base = _Assume_bounds_cast<_Array_ptr<char>>(mem, count(2 * size));
+  }
+  if (base == NULL) {
+    free<struct writer>(w);
+    return ((void *)0);
+  }
+  w->base = base, w->size = size;
+  w->fd = -1;
+
+  if (background) {
+    _Unchecked {
+      pthread_mutex_init((pthread_mutex_t *) &w->lock, NULL);
+      pthread_cond_init((pthread_cond_t *) &w->cond, NULL);
+      w->background = pthread_create((pthread_t *) &w->thread, NULL,
+                                     writer_thread_main, (void *) w) == 0;
+    }
+    /* Without the thread, everything still works, just synchronously. */
+    if (!w->background) {
+      _Unchecked {
+        pthread_cond_destroy((pthread_cond_t *) &w->cond);
+        pthread_mutex_destroy((pthread_mutex_t *) &w->lock);
+      }
+    }
+  }
+  return w;
+}
+
+void
+writer_destroy (_Ptr<struct writer> w)
+{
+  if (w->background) {
+    writer_lock(w);
+    w->stop = 1;
+    writer_signal(w);
+    writer_unlock(w);
+    _Unchecked {
+      pthread_join(w->thread, NULL);
+      pthread_cond_destroy((pthread_cond_t *) &w->cond);
+      pthread_mutex_destroy((pthread_mutex_t *) &w->lock);
+    }
+  }
+  free<char>(w->base);
+  free<struct writer>(w);
+}
+
+size_t
+writer_buffer_size (_Ptr<struct writer> w)
+{
+  return w->size;
+}
+
+size_t
+writer_queued (_Ptr<struct writer> w)
+{
+  return w->queued;
+}
+
+void
+writer_attach (_Ptr<struct writer> w, int fd)
+{
+  wait_idle(w);
+  w->fd = fd;
+  w->used = 0, w->reserved = 0;
+  w->queued = 0;
+  w->failed = 0;
+}
+
+int
+writer_write (_Ptr<struct writer> w, _Array_ptr<const char> data : count(n), size_t n)
+{
+  if (w->failed)
+    return 0;
+  w->queued += n;
+
+  /* Too big to be worth copying: send it along with what is buffered. */
+  if (n >= w->size) {
+    wait_idle(w);
+    _Array_ptr<const char> buffered : count(w->used) =
+      _Dynamic_bounds_cast<_Array_ptr<const char>>(w->base + w->active * w->size,
+                                                   count(w->used));
+    if (!w->failed && !write_out(w->fd, buffered, w->used, data, n))
+      w->failed = 1;
+    w->used = 0;
+    return !w->failed;
+  }
+
+  /* Top up the active buffer, so full buffers go out whole. */
+  size_t room = w->size - w->used;
+  size_t part = n < room ? n : room;
+  memcpy(active_space(w, part), data, part);
+  w->used += part;
+  if (part < n) {
+    flush_active(w);
+    memcpy(active_space(w, n - part),
+           _Dynamic_bounds_cast<_Array_ptr<const char>>(data + part, count(n - part)),
+           n - part);
+    w->used += n - part;
+  }
+  return !w->failed;
+}
+
+_Array_ptr<char>
+writer_reserve (_Ptr<struct writer> w, size_t n) : count(n)
+{
+  if (n > w->size)
+    return ((void *)0);
+  if (n > w->size - w->used)
+    flush_active(w);
+  w->reserved = n;
+  return active_space(w, n);
+}
+
+void
+writer_commit (_Ptr<struct writer> w, size_t n)
+{
+  if (n > w->reserved)
+    n = w->reserved;
+  w->used += n;
+  w->queued += n;
+  w->reserved = 0;
+}
+
+int
+writer_flush (_Ptr<struct writer> w)
+{
+  flush_active(w);
+  wait_idle(w);
+  return !w->failed;
+}
@@ -0,0 +1,59 @@
+/*
+ * writer.h
+ *
+ * A buffered output writer that goes straight to write(2), bypassing stdio.
+ *
+ * The writer owns two large page-aligned buffers.  Output is gathered in one
+ * of them until it fills, then the whole buffer goes out in a single write;
+ * writes larger than a buffer are passed to writev together with whatever is
+ * already buffered, so they are never copied.  With a background thread, a
+ * full buffer is handed to the thread and filling continues in the other
+ * one, so decoding and output I/O overlap.
+ *
+ * A writer is created once and then attached to one file descriptor after
+ * another, so a batch reuses the same buffers (and thread) for every image.
+ * Errors are sticky until the next writer_attach: once a write has failed,
+ * everything up to the next writer_flush is dropped and the flush fails.
+ */
+
+#ifndef WRITER_H
+#define WRITER_H
+
+struct writer;
+
+/* Create a writer with two buffers of at least size bytes each (rounded up
+ * to whole pages).  If background is nonzero, full buffers are written by a
+ * thread of the writer's own.  Returns NULL if out of memory.
+ */
+extern _Ptr<struct writer> writer_create(size_t size, int background);
+extern void writer_destroy(_Ptr<struct writer> w);
+
+/* The size of each buffer, which bounds writer_reserve. */
+extern size_t writer_buffer_size(_Ptr<struct writer> w);
+
+/* Send all further output to fd, and clear any error.  Call
+ * writer_flush before attaching another descriptor; the writer never closes
+ * fd itself.
+ */
+extern void writer_attach(_Ptr<struct writer> w, int fd);
+
+/* Queue n bytes.  Returns 1 on success, 0 if a write has failed. */
+extern int writer_write(_Ptr<struct writer> w, _Array_ptr<const char> data : count(n),
+                        size_t n);
+
+/* Return the next n bytes of buffer space, n at most writer_buffer_size,
+ * for the caller to fill in place and then pass to writer_commit.
+ */
+extern _Array_ptr<char> writer_reserve(_Ptr<struct writer> w, size_t n) : count(n);
+/* Queue the first n bytes of the space last reserved. */
+extern void writer_commit(_Ptr<struct writer> w, size_t n);
+
+/* Write out everything queued and wait for it.  Returns 1 if everything
+ * since writer_attach was written, 0 if not.
+ */
+extern int writer_flush(_Ptr<struct writer> w);
+
+/* Bytes queued since writer_attach, whether or not written yet. */
+extern size_t writer_queued(_Ptr<struct writer> w);
+
+#endif /* WRITER_H */
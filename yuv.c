@@ -0,0 +1,147 @@
+/*
+ * yuv.c
+ *
+ * Raw planar output of the coded components; see yuv.h.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <setjmp.h>
+
+#define HAVE_PROTOTYPES
+#include <jpeglib.h>
+
+#include "decoder.h"
+#include "yuv.h"
+#include "writer.h"
+#pragma CHECKED_SCOPE on
+
+/* One component's share of the buffers. */
+struct yuv_plane {
+  /* The samples of one iMCU row, height rows of stride bytes, that
+   * jpeg_read_raw_data fills in.
+   */
+  JSAMPROW strip : count(strip_size);
+  size_t strip_size;
+  JDIMENSION stride, height;
+  /* The component's size in the output. */
+  JDIMENSION width, rows;
+  /* All of the plane, for the components written after the first. */
+  JSAMPROW plane : count(plane_size);
+  size_t plane_size;
+};
+
+/* Allocate n bytes from the image pool, so that they go away with the
+ * decompression whether it finishes or not.
+ */
+
+static JSAMPROW
+alloc_samples (j_decompress_ptr cinfo, size_t n) : count(n)
+{
+  JSAMPROW samples : count(n) = ((void *)0);
+
+  _Unchecked {
+    samples = _Assume_bounds_cast<JSAMPROW>((*cinfo->mem->alloc_large)
+		((_Ptr<struct jpeg_common_struct>) cinfo, JPOOL_IMAGE, n),
+		count(n));
+  }
+  return samples;
+}
+
+/* The array of row pointers into p's strip, for jpeg_read_raw_data. */
+
+static JSAMPARRAY
+strip_rows (j_decompress_ptr cinfo, _Ptr<struct yuv_plane> p)
+{
+  JSAMPARRAY rows : count(p->height) = ((void *)0);
+
+  _Unchecked {
+    rows = _Assume_bounds_cast<JSAMPARRAY>((*cinfo->mem->alloc_small)
+		((_Ptr<struct jpeg_common_struct>) cinfo, JPOOL_IMAGE,
+		 p->height * sizeof(JSAMPROW)),
+		count(p->height));
+  }
+  for (JDIMENSION r = 0; r < p->height; r++)
+    rows[r] = p->strip + (size_t) r * p->stride;
+  return rows;
+}
+
+
+int
+yuv_write (j_decompress_ptr cinfo, _Ptr<struct writer> out, boolean luma_only)
+{
+  struct yuv_plane planes _Checked[MAX_COMPONENTS] = {};
+  JSAMPARRAY image _Checked[MAX_COMPONENTS] = {};
+  int n = cinfo->num_components;
+  /* The library still decodes every component, but only these are kept. */
+  int kept = luma_only ? 1 : n;
+
+  /* Color conversion doesn't run at all, so out_color_space only matters
+   * to anyone looking at the decompressor: say what we are really giving.
+   */
+  cinfo->raw_data_out = TRUE;
+  cinfo->out_color_space = cinfo->jpeg_color_space;
+  (void) jpeg_start_decompress(cinfo);
+
+  /* Each call to jpeg_read_raw_data returns one iMCU row: v_samp_factor
+   * blocks of each component, DCT_h_scaled_size samples wide and
+   * DCT_v_scaled_size high (before jpeg 7, DCT_scaled_size both ways) when
+   * the IDCT is scaling.  The library writes whole blocks, so the strips cover
+   * width_in_blocks of them even where the image ends partway through.
+   */
+  for (int c = 0; c < n; c++) {
+    jpeg_component_info comp = cinfo->comp_info[c];
+    _Ptr<struct yuv_plane> p = &planes[c];
+#if JPEG_LIB_VERSION >= 70
+    p->stride = comp.width_in_blocks * comp.DCT_h_scaled_size;
+    p->height = comp.v_samp_factor * comp.DCT_v_scaled_size;
+#else
+    p->stride = comp.width_in_blocks * comp.DCT_scaled_size;
+    p->height = comp.v_samp_factor * comp.DCT_scaled_size;
+#endif
+    p->width = comp.downsampled_width;
+    p->rows = comp.downsampled_height;
+    size_t strip_size = (size_t) p->stride * p->height;
+    p->strip = alloc_samples(cinfo, strip_size), p->strip_size = strip_size;
+    image[c] = strip_rows(cinfo, p);
+    if (c > 0 && c < kept) {
+      size_t plane_size = (size_t) p->width * p->rows;
+      p->plane = alloc_samples(cinfo, plane_size), p->plane_size = plane_size;
+    }
+  }
+
+  /* The first plane goes straight out as it is decoded; the others have to
+   * wait for it, so they are gathered whole.
+   */
+  JDIMENSION lines = imcu_output_rows(cinfo);
+  int ok = 1;
+  for (JDIMENSION imcu_row = 0; cinfo->output_scanline < cinfo->output_height; imcu_row++) {
+    if (jpeg_read_raw_data(cinfo, image, lines) == 0)
+      break;		/* can't happen: our sources don't suspend */
+    for (int c = 0; c < n; c++) {
+      _Ptr<struct yuv_plane> p = &planes[c];
+      JDIMENSION first = imcu_row * p->height;
+      for (JDIMENSION r = 0; r < p->height && first + r < p->rows; r++) {
+        JSAMPROW row : count(p->width) =
+          _Dynamic_bounds_cast<JSAMPROW>(p->strip + (size_t) r * p->stride, count(p->width));
+        if (c == 0) {
+          if (ok)
+            ok = writer_write(out, _Dynamic_bounds_cast<_Array_ptr<const char>>
+					(row, count(p->width)),
+                              p->width);
+        } else if (c < kept) {
+          memcpy(_Dynamic_bounds_cast<JSAMPROW>(p->plane + (size_t) (first + r) * p->width,
+                                                count(p->width)),
+                 row, p->width);
+        }
+      }
+    }
+  }
+
+  for (int c = 1; ok && c < kept; c++)
+    ok = writer_write(out, _Dynamic_bounds_cast<_Array_ptr<const char>>
+				(planes[c].plane, count(planes[c].plane_size)),
+                      planes[c].plane_size);
+  return ok;
+}
@@ -0,0 +1,39 @@
+/*
+ * yuv.h
+ *
+ * Writing an image's components as they are coded, without upsampling or
+ * color conversion.
+ *
+ * With raw_data_out set, jpeg_read_raw_data hands back the output of the
+ * IDCT directly: each component at its own subsampled resolution, in the
+ * JPEG's own color space.  For the usual YCbCr 4:2:0 file that is the
+ * planar I420 layout video encoders take, at half the size of the RGB
+ * image, and the decoder skips its two most expensive stages after the
+ * IDCT.
+ *
+ * Include <stdio.h> and <jpeglib.h> before this file.
+ */
+
+#ifndef YUV_H
+#define YUV_H
+
+struct writer;			/* see writer.h */
+
+/* Decode the image and write its components to out as headerless planes,
+ * one after another in component order (Y, Cb, Cr for a YCbCr file).  Each
+ * plane is the component's downsampled_width bytes by downsampled_height
+ * rows; for 4:2:0 the chroma planes are half the width and height of the
+ * luma, rounded up.  When the IDCT is scaling the image down, the library
+ * scales the chroma less where it can, so the planes may come out closer
+ * in size, or all the same size, than the sampling factors suggest.
+ * Called on a decompressor whose header has been read
+ * and whose scaling and IDCT parameters are set; this starts the
+ * decompression itself.  Errors in the JPEG data go to cinfo's error
+ * manager as usual, and the caller must still finish or abort the
+ * decompression afterwards.  With luma_only, only the first plane is
+ * written, which is the luma of a YCbCr or grayscale file.  Returns 1 on
+ * success, 0 if writing failed.
+ */
+extern int yuv_write(j_decompress_ptr cinfo, _Ptr<struct writer> out, boolean luma_only);
+
+#endif /* YUV_H */